@@ -1,36 +1,573 @@
+#include <linux/cgroup.h>
+#include <linux/cpumask.h>
+#include <linux/cred.h>
+#include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/percpu.h>
+#include <linux/pid.h>
+#include <linux/pid_namespace.h>
 #include <linux/printk.h>
 #include <linux/proc_fs.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
 #include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/threads.h>
+#include <linux/tracepoint.h>
+#include <linux/user_namespace.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 static struct proc_dir_entry *proc_entry;
+static struct proc_dir_entry *stats_entry;
+static struct proc_dir_entry *list_entry;
+static struct proc_dir_entry *events_entry;
 
-static int proc_count_show(struct seq_file *m, void *v) {
+// Walking every task on each read is O(tasks). The incremental count is kept
+// up to date by fork and free tracepoints instead, so reads don't depend on
+// the number of tasks.
+static bool incremental;
+module_param(incremental, bool, 0644);
+MODULE_PARM_DESC(incremental,
+                 "Report a count maintained on fork and free instead of "
+                 "walking every task on each read");
+
+static unsigned int top_threads = 10;
+module_param(top_threads, uint, 0644);
+MODULE_PARM_DESC(top_threads,
+                 "Number of processes with the most threads listed in "
+                 "/proc/count_stats");
+
+#define MAX_TOP_THREADS 64
+// Distinct cgroups tracked per read, the rest are summed as "other"
+#define CGROUP_HASH_BITS 8
+#define MAX_CGROUPS (1 << CGROUP_HASH_BITS)
+// Number of distinct `task_state_index` values
+#define TASK_STATE_COUNT (ilog2(TASK_REPORT_MAX) + 1)
+
+static unsigned int sample_ms = 100;
+module_param(sample_ms, uint, 0444);
+MODULE_PARM_DESC(sample_ms,
+                 "Milliseconds between samples in the /proc/count_events ring");
+
+#define EVENT_RING_BYTES (64 * 1024)
+#define SEED_ATTEMPTS 8
+
+// Each CPU only ever bumps its own counters, so forks and frees never contend
+// with each other or with readers. Readers sum over every CPU.
+static DEFINE_PER_CPU(unsigned long, fork_counts);
+static DEFINE_PER_CPU(unsigned long, free_counts);
+// Processes that existed when the module was loaded
+static long initial_count;
+// Whether the walk that found them saw no forks or frees, so the incremental
+// count is exact. Nothing corrects it later if it didn't.
+static bool seed_settled;
+
+// Layout of /proc/count_events, which can be read or mapped read-only.
+// Counters are totals since the module was loaded, so a rate between any two
+// samples is exact even if a storm started and ended between them.
+struct count_sample {
+  // Index of the sample, written last. Anything else means the slot is being
+  // overwritten and the reader should retry.
+  u64 seq;
+  u64 timestamp_ns;  // CLOCK_MONOTONIC
+  u64 forks;
+  u64 frees;
+  u64 processes;
+};
+
+struct count_ring {
+  u64 head;  // Samples ever written. Sample `i` is in slot `i % capacity`.
+  u32 capacity;
+  u32 sample_size;
+  u64 interval_ns;
+  struct count_sample samples[];
+};
+
+static struct count_ring *event_ring;
+static struct delayed_work sample_work;
+
+static struct tracepoint *fork_tracepoint;
+static struct tracepoint *free_tracepoint;
+
+static int count_processes(void) {
   int proc_count = 0;
 
   struct task_struct *task;
 
+  rcu_read_lock();
   for_each_process(task) { proc_count++; }
+  rcu_read_unlock();
+
+  return proc_count;
+}
+
+// Only thread group leaders are on the process list. Freeing is used instead
+// of exiting because zombies are still listed until they are reaped.
+static void probe_process_fork(void *data, struct task_struct *parent,
+                               struct task_struct *child) {
+  if (thread_group_leader(child)) {
+    this_cpu_inc(fork_counts);
+  }
+}
+
+static void probe_process_free(void *data, struct task_struct *task) {
+  if (thread_group_leader(task)) {
+    this_cpu_inc(free_counts);
+  }
+}
+
+static unsigned long sum_counts(unsigned long __percpu *counts) {
+  unsigned long sum = 0;
+  int cpu;
+
+  for_each_possible_cpu(cpu) { sum += *per_cpu_ptr(counts, cpu); }
+  return sum;
+}
+
+// The probes are registered before this walk, so a process created or freed
+// while it runs can be seen by the walk and a probe, or by only a probe, which
+// would leave the count off in either direction. The walk is retried until no
+// probe fired during it, and probes that fired before it are taken back out.
+// What is left is a process between being listed and its probe firing, which
+// lasts no longer than a fork or an RCU grace period. If every attempt races,
+// the last one is used and the count is reported as approximate.
+static long seed_initial_count(void) {
+  unsigned long forks;
+  unsigned long frees;
+  long walked;
+  int attempt = 0;
+
+  do {
+    forks = sum_counts(&fork_counts);
+    frees = sum_counts(&free_counts);
+    walked = count_processes();
+    seed_settled = sum_counts(&fork_counts) == forks &&
+                   sum_counts(&free_counts) == frees;
+  } while (!seed_settled && ++attempt < SEED_ATTEMPTS);
+
+  if (!seed_settled) {
+    pr_warn("proc_count: processes kept forking while counted, the "
+            "incremental count is approximate\n");
+  }
+  return walked - (long)(forks - frees);
+}
+
+static long incremental_count(unsigned long forks, unsigned long frees) {
+  return initial_count + (long)(forks - frees);
+}
+
+static void record_sample(struct work_struct *work) {
+  u64 index = event_ring->head;
+  struct count_sample *sample =
+      &event_ring->samples[index % event_ring->capacity];
+
+  WRITE_ONCE(sample->seq, U64_MAX);
+  smp_wmb();
+
+  sample->timestamp_ns = ktime_get_ns();
+  sample->forks = sum_counts(&fork_counts);
+  sample->frees = sum_counts(&free_counts);
+  sample->processes = incremental_count(sample->forks, sample->frees);
+
+  smp_wmb();
+  WRITE_ONCE(sample->seq, index);
+  smp_store_release(&event_ring->head, index + 1);
+
+  schedule_delayed_work(&sample_work, msecs_to_jiffies(max(sample_ms, 1U)));
+}
+
+static ssize_t count_events_read(struct file *file, char __user *buf,
+                                 size_t count, loff_t *ppos) {
+  return simple_read_from_buffer(buf, count, ppos, event_ring,
+                                 EVENT_RING_BYTES);
+}
+
+static int count_events_mmap(struct file *file, struct vm_area_struct *vma) {
+  if (vma->vm_flags & VM_WRITE) {
+    return -EPERM;
+  }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+  vm_flags_clear(vma, VM_MAYWRITE);
+#else
+  vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+  return remap_vmalloc_range(vma, event_ring, vma->vm_pgoff);
+}
+
+static const struct proc_ops count_events_ops = {
+    .proc_read = count_events_read,
+    .proc_lseek = default_llseek,
+    .proc_mmap = count_events_mmap,
+};
+
+// Tracepoints aren't exported by name, so they have to be looked up
+static void find_tracepoint(struct tracepoint *tracepoint, void *priv) {
+  if (strcmp(tracepoint->name, "sched_process_fork") == 0) {
+    fork_tracepoint = tracepoint;
+  } else if (strcmp(tracepoint->name, "sched_process_free") == 0) {
+    free_tracepoint = tracepoint;
+  }
+}
+
+static int proc_count_show(struct seq_file *m, void *v) {
+  long proc_count = incremental ? incremental_count(sum_counts(&fork_counts),
+                                                  sum_counts(&free_counts))
+                                : count_processes();
+
+  seq_printf(m, "%ld\n", proc_count);
+  return 0;
+}
+
+struct thread_leader {
+  pid_t pid;
+  int threads;
+  char comm[TASK_COMM_LEN];
+};
+
+struct cgroup_count {
+  u64 id;
+  unsigned long processes;
+};
+
+struct count_stats {
+  unsigned long processes;
+  unsigned long threads;
+  unsigned long states[TASK_STATE_COUNT];  // By `task_state_index`
+
+  unsigned long *runnable;  // Indexed by CPU
+
+  struct thread_leader top[MAX_TOP_THREADS];
+  unsigned int top_count;
+  unsigned int top_capacity;
+
+  struct cgroup_count cgroups[MAX_CGROUPS];
+  unsigned long other_cgroups;
+};
+
+// Keeps `top` sorted by descending thread count
+static void add_thread_leader(struct count_stats *stats,
+                              struct task_struct *task) {
+  int threads = get_nr_threads(task);
+  unsigned int i;
+
+  if (stats->top_capacity == 0 ||
+      (stats->top_count == stats->top_capacity &&
+       threads <= stats->top[stats->top_count - 1].threads)) {
+    return;
+  }
+
+  if (stats->top_count < stats->top_capacity) {
+    stats->top_count++;
+  }
+  for (i = stats->top_count - 1; i > 0 && stats->top[i - 1].threads < threads;
+       i--) {
+    stats->top[i] = stats->top[i - 1];
+  }
+
+  stats->top[i].pid = task_tgid_nr(task);
+  stats->top[i].threads = threads;
+  get_task_comm(stats->top[i].comm, task);
+}
+
+// Open addressing on the cgroup ID, which is unique for the cgroup's lifetime
+static void add_cgroup(struct count_stats *stats, struct task_struct *task) {
+#ifdef CONFIG_CGROUPS
+  u64 id = cgroup_id(task_dfl_cgroup(task));
+  unsigned int slot = hash_64(id, CGROUP_HASH_BITS);
+  unsigned int probes;
+
+  for (probes = 0; probes < MAX_CGROUPS; probes++) {
+    struct cgroup_count *cgroup = &stats->cgroups[slot];
+    if (cgroup->processes == 0) {
+      cgroup->id = id;
+    }
+    if (cgroup->id == id) {
+      cgroup->processes++;
+      return;
+    }
+    slot = (slot + 1) % MAX_CGROUPS;
+  }
+#endif
+  stats->other_cgroups++;
+}
+
+// Gathers everything in one walk, so the task list is only traversed once per
+// read no matter how many breakdowns are reported
+static void collect_stats(struct count_stats *stats) {
+  struct task_struct *process;
+  struct task_struct *thread;
 
-  seq_printf(m, "%d\n", proc_count);
+  rcu_read_lock();
+  for_each_process(process) {
+    stats->processes++;
+    add_thread_leader(stats, process);
+    add_cgroup(stats, process);
+
+    for_each_thread(process, thread) {
+      unsigned int state = task_state_index(thread);
+
+      stats->threads++;
+      stats->states[state]++;
+      if (task_index_to_char(state) == 'R') {
+        stats->runnable[task_cpu(thread)]++;
+      }
+    }
+  }
+  rcu_read_unlock();
+}
+
+// One `key value...` line per breakdown, with `name=count` pairs where a
+// breakdown has several values
+static int proc_count_stats_show(struct seq_file *m, void *v) {
+  struct count_stats *stats;
+  unsigned int i;
+  int cpu;
+
+  stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+  if (!stats) {
+    return -ENOMEM;
+  }
+  stats->runnable = kcalloc(nr_cpu_ids, sizeof(unsigned long), GFP_KERNEL);
+  if (!stats->runnable) {
+    kfree(stats);
+    return -ENOMEM;
+  }
+  stats->top_capacity = min_t(unsigned int, top_threads, MAX_TOP_THREADS);
+
+  collect_stats(stats);
+
+  seq_printf(m, "processes %lu\nthreads %lu\n", stats->processes,
+             stats->threads);
+  seq_printf(m, "events forks=%lu frees=%lu seed=%s\nstate",
+             sum_counts(&fork_counts), sum_counts(&free_counts),
+             seed_settled ? "exact" : "approximate");
+  for (i = 0; i < ARRAY_SIZE(stats->states); i++) {
+    seq_printf(m, " %c=%lu", task_index_to_char(i), stats->states[i]);
+  }
+
+  seq_puts(m, "\nrunnable");
+  for_each_possible_cpu(cpu) {
+    seq_printf(m, " %d=%lu", cpu, stats->runnable[cpu]);
+  }
+
+  seq_puts(m, "\ncgroup");
+  for (i = 0; i < MAX_CGROUPS; i++) {
+    if (stats->cgroups[i].processes) {
+      seq_printf(m, " %llu=%lu", stats->cgroups[i].id,
+                 stats->cgroups[i].processes);
+    }
+  }
+  seq_printf(m, " other=%lu\n", stats->other_cgroups);
+
+  for (i = 0; i < stats->top_count; i++) {
+    seq_printf(m, "top %d=%d ", stats->top[i].pid, stats->top[i].threads);
+    seq_escape(m, stats->top[i].comm, " \t\n\\");
+    seq_putc(m, '\n');
+  }
+
+  kfree(stats->runnable);
+  kfree(stats);
   return 0;
 }
 
+// /proc/count_list has one line per process and is produced a buffer at a
+// time, so a listing of any size only needs a page or so of kernel memory.
+// The position is the next TGID to look at, which lets a read resume where
+// the last one stopped however many processes came and went in between.
+// Each step looks the process up under RCU and keeps a reference instead,
+// so RCU is never held from one step to the next or across the copy out.
+static struct task_struct *find_process(loff_t *pos) {
+  struct task_struct *task = NULL;
+  struct pid *pid;
+  int nr;
+
+  if (*pos > PID_MAX_LIMIT) {
+    return NULL;
+  }
+  nr = *pos;
+
+  rcu_read_lock();
+  while ((pid = find_ge_pid(nr, &init_pid_ns))) {
+    nr = pid_nr(pid);
+    // Only thread group leaders have a TGID of their own
+    task = pid_task(pid, PIDTYPE_TGID);
+    if (task) {
+      get_task_struct(task);
+      break;
+    }
+    nr++;
+  }
+  rcu_read_unlock();
+
+  *pos = nr;
+  return task;
+}
+
+static void *count_list_start(struct seq_file *m, loff_t *pos) {
+  if (*pos == 0) {
+    return SEQ_START_TOKEN;
+  }
+  return find_process(pos);
+}
+
+static void *count_list_next(struct seq_file *m, void *v, loff_t *pos) {
+  if (v != SEQ_START_TOKEN) {
+    put_task_struct(v);
+  }
+  ++*pos;
+  return find_process(pos);
+}
+
+// Also gets the process that didn't fit when a read fills its buffer
+static void count_list_stop(struct seq_file *m, void *v) {
+  if (v && v != SEQ_START_TOKEN) {
+    put_task_struct(v);
+  }
+}
+
+static int count_list_show(struct seq_file *m, void *v) {
+  struct task_struct *task = v;
+  char comm[TASK_COMM_LEN];
+  pid_t ppid = 0;
+  uid_t uid;
+
+  if (v == SEQ_START_TOKEN) {
+    seq_puts(m, "pid ppid uid state threads comm\n");
+    return 0;
+  }
+
+  // The parent and credentials can be replaced at any time
+  rcu_read_lock();
+  if (pid_alive(task)) {
+    ppid = task_tgid_nr(rcu_dereference(task->real_parent));
+  }
+  uid = from_kuid_munged(&init_user_ns, task_uid(task));
+  rcu_read_unlock();
+  get_task_comm(comm, task);
+
+  seq_printf(m, "%d %d %u %c %d ", task_tgid_nr(task), ppid, uid,
+             task_index_to_char(task_state_index(task)),
+             get_nr_threads(task));
+  seq_escape(m, comm, " \t\n\\");
+  seq_putc(m, '\n');
+  return 0;
+}
+
+static const struct seq_operations count_list_ops = {
+    .start = count_list_start,
+    .next = count_list_next,
+    .stop = count_list_stop,
+    .show = count_list_show,
+};
+
 static int __init proc_count_init(void) {
+  int error;
+
   pr_info("proc_count: init\n");
+
+  for_each_kernel_tracepoint(find_tracepoint, NULL);
+  if (!fork_tracepoint || !free_tracepoint) {
+    pr_err("proc_count: sched tracepoints not found\n");
+    return -ENOENT;
+  }
+
+  error = tracepoint_probe_register(fork_tracepoint, probe_process_fork, NULL);
+  if (error) {
+    return error;
+  }
+  error = tracepoint_probe_register(free_tracepoint, probe_process_free, NULL);
+  if (error) {
+    goto unregister_fork;
+  }
+
+  initial_count = seed_initial_count();
+
   proc_entry = proc_create_single("count", 0, NULL, proc_count_show);
 
   if (!proc_entry) {
-    return -ENOMEM;
+    error = -ENOMEM;
+    goto unregister_free;
+  }
+
+  stats_entry =
+      proc_create_single("count_stats", 0, NULL, proc_count_stats_show);
+
+  if (!stats_entry) {
+    error = -ENOMEM;
+    goto remove_count;
   }
 
+  list_entry = proc_create_seq("count_list", 0, NULL, &count_list_ops);
+
+  if (!list_entry) {
+    error = -ENOMEM;
+    goto remove_stats;
+  }
+
+  // Zeroed and safe to map into userspace
+  event_ring = vmalloc_user(EVENT_RING_BYTES);
+  if (!event_ring) {
+    error = -ENOMEM;
+    goto remove_list;
+  }
+  event_ring->capacity = (EVENT_RING_BYTES - sizeof(struct count_ring)) /
+                         sizeof(struct count_sample);
+  event_ring->sample_size = sizeof(struct count_sample);
+  event_ring->interval_ns = (u64)sample_ms * NSEC_PER_MSEC;
+
+  events_entry = proc_create("count_events", 0444, NULL, &count_events_ops);
+
+  if (!events_entry) {
+    error = -ENOMEM;
+    goto free_ring;
+  }
+  proc_set_size(events_entry, EVENT_RING_BYTES);
+
+  INIT_DELAYED_WORK(&sample_work, record_sample);
+  schedule_delayed_work(&sample_work, 0);
+
   return 0;
+
+free_ring:
+  vfree(event_ring);
+remove_list:
+  proc_remove(list_entry);
+remove_stats:
+  proc_remove(stats_entry);
+remove_count:
+  proc_remove(proc_entry);
+unregister_free:
+  tracepoint_probe_unregister(free_tracepoint, probe_process_free, NULL);
+unregister_fork:
+  tracepoint_probe_unregister(fork_tracepoint, probe_process_fork, NULL);
+  tracepoint_synchronize_unregister();
+  return error;
 }
 
 static void __exit proc_count_exit(void) {
   pr_info("proc_count: exit\n");
+  proc_remove(events_entry);
+  cancel_delayed_work_sync(&sample_work);
+  vfree(event_ring);
+  proc_remove(list_entry);
+  proc_remove(stats_entry);
   proc_remove(proc_entry);
+
+  tracepoint_probe_unregister(free_tracepoint, probe_process_free, NULL);
+  tracepoint_probe_unregister(fork_tracepoint, probe_process_fork, NULL);
+  // No probe may still be running once the module's code is gone
+  tracepoint_synchronize_unregister();
 }
 
 module_init(proc_count_init);
@@ -0,0 +1,167 @@
+// Compares /proc/count read latency between the walking and incremental modes
+// as the number of processes grows, along with the time to read the whole of
+// /proc/count_list. Needs root to switch modes, and a high enough `pid_max`
+// and `ulimit -u` for the largest scale.
+//
+// Build with `cc -O2 -o proc_count_bench proc_count_bench.c`.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define COUNT_PATH "/proc/count"
+#define LIST_PATH "/proc/count_list"
+#define MODE_PATH "/sys/module/proc_count/parameters/incremental"
+#define READS_PER_MODE 1000
+// Each read of the listing is a full pass over every process
+#define LIST_READS 20
+#define LIST_BUFFER_SIZE 4096
+
+static const long SCALES[] = {1000, 10000, 100000};
+
+#define errno_exit(str) \
+  do {                  \
+    int err = errno;    \
+    perror(str);        \
+    exit(err);          \
+  } while (0)
+
+static long read_count(void) {
+  char buf[32] = {0};
+
+  int fd = open(COUNT_PATH, O_RDONLY);
+  if (fd == -1) {
+    errno_exit("open");
+  }
+  if (read(fd, buf, sizeof(buf) - 1) == -1) {
+    errno_exit("read");
+  }
+  close(fd);
+
+  return strtol(buf, NULL, 10);
+}
+
+// Reads a page at a time like `cat`, so the module resumes the listing on
+// every call. Returns the number of lines.
+static long read_list(void) {
+  static char buf[LIST_BUFFER_SIZE];
+  long lines = 0;
+  ssize_t n;
+
+  int fd = open(LIST_PATH, O_RDONLY);
+  if (fd == -1) {
+    errno_exit("open");
+  }
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (ssize_t i = 0; i < n; i++) {
+      lines += buf[i] == '\n';
+    }
+  }
+  if (n == -1) {
+    errno_exit("read");
+  }
+  close(fd);
+
+  return lines;
+}
+
+static void set_incremental(int enabled) {
+  int fd = open(MODE_PATH, O_WRONLY);
+  if (fd == -1) {
+    errno_exit("open");
+  }
+  const char *value = enabled ? "Y" : "N";
+  if (write(fd, value, 1) != 1) {
+    errno_exit("write");
+  }
+  close(fd);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    errno_exit("clock_gettime");
+  }
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *left, const void *right) {
+  uint64_t l = *(const uint64_t *)left;
+  uint64_t r = *(const uint64_t *)right;
+  return (l > r) - (l < r);
+}
+
+static void measure(const char *mode, long processes, long (*read_fn)(void),
+                    int reads) {
+  uint64_t samples[READS_PER_MODE];
+
+  for (int i = 0; i < reads; i++) {
+    uint64_t start = now_ns();
+    read_fn();
+    samples[i] = now_ns() - start;
+  }
+  qsort(samples, reads, sizeof(uint64_t), compare_u64);
+
+  printf("%-8ld %-12s %10.1f %10.1f %10.1f\n", processes, mode,
+         samples[reads / 2] / 1e3, samples[reads * 99 / 100] / 1e3,
+         samples[reads - 1] / 1e3);
+}
+
+int main(void) {
+  long max_scale = SCALES[sizeof(SCALES) / sizeof(SCALES[0]) - 1];
+  pid_t *children = calloc(max_scale, sizeof(pid_t));
+  if (children == NULL) {
+    errno_exit("calloc");
+  }
+  long child_count = 0;
+
+  printf("%-8s %-12s %10s %10s %10s\n", "procs", "mode", "p50_us", "p99_us",
+         "max_us");
+
+  for (size_t s = 0; s < sizeof(SCALES) / sizeof(SCALES[0]); s++) {
+    // Other processes on the system count towards the scale too
+    long processes = read_count();
+    while (processes < SCALES[s]) {
+      pid_t pid = fork();
+      if (pid == -1) {
+        // Out of pids or over the user limit, so measure what we have
+        perror("fork");
+        break;
+      }
+      if (pid == 0) {
+        pause();
+        _exit(EXIT_SUCCESS);
+      }
+      children[child_count++] = pid;
+      processes++;
+    }
+
+    processes = read_count();
+    set_incremental(0);
+    measure("walk", processes, read_count, READS_PER_MODE);
+    set_incremental(1);
+    measure("incremental", processes, read_count, READS_PER_MODE);
+    measure("list", processes, read_list, LIST_READS);
+
+    if (processes < SCALES[s]) {
+      break;
+    }
+  }
+
+  set_incremental(0);
+  for (long i = 0; i < child_count; i++) {
+    kill(children[i], SIGKILL);
+  }
+  for (long i = 0; i < child_count; i++) {
+    waitpid(children[i], NULL, 0);
+  }
+  free(children);
+  return 0;
+}
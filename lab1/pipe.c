@@ -1,11 +1,139 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 enum PipeAction { READ = 0, WRITE = 1 };
 
+// Stage mode: `pipe [--stats[=FILE]] [--cache=DIR] [--] STAGE [:: STAGE]...`
+// where each STAGE is `[-j N] [-0] [-c] [-k] command [args...]`.
+//
+// `-j N` runs N copies of the command and deals its input to them
+// round-robin, one batch of whole records at a time. The copies' outputs are
+// merged back into a single stream for the next stage. By default records are
+// lines and the merge interleaves whole records as they arrive. `-0` makes
+// records NUL-terminated and `-c` concatenates the outputs in worker order
+// instead, which keeps e.g. `gzip -c` output valid.
+//
+// `--stats` writes a JSON report to `stderr`, or FILE, once the pipeline
+// finishes: resource usage of every process and the bytes crossing every
+// pipe. Counting bytes between stages takes an extra relay process per edge,
+// so it is opt-in.
+//
+// `-k` marks a stage as deterministic, so that its output only depends on its
+// arguments and input. Such a stage's output is kept in the `--cache`
+// directory, named after the SHA-256 of its arguments and input. The whole
+// input is read, hashed on the way, before anything else happens: on a hit
+// the cached output is sent on and the command never runs, otherwise the
+// command runs on the spooled input and its output is stored as it streams
+// through. Only output of runs that exit successfully is kept. `-k` needs
+// `--cache` and can't be combined with `-j`. The `--stats` report has the hit
+// rate and the time the hits saved.
+#define STAGE_SEPARATOR "::"
+#define MAX_STAGE_WIDTH 256
+#define SHARD_BATCH_SIZE 16384
+#define MERGE_BUFFER_SIZE 65536
+#define CACHE_MAGIC "pipecch1"
+#define SHA256_DIGEST_SIZE 32
+
+enum CacheOutcome { CACHE_NONE, CACHE_HIT, CACHE_MISS };
+
+// Shared with the stage's cache helper
+struct cache_result {
+  enum CacheOutcome outcome;
+  // How long the command took on the run that stored the output
+  uint64_t command_ns;
+  // `command_ns` less the time spent sending the cached output, for hits
+  uint64_t saved_ns;
+};
+
+// Starts every cache entry, followed by the output itself
+struct cache_header {
+  char magic[8];
+  uint64_t command_ns;
+};
+
+struct sha256 {
+  uint32_t state[8];
+  uint64_t length;
+  uint8_t block[64];
+};
+
+struct stage {
+  char** argv;  // Points into `main`'s `argv`, NULL-terminated in place
+  int width;
+  bool ordered;
+  bool cached;
+  char delimiter;
+
+  int in_fd;
+  int out_fd;
+  // Pipes feeding and draining each copy, only used when `width` > 1
+  int (*worker_in)[2];
+  int (*worker_out)[2];
+  // Shared with the helpers, NULL unless stats are enabled
+  uint64_t* worker_bytes_in;
+  uint64_t* worker_bytes_out;
+  // NULL unless the stage is cached
+  struct cache_result* cache;
+};
+
+enum ChildRole { COMMAND, SHARD, MERGE, RELAY, CACHE };
+
+struct child {
+  pid_t pid;
+  enum ChildRole role;
+  int stage;  // Edge index for relays
+  int worker;
+
+  int status;
+  struct timespec started;
+  struct timespec finished;
+  struct rusage usage;
+};
+
+// A pipe between two stages (or `stdin`/`stdout`) with a relay in the middle
+struct edge {
+  int in_fd;
+  int out_fd;
+};
+
+struct pipeline {
+  struct stage* stages;
+  int stage_count;
+
+  // Every pipe end opened by the launcher. Commands lose them through
+  // close-on-exec, but forked helpers have to close them by hand.
+  int* fds;
+  int fd_count;
+
+  struct child* children;
+  int child_count;
+
+  bool stats;
+  const char* stats_path;
+  // Edge `i` feeds stage `i`, and the last one feeds `stdout`
+  struct edge* edges;
+  int edge_count;
+  uint64_t* edge_bytes;
+
+  const char* cache_dir;
+};
+
 // Short for "debug print pipe" because I don't like typing
 void dpp(int* pipe) {
   // Cast to void to silence cert-err33-c clang-tidy warning
@@ -43,12 +171,1339 @@ int wait_wrapper(int child_pid) {
   exit(ECHILD);
 }
 
+// Like `wait_wrapper`, but for stages that run concurrently. A stage killed by
+// SIGPIPE only means a later stage stopped reading early, so it counts as a
+// success. Other signals are reported the way a shell would.
+int stage_exit_status(int child_status) {
+  if (WIFEXITED(child_status)) {
+    return WEXITSTATUS(child_status);
+  }
+  if (WTERMSIG(child_status) == SIGPIPE) {
+    return EXIT_SUCCESS;
+  }
+  return 128 + WTERMSIG(child_status);
+}
+
+void* calloc_wrapper(size_t count, size_t size) {
+  void* memory = calloc(count, size);
+  if (memory == NULL) {
+    exit(errno);
+  }
+  return memory;
+}
+
+ssize_t read_wrapper(int fd, char* buf, size_t count) {
+  ssize_t bytes_read = 0;
+  do {
+    bytes_read = read(fd, buf, count);
+  } while (bytes_read == -1 && errno == EINTR);
+
+  if (bytes_read == -1) {
+    exit(errno);
+  }
+  return bytes_read;
+}
+
+// Returns false if the reader is gone, which helpers treat as a request to
+// stop rather than an error
+bool write_all(int fd, const char* buf, size_t count) {
+  while (count > 0) {
+    ssize_t written = write(fd, buf, count);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EPIPE) {
+        return false;
+      }
+      exit(errno);
+    }
+    buf += written;
+    count -= written;
+  }
+  return true;
+}
+
+// Like `write_all`, but for files, where any error including a full disk is
+// left to the caller. Returns false with `errno` set on failure.
+bool write_file(int fd, const char* buf, size_t count) {
+  while (count > 0) {
+    ssize_t written = write(fd, buf, count);
+    if (written == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    buf += written;
+    count -= written;
+  }
+  return true;
+}
+
+// Length of the prefix of `buf` that ends on a record boundary. A record too
+// big for the whole buffer is passed on in pieces, so callers must keep
+// sending to the same place until a piece ends with `delimiter`.
+size_t complete_records(const char* buf, size_t len, size_t capacity,
+                        char delimiter, bool eof) {
+  if (eof) {
+    return len;
+  }
+
+  const char* last = memrchr(buf, delimiter, len);
+  if (last != NULL) {
+    return (size_t)(last - buf) + 1;
+  }
+  return len == capacity ? len : 0;
+}
+
+bool is_stats_option(const char* arg) {
+  return strcmp(arg, "--stats") == 0 || strncmp(arg, "--stats=", 8) == 0;
+}
+
+bool is_cache_option(const char* arg) {
+  return strncmp(arg, "--cache=", 8) == 0 && arg[8] != '\0';
+}
+
+bool is_stage_mode(int argc, char* argv[]) {
+  if (strcmp(argv[1], "--") == 0 || is_stats_option(argv[1]) ||
+      is_cache_option(argv[1])) {
+    return true;
+  }
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], STAGE_SEPARATOR) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Splits `argv` into stages, overwriting each separator with NULL so every
+// stage can be passed to `execvp` directly. Returns false on malformed input.
+bool parse_stages(int argc, char* argv[], struct pipeline* pipeline) {
+  int start = 1;
+  for (; start < argc; start++) {
+    if (is_stats_option(argv[start])) {
+      pipeline->stats = true;
+      pipeline->stats_path = strchr(argv[start], '=');
+      if (pipeline->stats_path != NULL) {
+        pipeline->stats_path++;
+      }
+    } else if (is_cache_option(argv[start])) {
+      pipeline->cache_dir = argv[start] + 8;
+    } else {
+      break;
+    }
+  }
+  if (start < argc && strcmp(argv[start], "--") == 0) {
+    start++;
+  }
+
+  pipeline->stages = calloc_wrapper(argc, sizeof(struct stage));
+  pipeline->stage_count = 0;
+
+  int i = start;
+  while (i < argc) {
+    struct stage* stage = &pipeline->stages[pipeline->stage_count++];
+    stage->width = 1;
+    stage->delimiter = '\n';
+
+    for (; i < argc && argv[i][0] == '-'; i++) {
+      if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+        char* end = NULL;
+        long width = strtol(argv[++i], &end, 10);
+        if (*end != '\0' || width < 1 || width > MAX_STAGE_WIDTH) {
+          return false;
+        }
+        stage->width = (int)width;
+      } else if (strcmp(argv[i], "-0") == 0) {
+        stage->delimiter = '\0';
+      } else if (strcmp(argv[i], "-c") == 0) {
+        stage->ordered = true;
+      } else if (strcmp(argv[i], "-k") == 0) {
+        stage->cached = true;
+      } else {
+        break;
+      }
+    }
+
+    if (i == argc || strcmp(argv[i], STAGE_SEPARATOR) == 0) {
+      // Stage without a command
+      return false;
+    }
+    if (stage->cached && (stage->width > 1 || pipeline->cache_dir == NULL)) {
+      return false;
+    }
+
+    stage->argv = &argv[i];
+    while (i < argc && strcmp(argv[i], STAGE_SEPARATOR) != 0) {
+      i++;
+    }
+    if (i < argc) {
+      argv[i++] = NULL;
+      if (i == argc) {
+        // Trailing separator
+        return false;
+      }
+    }
+  }
+
+  return pipeline->stage_count > 0;
+}
+
+void open_pipe(struct pipeline* pipeline, int* fds) {
+  if (pipe2(fds, O_CLOEXEC) == -1) {
+    exit(errno);
+  }
+  pipeline->fds[pipeline->fd_count++] = fds[READ];
+  pipeline->fds[pipeline->fd_count++] = fds[WRITE];
+}
+
+void add_edge(struct pipeline* pipeline, int in_fd, int out_fd) {
+  struct edge* edge = &pipeline->edges[pipeline->edge_count++];
+  edge->in_fd = in_fd;
+  edge->out_fd = out_fd;
+}
+
+// Puts a relay between `in_fd` and a new pipe, returning the pipe's read end
+int relay_into_pipe(struct pipeline* pipeline, int in_fd) {
+  int relayed_pipe[2] = {0};
+  open_pipe(pipeline, relayed_pipe);
+  add_edge(pipeline, in_fd, relayed_pipe[WRITE]);
+  return relayed_pipe[READ];
+}
+
+// Creates every pipe up front, so each process can be started knowing exactly
+// which descriptors it owns
+void connect_stages(struct pipeline* pipeline) {
+  int fd_capacity = 2;
+  int worker_count = 0;
+  for (int i = 0; i < pipeline->stage_count; i++) {
+    fd_capacity += 4 + 4 * pipeline->stages[i].width;
+    worker_count += pipeline->stages[i].width;
+  }
+  pipeline->fds = calloc_wrapper(fd_capacity, sizeof(int));
+
+  int prev_read = STDIN_FILENO;
+  uint64_t* worker_bytes = NULL;
+  if (pipeline->stats) {
+    pipeline->edges =
+        calloc_wrapper(pipeline->stage_count + 1, sizeof(struct edge));
+
+    // Helpers bump these after forking, so they can't live on the heap
+    size_t counters = pipeline->stage_count + 1 + 2 * worker_count;
+    pipeline->edge_bytes =
+        mmap(NULL, counters * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pipeline->edge_bytes == MAP_FAILED) {
+      exit(errno);
+    }
+
+    worker_bytes = pipeline->edge_bytes + pipeline->stage_count + 1;
+    prev_read = relay_into_pipe(pipeline, STDIN_FILENO);
+  }
+
+  for (int i = 0; i < pipeline->stage_count; i++) {
+    struct stage* stage = &pipeline->stages[i];
+    stage->in_fd = prev_read;
+
+    if (i == pipeline->stage_count - 1 && !pipeline->stats) {
+      stage->out_fd = STDOUT_FILENO;
+    } else {
+      int current_pipe[2] = {0};
+      open_pipe(pipeline, current_pipe);
+      stage->out_fd = current_pipe[WRITE];
+
+      if (i == pipeline->stage_count - 1) {
+        add_edge(pipeline, current_pipe[READ], STDOUT_FILENO);
+      } else if (pipeline->stats) {
+        prev_read = relay_into_pipe(pipeline, current_pipe[READ]);
+      } else {
+        prev_read = current_pipe[READ];
+      }
+    }
+
+    if (stage->width > 1) {
+      stage->worker_in = calloc_wrapper(stage->width, sizeof(int[2]));
+      stage->worker_out = calloc_wrapper(stage->width, sizeof(int[2]));
+      for (int worker = 0; worker < stage->width; worker++) {
+        open_pipe(pipeline, stage->worker_in[worker]);
+        open_pipe(pipeline, stage->worker_out[worker]);
+      }
+
+      if (pipeline->stats) {
+        stage->worker_bytes_in = worker_bytes;
+        stage->worker_bytes_out = worker_bytes + stage->width;
+        worker_bytes += 2 * stage->width;
+      }
+    }
+  }
+}
+
+void close_pipeline_fds(const struct pipeline* pipeline, const int* keep,
+                        int keep_count) {
+  for (int i = 0; i < pipeline->fd_count; i++) {
+    bool kept = false;
+    for (int k = 0; k < keep_count; k++) {
+      kept = kept || pipeline->fds[i] == keep[k];
+    }
+    if (!kept) {
+      close(pipeline->fds[i]);
+    }
+  }
+}
+
+void add_child(struct pipeline* pipeline, pid_t child_pid, enum ChildRole role,
+               int stage, int worker) {
+  struct child* child = &pipeline->children[pipeline->child_count++];
+  child->pid = child_pid;
+  child->role = role;
+  child->stage = stage;
+  child->worker = worker;
+  if (clock_gettime(CLOCK_MONOTONIC, &child->started) == -1) {
+    exit(errno);
+  }
+}
+
+void spawn_command(struct pipeline* pipeline, char** argv, int in_fd,
+                   int out_fd, int stage, int worker) {
+  pid_t child_pid = fork();
+  switch (child_pid) {
+    case -1:
+      exit(errno);
+
+    case 0:
+      // The originals are close-on-exec, but their duplicates are not
+      if (in_fd != STDIN_FILENO && dup2(in_fd, STDIN_FILENO) == -1) {
+        exit(errno);
+      }
+      if (out_fd != STDOUT_FILENO && dup2(out_fd, STDOUT_FILENO) == -1) {
+        exit(errno);
+      }
+
+      execvp(argv[0], argv);
+      exit(errno);
+
+    default:
+      add_child(pipeline, child_pid, COMMAND, stage, worker);
+      break;
+  }
+}
+
+// Deals batches of whole records from `in_fd` to each worker in turn
+void shard_records(const struct stage* stage) {
+  char buf[SHARD_BATCH_SIZE];
+  size_t len = 0;
+  bool eof = false;
+
+  bool* gone = calloc_wrapper(stage->width, sizeof(bool));
+  int gone_count = 0;
+  int target = 0;
+
+  while (!eof || len > 0) {
+    if (!eof) {
+      ssize_t bytes_read =
+          read_wrapper(stage->in_fd, buf + len, sizeof(buf) - len);
+      eof = bytes_read == 0;
+      len += bytes_read;
+    }
+
+    size_t batch =
+        complete_records(buf, len, sizeof(buf), stage->delimiter, eof);
+    if (batch == 0) {
+      continue;
+    }
+
+    if (!write_all(stage->worker_in[target][WRITE], buf, batch)) {
+      // Like a pipe to a closed reader, records sent to a worker that has
+      // exited are dropped
+      gone[target] = true;
+      if (++gone_count == stage->width) {
+        break;
+      }
+    } else if (stage->worker_bytes_in != NULL) {
+      stage->worker_bytes_in[target] += batch;
+    }
+
+    bool record_finished = eof || buf[batch - 1] == stage->delimiter;
+    if (record_finished || gone[target]) {
+      do {
+        target = (target + 1) % stage->width;
+      } while (gone[target]);
+    }
+
+    memmove(buf, buf + batch, len - batch);
+    len -= batch;
+  }
+
+  free(gone);
+}
+
+struct merge_input {
+  char* buf;
+  size_t len;
+  bool eof;
+  // Used by ordered merges for output that arrives before the worker's turn
+  FILE* spool;
+};
+
+// Forwards whole records from whichever worker has them
+void merge_interleaved(const struct stage* stage) {
+  struct merge_input* inputs = calloc_wrapper(stage->width, sizeof(*inputs));
+  struct pollfd* pollfds = calloc_wrapper(stage->width, sizeof(*pollfds));
+  for (int i = 0; i < stage->width; i++) {
+    inputs[i].buf = calloc_wrapper(MERGE_BUFFER_SIZE, 1);
+  }
+
+  // Worker in the middle of a record too large for its buffer. Nothing else
+  // may be written until the rest of that record arrives.
+  int partial = -1;
+  int open_count = stage->width;
+
+  while (open_count > 0) {
+    for (int i = 0; i < stage->width; i++) {
+      bool wanted = !inputs[i].eof && (partial == -1 || partial == i);
+      pollfds[i].fd = wanted ? stage->worker_out[i][READ] : -1;
+      pollfds[i].events = POLLIN;
+    }
+
+    if (poll(pollfds, stage->width, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      exit(errno);
+    }
+
+    for (int i = 0; i < stage->width; i++) {
+      // `partial` may have been set by an earlier input in this round
+      if (pollfds[i].fd == -1 || pollfds[i].revents == 0 ||
+          (partial != -1 && partial != i)) {
+        continue;
+      }
+
+      struct merge_input* input = &inputs[i];
+      ssize_t bytes_read =
+          read_wrapper(stage->worker_out[i][READ], input->buf + input->len,
+                       MERGE_BUFFER_SIZE - input->len);
+      input->len += bytes_read;
+      if (bytes_read == 0) {
+        input->eof = true;
+        open_count--;
+      } else if (stage->worker_bytes_out != NULL) {
+        stage->worker_bytes_out[i] += bytes_read;
+      }
+
+      size_t ready = complete_records(input->buf, input->len, MERGE_BUFFER_SIZE,
+                                      stage->delimiter, input->eof);
+      if (ready == 0) {
+        continue;
+      }
+
+      if (!write_all(stage->out_fd, input->buf, ready)) {
+        return;
+      }
+      bool record_finished =
+          input->eof || input->buf[ready - 1] == stage->delimiter;
+      partial = record_finished ? -1 : i;
+
+      memmove(input->buf, input->buf + ready, input->len - ready);
+      input->len -= ready;
+    }
+  }
+}
+
+// Streams worker 0's output, then worker 1's, and so on. Output from workers
+// whose turn hasn't come yet is spooled to temporary files so that they never
+// block, since a blocked worker would eventually stall the shard helper.
+void merge_ordered(const struct stage* stage) {
+  struct merge_input* inputs = calloc_wrapper(stage->width, sizeof(*inputs));
+  struct pollfd* pollfds = calloc_wrapper(stage->width, sizeof(*pollfds));
+  char buf[MERGE_BUFFER_SIZE];
+
+  for (int i = 1; i < stage->width; i++) {
+    inputs[i].spool = tmpfile();
+    if (inputs[i].spool == NULL) {
+      exit(errno);
+    }
+  }
+
+  int head = 0;
+  while (head < stage->width) {
+    for (int i = 0; i < stage->width; i++) {
+      pollfds[i].fd = inputs[i].eof ? -1 : stage->worker_out[i][READ];
+      pollfds[i].events = POLLIN;
+    }
+
+    if (poll(pollfds, stage->width, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      exit(errno);
+    }
+
+    for (int i = head; i < stage->width; i++) {
+      if (pollfds[i].fd == -1 || pollfds[i].revents == 0) {
+        continue;
+      }
+
+      ssize_t bytes_read =
+          read_wrapper(stage->worker_out[i][READ], buf, sizeof(buf));
+      if (bytes_read > 0 && stage->worker_bytes_out != NULL) {
+        stage->worker_bytes_out[i] += bytes_read;
+      }
+
+      if (bytes_read == 0) {
+        inputs[i].eof = true;
+      } else if (i == head) {
+        if (!write_all(stage->out_fd, buf, bytes_read)) {
+          return;
+        }
+      } else if (fwrite(buf, 1, bytes_read, inputs[i].spool) !=
+                 (size_t)bytes_read) {
+        exit(errno);
+      }
+    }
+
+    while (head < stage->width && inputs[head].eof) {
+      if (++head == stage->width) {
+        break;
+      }
+
+      // Catch up on everything the new head wrote before its turn
+      FILE* spool = inputs[head].spool;
+      if (fflush(spool) != 0 || fseek(spool, 0, SEEK_SET) != 0) {
+        exit(errno);
+      }
+      size_t spooled = 0;
+      while ((spooled = fread(buf, 1, sizeof(buf), spool)) > 0) {
+        if (!write_all(stage->out_fd, buf, spooled)) {
+          return;
+        }
+      }
+      (void)fclose(spool);
+      inputs[head].spool = NULL;
+    }
+  }
+}
+
+// Counts the bytes crossing an edge. Both ends are usually pipes, so the data
+// is moved with `splice` and never copied into the relay.
+void relay_bytes(const struct edge* edge, uint64_t* bytes) {
+  bool use_splice = true;
+  char buf[MERGE_BUFFER_SIZE];
+
+  while (true) {
+    // Stop as soon as the reader is gone rather than on the next write, which
+    // may never come if e.g. `stdin` is a terminal the first stage ignores
+    struct pollfd pollfds[2] = {{.fd = edge->in_fd, .events = POLLIN},
+                                {.fd = edge->out_fd, .events = 0}};
+    if (poll(pollfds, 2, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      exit(errno);
+    }
+    if (pollfds[1].revents & (POLLERR | POLLHUP)) {
+      return;
+    }
+
+    ssize_t moved = 0;
+    if (use_splice) {
+      moved = splice(edge->in_fd, NULL, edge->out_fd, NULL, MERGE_BUFFER_SIZE,
+                     SPLICE_F_MOVE);
+      if (moved == -1 && errno == EINVAL) {
+        // Neither end is a pipe, e.g. a terminal on both sides
+        use_splice = false;
+        continue;
+      }
+      if (moved == -1 && errno == EPIPE) {
+        return;
+      }
+      if (moved == -1 && errno != EINTR) {
+        exit(errno);
+      }
+    } else {
+      moved = read_wrapper(edge->in_fd, buf, sizeof(buf));
+      if (!write_all(edge->out_fd, buf, moved)) {
+        return;
+      }
+    }
+
+    if (moved == 0) {
+      return;
+    }
+    if (moved > 0) {
+      *bytes += moved;
+    }
+  }
+}
+
+void spawn_relay(struct pipeline* pipeline, int edge_index) {
+  const struct edge* edge = &pipeline->edges[edge_index];
+
+  pid_t child_pid = fork();
+  switch (child_pid) {
+    case -1:
+      exit(errno);
+
+    case 0: {
+      int keep[2] = {edge->in_fd, edge->out_fd};
+      close_pipeline_fds(pipeline, keep, 2);
+
+      if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        exit(errno);
+      }
+
+      relay_bytes(edge, &pipeline->edge_bytes[edge_index]);
+      exit(EXIT_SUCCESS);
+    }
+
+    default:
+      add_child(pipeline, child_pid, RELAY, edge_index, 0);
+      break;
+  }
+}
+
+void spawn_helper(struct pipeline* pipeline, const struct stage* stage,
+                  int stage_index, bool shard) {
+  pid_t child_pid = fork();
+  switch (child_pid) {
+    case -1:
+      exit(errno);
+
+    case 0: {
+      int* keep = calloc_wrapper(stage->width + 1, sizeof(int));
+      keep[0] = shard ? stage->in_fd : stage->out_fd;
+      for (int i = 0; i < stage->width; i++) {
+        keep[i + 1] = shard ? stage->worker_in[i][WRITE]
+                            : stage->worker_out[i][READ];
+      }
+      // Otherwise workers and the next stage never see end of file
+      close_pipeline_fds(pipeline, keep, stage->width + 1);
+
+      // A closed reader shows up as EPIPE instead of killing the helper
+      if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        exit(errno);
+      }
+
+      if (shard) {
+        shard_records(stage);
+      } else if (stage->ordered) {
+        merge_ordered(stage);
+      } else {
+        merge_interleaved(stage);
+      }
+      exit(EXIT_SUCCESS);
+    }
+
+    default:
+      add_child(pipeline, child_pid, shard ? SHARD : MERGE, stage_index, 0);
+      break;
+  }
+}
+
+const uint32_t SHA256_ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+uint32_t rotate_right(uint32_t value, int bits) {
+  return (value >> bits) | (value << (32 - bits));
+}
+
+void sha256_init(struct sha256* sha) {
+  const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                               0xa54ff53a, 0x510e527f, 0x9b05688c,
+                               0x1f83d9ab, 0x5be0cd19};
+  memcpy(sha->state, initial, sizeof(initial));
+  sha->length = 0;
+}
+
+void sha256_block(struct sha256* sha, const uint8_t* block) {
+  uint32_t schedule[64];
+  for (int i = 0; i < 16; i++) {
+    schedule[i] = (uint32_t)block[4 * i] << 24 |
+                  (uint32_t)block[4 * i + 1] << 16 |
+                  (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  for (int i = 16; i < 64; i++) {
+    uint32_t s0 = rotate_right(schedule[i - 15], 7) ^
+                  rotate_right(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+    uint32_t s1 = rotate_right(schedule[i - 2], 17) ^
+                  rotate_right(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+    schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+  }
+
+  // a to h
+  uint32_t v[8];
+  memcpy(v, sha->state, sizeof(v));
+  for (int i = 0; i < 64; i++) {
+    uint32_t s1 =
+        rotate_right(v[4], 6) ^ rotate_right(v[4], 11) ^ rotate_right(v[4], 25);
+    uint32_t choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+    uint32_t t1 = v[7] + s1 + choice + SHA256_ROUND_CONSTANTS[i] + schedule[i];
+    uint32_t s0 =
+        rotate_right(v[0], 2) ^ rotate_right(v[0], 13) ^ rotate_right(v[0], 22);
+    uint32_t majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+
+    memmove(&v[1], &v[0], 7 * sizeof(uint32_t));
+    v[4] += t1;
+    v[0] = t1 + s0 + majority;
+  }
+  for (int i = 0; i < 8; i++) {
+    sha->state[i] += v[i];
+  }
+}
+
+void sha256_update(struct sha256* sha, const void* data, size_t len) {
+  const uint8_t* bytes = data;
+  size_t used = sha->length % sizeof(sha->block);
+  sha->length += len;
+
+  if (used > 0) {
+    size_t take = sizeof(sha->block) - used;
+    if (take > len) {
+      take = len;
+    }
+    memcpy(sha->block + used, bytes, take);
+    bytes += take;
+    len -= take;
+    if (used + take < sizeof(sha->block)) {
+      return;
+    }
+    sha256_block(sha, sha->block);
+  }
+
+  for (; len >= sizeof(sha->block); len -= sizeof(sha->block)) {
+    sha256_block(sha, bytes);
+    bytes += sizeof(sha->block);
+  }
+  memcpy(sha->block, bytes, len);
+}
+
+void sha256_final(struct sha256* sha, uint8_t* digest) {
+  uint64_t bits = sha->length * 8;
+  uint8_t padding[72] = {0x80};
+  size_t used = sha->length % sizeof(sha->block);
+  size_t padding_len = (used < 56 ? 56 : 120) - used;
+  for (int i = 0; i < 8; i++) {
+    padding[padding_len + i] = (uint8_t)(bits >> (56 - 8 * i));
+  }
+  sha256_update(sha, padding, padding_len + 8);
+
+  for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+    digest[i] = (uint8_t)(sha->state[i / 4] >> (24 - 8 * (i % 4)));
+  }
+}
+
+uint64_t elapsed_ns(const struct timespec* start, const struct timespec* end) {
+  return (uint64_t)(end->tv_sec - start->tv_sec) * 1000000000ULL +
+         end->tv_nsec - start->tv_nsec;
+}
+
+// Hashes the stage's arguments, then copies its input to `spool` and hashes
+// that on the way. Writes the entry's path into `path`.
+void spool_input(const struct pipeline* pipeline, const struct stage* stage,
+                 int spool, char* path, size_t size) {
+  struct sha256 sha;
+  sha256_init(&sha);
+
+  // The count keeps arguments from running into the input
+  int arg_count = 0;
+  while (stage->argv[arg_count] != NULL) {
+    arg_count++;
+  }
+  sha256_update(&sha, &arg_count, sizeof(arg_count));
+  for (int i = 0; i < arg_count; i++) {
+    sha256_update(&sha, stage->argv[i], strlen(stage->argv[i]) + 1);
+  }
+
+  char buf[MERGE_BUFFER_SIZE];
+  ssize_t bytes_read = 0;
+  while ((bytes_read = read_wrapper(stage->in_fd, buf, sizeof(buf))) > 0) {
+    sha256_update(&sha, buf, bytes_read);
+    // The command must never see part of its input
+    if (!write_file(spool, buf, bytes_read)) {
+      exit(errno);
+    }
+  }
+
+  uint8_t digest[SHA256_DIGEST_SIZE];
+  sha256_final(&sha, digest);
+  int len = snprintf(path, size, "%s/", pipeline->cache_dir);
+  for (int i = 0; i < SHA256_DIGEST_SIZE && len < (int)size; i++) {
+    len += snprintf(path + len, size - len, "%02x", digest[i]);
+  }
+}
+
+// A new file next to the entries, so it can be renamed into place
+int open_cache_temp(const struct pipeline* pipeline, char* path, size_t size) {
+  (void)snprintf(path, size, "%s/.tmp-XXXXXX", pipeline->cache_dir);
+  int fd = mkostemp(path, O_CLOEXEC);
+  if (fd == -1) {
+    exit(errno);
+  }
+  return fd;
+}
+
+// Opens the entry at `path` if there is a complete one
+int open_cache_entry(const char* path, struct cache_header* header) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      return -1;
+    }
+    exit(errno);
+  }
+
+  if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+      memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Sends a cached output on, straight from the page cache when `sendfile`
+// can write to `out_fd`. Returns false if the reader is gone.
+bool send_cache_entry(int fd, int out_fd) {
+  bool use_sendfile = true;
+  off_t offset = sizeof(struct cache_header);
+  char buf[MERGE_BUFFER_SIZE];
+
+  while (true) {
+    ssize_t sent = 0;
+    if (use_sendfile) {
+      sent = sendfile(out_fd, fd, &offset, MERGE_BUFFER_SIZE);
+      if (sent == -1 && errno == EINVAL) {
+        use_sendfile = false;
+        continue;
+      }
+      if (sent == -1 && errno == EPIPE) {
+        return false;
+      }
+      if (sent == -1 && errno != EINTR) {
+        exit(errno);
+      }
+    } else {
+      sent = pread(fd, buf, sizeof(buf), offset);
+      if (sent == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        exit(errno);
+      }
+      if (!write_all(out_fd, buf, sent)) {
+        return false;
+      }
+      offset += sent;
+    }
+
+    if (sent == 0) {
+      return true;
+    }
+  }
+}
+
+// Copies the command's output to both `out_fd` and the entry. When `out_fd`
+// is a pipe, `tee` duplicates the data into it and `splice` then moves the
+// same data into the entry, so none of it is copied into the helper. Returns
+// false if the reader is gone. If the entry can't be written, e.g. because
+// the disk is full, `*stored` is cleared and the output is only passed on.
+bool store_output(int from, int out_fd, int entry, bool* stored) {
+  bool use_tee = true;
+  char buf[MERGE_BUFFER_SIZE];
+
+  while (true) {
+    ssize_t copied = 0;
+    if (use_tee) {
+      copied = tee(from, out_fd, MERGE_BUFFER_SIZE, 0);
+      if (copied == -1 && errno == EINVAL) {
+        // `out_fd` isn't a pipe, e.g. a terminal
+        use_tee = false;
+        continue;
+      }
+      if (copied == -1 && errno == EPIPE) {
+        return false;
+      }
+      if (copied == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        exit(errno);
+      }
+
+      // `tee` left the data in `from`, so exactly that much is taken out
+      for (ssize_t left = copied; left > 0;) {
+        ssize_t moved = -1;
+        if (*stored) {
+          moved = splice(from, NULL, entry, NULL, left, SPLICE_F_MOVE);
+          if (moved == -1 && errno == EINTR) {
+            continue;
+          }
+          *stored = moved != -1;
+        }
+        if (!*stored) {
+          size_t discard = sizeof(buf);
+          if ((size_t)left < discard) {
+            discard = left;
+          }
+          moved = read_wrapper(from, buf, discard);
+        }
+        left -= moved;
+      }
+    } else {
+      copied = read_wrapper(from, buf, sizeof(buf));
+      if (!write_all(out_fd, buf, copied)) {
+        return false;
+      }
+      if (*stored && !write_file(entry, buf, copied)) {
+        *stored = false;
+      }
+    }
+
+    if (copied == 0) {
+      return true;
+    }
+  }
+}
+
+// Runs the command on the spooled input, storing its output as it goes.
+// Returns the command's wait status.
+int run_and_store(const struct pipeline* pipeline, const struct stage* stage,
+                  int spool, const char* path) {
+  char temp_path[PATH_MAX];
+  int entry = open_cache_temp(pipeline, temp_path, sizeof(temp_path));
+  struct cache_header header = {.magic = CACHE_MAGIC};
+  if (lseek(entry, sizeof(header), SEEK_SET) == -1 ||
+      lseek(spool, 0, SEEK_SET) == -1) {
+    exit(errno);
+  }
+
+  int output[2] = {0};
+  if (pipe2(output, O_CLOEXEC) == -1) {
+    exit(errno);
+  }
+
+  struct timespec started;
+  if (clock_gettime(CLOCK_MONOTONIC, &started) == -1) {
+    exit(errno);
+  }
+  pid_t child_pid = fork();
+  switch (child_pid) {
+    case -1:
+      exit(errno);
+
+    case 0:
+      if (dup2(spool, STDIN_FILENO) == -1 ||
+          dup2(output[WRITE], STDOUT_FILENO) == -1) {
+        exit(errno);
+      }
+      // Ignored signals stay ignored across `exec`
+      if (signal(SIGPIPE, SIG_DFL) == SIG_ERR) {
+        exit(errno);
+      }
+      execvp(stage->argv[0], stage->argv);
+      exit(errno);
+
+    default:
+      break;
+  }
+
+  close(output[WRITE]);
+  bool stored = true;
+  bool delivered = store_output(output[READ], stage->out_fd, entry, &stored);
+  // The command gets SIGPIPE if it still had output for a gone reader
+  close(output[READ]);
+
+  int child_status = 0;
+  while (waitpid(child_pid, &child_status, 0) == -1) {
+    if (errno != EINTR) {
+      exit(errno);
+    }
+  }
+  struct timespec finished;
+  if (clock_gettime(CLOCK_MONOTONIC, &finished) == -1) {
+    exit(errno);
+  }
+  header.command_ns = elapsed_ns(&started, &finished);
+  stage->cache->command_ns = header.command_ns;
+
+  // Output cut short by a gone reader or a failed write is incomplete, so
+  // it isn't kept. Neither is any failure to put it in place, since the
+  // stage itself succeeded.
+  bool keep = delivered && stored && WIFEXITED(child_status) &&
+              WEXITSTATUS(child_status) == EXIT_SUCCESS &&
+              pwrite(entry, &header, sizeof(header), 0) == sizeof(header) &&
+              rename(temp_path, path) == 0;
+  if (!keep) {
+    unlink(temp_path);
+  }
+  close(entry);
+  return child_status;
+}
+
+// Stands in for a cached stage's command, running it only on a miss. Exits
+// with the stage's status.
+void run_cached_stage(const struct pipeline* pipeline,
+                      const struct stage* stage) {
+  char temp_path[PATH_MAX];
+  int spool = open_cache_temp(pipeline, temp_path, sizeof(temp_path));
+  unlink(temp_path);
+
+  char path[PATH_MAX];
+  spool_input(pipeline, stage, spool, path, sizeof(path));
+
+  struct cache_header header;
+  int entry = open_cache_entry(path, &header);
+  if (entry == -1) {
+    stage->cache->outcome = CACHE_MISS;
+    exit(stage_exit_status(run_and_store(pipeline, stage, spool, path)));
+  }
+
+  struct timespec started;
+  if (clock_gettime(CLOCK_MONOTONIC, &started) == -1) {
+    exit(errno);
+  }
+  send_cache_entry(entry, stage->out_fd);
+  struct timespec finished;
+  if (clock_gettime(CLOCK_MONOTONIC, &finished) == -1) {
+    exit(errno);
+  }
+
+  uint64_t sending_ns = elapsed_ns(&started, &finished);
+  stage->cache->outcome = CACHE_HIT;
+  stage->cache->command_ns = header.command_ns;
+  stage->cache->saved_ns =
+      header.command_ns > sending_ns ? header.command_ns - sending_ns : 0;
+  exit(EXIT_SUCCESS);
+}
+
+void prepare_cache(struct pipeline* pipeline) {
+  if (mkdir(pipeline->cache_dir, 0755) == -1 && errno != EEXIST) {
+    exit(errno);
+  }
+
+  // Helpers fill these in after forking, so they can't live on the heap
+  struct cache_result* results =
+      mmap(NULL, pipeline->stage_count * sizeof(struct cache_result),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (results == MAP_FAILED) {
+    exit(errno);
+  }
+  for (int i = 0; i < pipeline->stage_count; i++) {
+    if (pipeline->stages[i].cached) {
+      pipeline->stages[i].cache = &results[i];
+    }
+  }
+}
+
+void spawn_cached(struct pipeline* pipeline, const struct stage* stage,
+                  int stage_index) {
+  pid_t child_pid = fork();
+  switch (child_pid) {
+    case -1:
+      exit(errno);
+
+    case 0: {
+      int keep[2] = {stage->in_fd, stage->out_fd};
+      close_pipeline_fds(pipeline, keep, 2);
+
+      if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        exit(errno);
+      }
+
+      run_cached_stage(pipeline, stage);
+      exit(EXIT_SUCCESS);
+    }
+
+    default:
+      add_child(pipeline, child_pid, CACHE, stage_index, 0);
+      break;
+  }
+}
+
+// Reaps children in whatever order they finish, so each one's wall time ends
+// when it actually exits
+void reap_children(struct pipeline* pipeline) {
+  for (int reaped = 0; reaped < pipeline->child_count; reaped++) {
+    int child_status = 0;
+    struct rusage usage;
+    pid_t child_pid = wait4(-1, &child_status, 0, &usage);
+    if (child_pid == -1) {
+      if (errno == EINTR) {
+        reaped--;
+        continue;
+      }
+      exit(errno);
+    }
+
+    for (int i = 0; i < pipeline->child_count; i++) {
+      struct child* child = &pipeline->children[i];
+      if (child->pid != child_pid) {
+        continue;
+      }
+
+      child->status = stage_exit_status(child_status);
+      child->usage = usage;
+      if (clock_gettime(CLOCK_MONOTONIC, &child->finished) == -1) {
+        exit(errno);
+      }
+    }
+  }
+}
+
+double elapsed_ms(const struct timespec* start, const struct timespec* end) {
+  return (double)(end->tv_sec - start->tv_sec) * 1e3 +
+         (double)(end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+double timeval_ms(const struct timeval* time) {
+  return (double)time->tv_sec * 1e3 + (double)time->tv_usec / 1e3;
+}
+
+void print_json_string(FILE* out, const char* str) {
+  (void)fputc('"', out);
+  for (; *str != '\0'; str++) {
+    unsigned char c = *str;
+    if (c == '"' || c == '\\') {
+      (void)fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      (void)fprintf(out, "\\u%04x", c);
+    } else {
+      (void)fputc(c, out);
+    }
+  }
+  (void)fputc('"', out);
+}
+
+void print_usage_json(FILE* out, const struct rusage* usage) {
+  (void)fprintf(out,
+                "\"user_ms\": %.3f, \"sys_ms\": %.3f, \"max_rss_kb\": %ld, "
+                "\"voluntary_switches\": %ld, \"involuntary_switches\": %ld",
+                timeval_ms(&usage->ru_utime), timeval_ms(&usage->ru_stime),
+                usage->ru_maxrss, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+void print_child_json(FILE* out, const struct pipeline* pipeline,
+                      const struct child* child) {
+  const char* roles[] = {"command", "shard", "merge", "relay", "cache"};
+  const struct stage* stage = &pipeline->stages[child->stage];
+
+  (void)fprintf(out,
+                "{\"role\": \"%s\", \"worker\": %d, \"pid\": %d, "
+                "\"status\": %d, \"wall_ms\": %.3f, ",
+                roles[child->role], child->worker, child->pid, child->status,
+                elapsed_ms(&child->started, &child->finished));
+  print_usage_json(out, &child->usage);
+  if (child->role == COMMAND && stage->width > 1) {
+    (void)fprintf(out, ", \"bytes_in\": %llu, \"bytes_out\": %llu",
+                  (unsigned long long)stage->worker_bytes_in[child->worker],
+                  (unsigned long long)stage->worker_bytes_out[child->worker]);
+  }
+  (void)fputc('}', out);
+}
+
+void print_stats_json(FILE* out, const struct pipeline* pipeline,
+                      const struct timespec* started,
+                      const struct timespec* finished, int result) {
+  (void)fprintf(out, "{\"status\": %d, \"wall_ms\": %.3f,\n", result,
+                elapsed_ms(started, finished));
+
+  if (pipeline->cache_dir != NULL) {
+    int hits = 0;
+    int misses = 0;
+    uint64_t saved_ns = 0;
+    for (int i = 0; i < pipeline->stage_count; i++) {
+      const struct cache_result* cache = pipeline->stages[i].cache;
+      if (cache != NULL) {
+        hits += cache->outcome == CACHE_HIT;
+        misses += cache->outcome == CACHE_MISS;
+        saved_ns += cache->saved_ns;
+      }
+    }
+    (void)fprintf(out,
+                  " \"cache\": {\"hits\": %d, \"misses\": %d, "
+                  "\"hit_rate\": %.3f, \"saved_ms\": %.3f},\n",
+                  hits, misses,
+                  hits + misses > 0 ? (double)hits / (hits + misses) : 0.0,
+                  (double)saved_ns / 1e6);
+  }
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == -1) {
+    exit(errno);
+  }
+  (void)fprintf(out, " \"launcher\": {");
+  print_usage_json(out, &usage);
+  if (getrusage(RUSAGE_CHILDREN, &usage) == -1) {
+    exit(errno);
+  }
+  (void)fprintf(out, "},\n \"children\": {");
+  print_usage_json(out, &usage);
+  (void)fprintf(out, "},\n \"stages\": [");
+
+  for (int i = 0; i < pipeline->stage_count; i++) {
+    const struct stage* stage = &pipeline->stages[i];
+    (void)fprintf(out, "%s\n  {\"stage\": %d, \"argv\": [", i ? "," : "", i);
+    for (char** arg = stage->argv; *arg != NULL; arg++) {
+      (void)fputs(arg == stage->argv ? "" : ", ", out);
+      print_json_string(out, *arg);
+    }
+    (void)fprintf(out,
+                  "], \"width\": %d, \"bytes_in\": %llu, "
+                  "\"bytes_out\": %llu,\n",
+                  stage->width, (unsigned long long)pipeline->edge_bytes[i],
+                  (unsigned long long)pipeline->edge_bytes[i + 1]);
+    if (stage->cache != NULL) {
+      const char* outcomes[] = {"none", "hit", "miss"};
+      (void)fprintf(out,
+                    "   \"cache\": \"%s\", \"command_ms\": %.3f, "
+                    "\"saved_ms\": %.3f,\n",
+                    outcomes[stage->cache->outcome],
+                    (double)stage->cache->command_ns / 1e6,
+                    (double)stage->cache->saved_ns / 1e6);
+    }
+    (void)fputs("   \"processes\": [", out);
+
+    bool first = true;
+    for (int c = 0; c < pipeline->child_count; c++) {
+      const struct child* child = &pipeline->children[c];
+      if (child->role == RELAY || child->stage != i) {
+        continue;
+      }
+      (void)fputs(first ? "\n    " : ",\n    ", out);
+      print_child_json(out, pipeline, child);
+      first = false;
+    }
+    (void)fprintf(out, "]}");
+  }
+
+  (void)fprintf(out, "],\n \"edges\": [");
+  for (int i = 0; i < pipeline->edge_count; i++) {
+    // Edges are numbered by the stage they feed, -1 standing for the ends
+    int to = i < pipeline->stage_count ? i : -1;
+    (void)fprintf(out, "%s\n  {\"from\": %d, \"to\": %d, \"bytes\": %llu}",
+                  i ? "," : "", i - 1, to,
+                  (unsigned long long)pipeline->edge_bytes[i]);
+  }
+  (void)fprintf(out, "]}\n");
+}
+
+void write_stats(const struct pipeline* pipeline,
+                 const struct timespec* started, int result) {
+  struct timespec finished;
+  if (clock_gettime(CLOCK_MONOTONIC, &finished) == -1) {
+    exit(errno);
+  }
+
+  FILE* out = stderr;
+  if (pipeline->stats_path != NULL) {
+    out = fopen(pipeline->stats_path, "w");
+    if (out == NULL) {
+      exit(errno);
+    }
+  }
+
+  print_stats_json(out, pipeline, started, &finished, result);
+
+  if (out != stderr && fclose(out) != 0) {
+    exit(errno);
+  }
+}
+
+// Runs every stage concurrently. Returns the first nonzero exit status in
+// pipeline order, like the sequential mode does.
+int run_stage_pipeline(int argc, char* argv[]) {
+  struct pipeline pipeline = {0};
+  if (!parse_stages(argc, argv, &pipeline)) {
+    return EINVAL;
+  }
+
+  struct timespec started;
+  if (clock_gettime(CLOCK_MONOTONIC, &started) == -1) {
+    return errno;
+  }
+
+  connect_stages(&pipeline);
+  if (pipeline.cache_dir != NULL) {
+    prepare_cache(&pipeline);
+  }
+
+  int process_capacity = pipeline.edge_count;
+  for (int i = 0; i < pipeline.stage_count; i++) {
+    process_capacity += pipeline.stages[i].width + 2;
+  }
+  pipeline.children = calloc_wrapper(process_capacity, sizeof(struct child));
+
+  for (int i = 0; i < pipeline.edge_count; i++) {
+    spawn_relay(&pipeline, i);
+  }
+
+  for (int i = 0; i < pipeline.stage_count; i++) {
+    struct stage* stage = &pipeline.stages[i];
+    if (stage->cached) {
+      spawn_cached(&pipeline, stage, i);
+      continue;
+    }
+    if (stage->width == 1) {
+      spawn_command(&pipeline, stage->argv, stage->in_fd, stage->out_fd, i, 0);
+      continue;
+    }
+
+    spawn_helper(&pipeline, stage, i, true);
+    for (int worker = 0; worker < stage->width; worker++) {
+      spawn_command(&pipeline, stage->argv, stage->worker_in[worker][READ],
+                    stage->worker_out[worker][WRITE], i, worker);
+    }
+    spawn_helper(&pipeline, stage, i, false);
+  }
+
+  close_pipeline_fds(&pipeline, NULL, 0);
+  reap_children(&pipeline);
+
+  int result = EXIT_SUCCESS;
+  for (int i = 0; i < pipeline.child_count; i++) {
+    const struct child* child = &pipeline.children[i];
+    if (result == EXIT_SUCCESS && child->role != RELAY) {
+      result = child->status;
+    }
+  }
+
+  if (pipeline.stats) {
+    write_stats(&pipeline, &started, result);
+  }
+
+  for (int i = 0; i < pipeline.stage_count; i++) {
+    free(pipeline.stages[i].worker_in);
+    free(pipeline.stages[i].worker_out);
+  }
+  free(pipeline.stages);
+  free(pipeline.fds);
+  free(pipeline.children);
+  free(pipeline.edges);
+  return result;
+}
+
 int main(int argc, char* argv[]) {
   if (argc <= 1) {
     // As required by spec
     return EINVAL;
   }
 
+  if (is_stage_mode(argc, argv)) {
+    return run_stage_pipeline(argc, argv);
+  }
+
   if (argc == 2) {
     if (execlp(argv[1], argv[1], NULL) == -1) {
       return errno;
@@ -1,9 +1,11 @@
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
@@ -18,6 +20,33 @@
 
 typedef uint32_t u32;
 typedef int32_t i32;
+typedef uint64_t u64;
+
+#define CHECKPOINT_MAGIC "rrckpt01"
+#define DEFAULT_CHECKPOINT_INTERVAL 1000000
+
+enum device_kind { DISK, NIC, DEVICE_COUNT };
+
+// How a device picks which waiting request to serve
+enum discipline {
+  // One request at a time, in the order they came
+  FCFS,
+  // One time unit to each request in turn, so that transfers share the
+  // device's bandwidth
+  ROUND_ROBIN,
+};
+
+static const char *const DEVICE_NAMES[DEVICE_COUNT] = {"disk", "nic"};
+static const enum discipline DEVICE_DISCIPLINES[DEVICE_COUNT] = {FCFS,
+                                                                 ROUND_ROBIN};
+
+// A CPU burst and the I/O the process blocks on after it, if any
+struct burst {
+  u32 cpu_time;
+  enum device_kind device;
+  // 0 after a process's last CPU burst
+  u32 io_time;
+};
 
 struct process {
   u32 pid;
@@ -29,11 +58,49 @@ struct process {
   /* Additional fields here */
   u32 remaining_time;
   bool first_run;
+
+  struct burst *bursts;
+  u32 burst_count;
+  u32 next_burst;
+  u32 io_remaining;
+  u32 io_submitted;
+  // Time spent blocked on I/O, queueing included
+  u32 io_time;
   /* End of "Additional fields here" */
 };
 
 TAILQ_HEAD(process_list, process);
 
+struct device {
+  // The request being served is first
+  struct process_list queue;
+  u32 busy_time;
+  u32 requests;
+  u64 total_queueing_delay;
+};
+
+// Everything that changes as the simulation runs, besides the processes
+struct simulation {
+  // The current process is first
+  struct process_list list;
+  struct device devices[DEVICE_COUNT];
+
+  u32 current_time;
+  u32 run_time;
+  // Next process to arrive, in arrival order
+  u32 queue_idx;
+  u32 blocked_count;
+
+  // Wide enough for long traces with many processes
+  u64 total_waiting_time;
+  u64 total_response_time;
+  // When the last process finished
+  u32 end_time;
+  u32 cpu_busy_time;
+  // Time units where the CPU and at least one device were both busy
+  u32 overlap_time;
+};
+
 static int compare_by_arrival(const void *left, const void *right) {
   u32 diff = ((struct process *)left)->arrival_time -
              ((struct process *)right)->arrival_time;
@@ -106,8 +173,57 @@ u32 next_int_from_c_str(const char *data) {
   return current;
 }
 
+// Reads `, DEVICE IO_TIME, CPU_TIME` into the burst that ends at `cpu_time`
+// and the one after it, if the line has any more
+static bool next_io_burst(const char **data, const char *data_end,
+                          struct burst *burst, struct burst *next) {
+  while (*data != data_end && (**data == ',' || **data == ' ' ||
+                               **data == '\t' || **data == '\r')) {
+    ++(*data);
+  }
+  // Anything else starts the next process
+  if (*data == data_end || **data < 'a' || **data > 'z') {
+    return false;
+  }
+
+  const char *name = *data;
+  while (*data != data_end && **data >= 'a' && **data <= 'z') {
+    ++(*data);
+  }
+  for (u32 i = 0; i < DEVICE_COUNT; ++i) {
+    if (strlen(DEVICE_NAMES[i]) == (size_t)(*data - name) &&
+        strncmp(name, DEVICE_NAMES[i], *data - name) == 0) {
+      burst->device = i;
+      burst->io_time = next_int(data, data_end);
+      next->cpu_time = next_int(data, data_end);
+      next->io_time = 0;
+      // A zero I/O time would end the process early, and a zero CPU time
+      // after I/O would have nothing to run
+      if (burst->io_time == 0 || next->cpu_time == 0) {
+        printf("Empty burst after %s %u, expected I/O and CPU times above 0\n",
+               DEVICE_NAMES[i], burst->io_time);
+        exit(EINVAL);
+      }
+      return true;
+    }
+  }
+
+  printf("Unknown device \"%.*s\", expected disk or nic\n",
+         (int)(*data - name), name);
+  exit(EINVAL);
+}
+
+// A trace is the number of processes followed by a line for each:
+//
+//   PID, ARRIVAL_TIME, CPU_TIME[, DEVICE IO_TIME, CPU_TIME]...
+//
+// A process alternates between running for CPU_TIME and blocking on I/O at
+// DEVICE (disk or nic) for IO_TIME, and ends with a CPU burst. Every IO_TIME
+// and each CPU_TIME after one must be above 0. `burst_time` is the sum of its
+// CPU bursts.
 void init_processes(const char *path, struct process **process_data,
-                    u32 *process_size) {
+                    u32 *process_size, struct burst **burst_data,
+                    u64 *trace_hash) {
   int fd = open(path, O_RDONLY);
   if (fd == -1) {
     int err = errno;
@@ -133,6 +249,12 @@ void init_processes(const char *path, struct process **process_data,
   const char *data_end = data_start + size;
   const char *data = data_start;
 
+  // FNV-1a, so a checkpoint can tell if it is resumed with another trace
+  *trace_hash = 0xcbf29ce484222325ULL;
+  for (const char *c = data_start; c != data_end; ++c) {
+    *trace_hash = (*trace_hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+  }
+
   *process_size = next_int(&data, data_end);
 
   *process_data = calloc(sizeof(struct process), *process_size);
@@ -142,100 +264,444 @@ void init_processes(const char *path, struct process **process_data,
     exit(err);
   }
 
+  // Processes point into this once it stops growing
+  u32 burst_capacity = *process_size + 1;
+  u32 burst_size = 0;
+  u32 *first_bursts = calloc(sizeof(u32), *process_size);
+  *burst_data = calloc(sizeof(struct burst), burst_capacity);
+  if (first_bursts == NULL || *burst_data == NULL) {
+    int err = errno;
+    perror("calloc");
+    exit(err);
+  }
+
   for (u32 i = 0; i < *process_size; ++i) {
-    (*process_data)[i].pid = next_int(&data, data_end);
-    (*process_data)[i].arrival_time = next_int(&data, data_end);
-    (*process_data)[i].burst_time = next_int(&data, data_end);
-    (*process_data)[i].remaining_time = (*process_data)[i].burst_time;
-    (*process_data)[i].first_run = true;
+    struct process *process = &(*process_data)[i];
+    process->pid = next_int(&data, data_end);
+    process->arrival_time = next_int(&data, data_end);
+    first_bursts[i] = burst_size;
+
+    struct burst *burst = &(*burst_data)[burst_size++];
+    burst->cpu_time = next_int(&data, data_end);
+    burst->io_time = 0;
+    while (true) {
+      if (burst_size == burst_capacity) {
+        burst_capacity *= 2;
+        *burst_data =
+            realloc(*burst_data, burst_capacity * sizeof(struct burst));
+        if (*burst_data == NULL) {
+          int err = errno;
+          perror("realloc");
+          exit(err);
+        }
+        burst = &(*burst_data)[burst_size - 1];
+      }
+      if (!next_io_burst(&data, data_end, burst,
+                         &(*burst_data)[burst_size])) {
+        break;
+      }
+      burst = &(*burst_data)[burst_size++];
+    }
+
+    process->burst_count = burst_size - first_bursts[i];
+    process->burst_time = 0;
+    for (u32 b = first_bursts[i]; b < burst_size; ++b) {
+      process->burst_time += (*burst_data)[b].cpu_time;
+    }
+    process->remaining_time = (*burst_data)[first_bursts[i]].cpu_time;
+    process->first_run = true;
+  }
+
+  for (u32 i = 0; i < *process_size; ++i) {
+    (*process_data)[i].bursts = &(*burst_data)[first_bursts[i]];
   }
+  free(first_bursts);
 
   munmap((void *)data, size);
   close(fd);
 }
 
+// A checkpoint is the magic and the trace's hash followed by native-endian
+// integers: the process count, the rest of `struct simulation` field by field,
+// each process's progress in arrival order, then the list and each device's
+// queue as a length and indices into arrival order. PIDs, arrival times and
+// bursts come from the trace again on resume.
+static void put_u32(FILE *file, u32 value) {
+  fwrite(&value, sizeof(value), 1, file);
+}
+
+static void put_u64(FILE *file, u64 value) {
+  fwrite(&value, sizeof(value), 1, file);
+}
+
+static void put_queue(FILE *file, struct process_list *queue,
+                      const struct process *data) {
+  u32 length = 0;
+  struct process *process;
+  TAILQ_FOREACH(process, queue, pointers) { ++length; }
+
+  put_u32(file, length);
+  TAILQ_FOREACH(process, queue, pointers) { put_u32(file, process - data); }
+}
+
+// Written next to `path`, synced and renamed over it, so a crash while saving
+// leaves the previous checkpoint intact
+void save_checkpoint(const char *path, struct simulation *sim,
+                     const struct process *data, u32 size, u64 trace_hash) {
+  char temp_path[PATH_MAX];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+  FILE *file = fopen(temp_path, "wb");
+  if (file == NULL) {
+    int err = errno;
+    perror("fopen");
+    exit(err);
+  }
+
+  fwrite(CHECKPOINT_MAGIC, 1, sizeof(CHECKPOINT_MAGIC) - 1, file);
+  fwrite(&trace_hash, sizeof(trace_hash), 1, file);
+  put_u32(file, size);
+
+  put_u32(file, sim->current_time);
+  put_u32(file, sim->run_time);
+  put_u32(file, sim->queue_idx);
+  put_u32(file, sim->blocked_count);
+  put_u64(file, sim->total_waiting_time);
+  put_u64(file, sim->total_response_time);
+  put_u32(file, sim->end_time);
+  put_u32(file, sim->cpu_busy_time);
+  put_u32(file, sim->overlap_time);
+
+  for (u32 i = 0; i < size; ++i) {
+    put_u32(file, data[i].remaining_time);
+    put_u32(file, data[i].first_run);
+    put_u32(file, data[i].next_burst);
+    put_u32(file, data[i].io_remaining);
+    put_u32(file, data[i].io_submitted);
+    put_u32(file, data[i].io_time);
+  }
+
+  put_queue(file, &sim->list, data);
+  for (u32 d = 0; d < DEVICE_COUNT; ++d) {
+    put_u32(file, sim->devices[d].busy_time);
+    put_u32(file, sim->devices[d].requests);
+    put_u64(file, sim->devices[d].total_queueing_delay);
+    put_queue(file, &sim->devices[d].queue, data);
+  }
+
+  // Otherwise the rename can reach the disk before the data does
+  if (ferror(file) || fflush(file) != 0 || fsync(fileno(file)) == -1 ||
+      fclose(file) != 0 || rename(temp_path, path) == -1) {
+    int err = errno;
+    perror("save_checkpoint");
+    exit(err);
+  }
+}
+
+static u32 get_u32(FILE *file, const char *path) {
+  u32 value;
+  if (fread(&value, sizeof(value), 1, file) != 1) {
+    printf("Checkpoint %s is truncated\n", path);
+    exit(EINVAL);
+  }
+  return value;
+}
+
+static u64 get_u64(FILE *file, const char *path) {
+  u64 value;
+  if (fread(&value, sizeof(value), 1, file) != 1) {
+    printf("Checkpoint %s is truncated\n", path);
+    exit(EINVAL);
+  }
+  return value;
+}
+
+static void get_queue(FILE *file, const char *path,
+                      struct process_list *queue, struct process *data,
+                      u32 size) {
+  u32 length = get_u32(file, path);
+  for (u32 i = 0; i < length; ++i) {
+    u32 index = get_u32(file, path);
+    if (index >= size) {
+      printf("Checkpoint %s refers to process %u of %u\n", path, index, size);
+      exit(EINVAL);
+    }
+    TAILQ_INSERT_TAIL(queue, &data[index], pointers);
+  }
+}
+
+// Restores a checkpoint into a fresh `sim`, with `data` sorted by arrival
+void load_checkpoint(const char *path, struct simulation *sim,
+                     struct process *data, u32 size, u64 trace_hash) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    int err = errno;
+    perror("fopen");
+    exit(err);
+  }
+
+  char magic[sizeof(CHECKPOINT_MAGIC) - 1];
+  u64 saved_hash;
+  if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+      memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0 ||
+      fread(&saved_hash, sizeof(saved_hash), 1, file) != 1) {
+    printf("%s is not a checkpoint\n", path);
+    exit(EINVAL);
+  }
+  if (saved_hash != trace_hash || get_u32(file, path) != size) {
+    printf("Checkpoint %s is of a different trace\n", path);
+    exit(EINVAL);
+  }
+
+  sim->current_time = get_u32(file, path);
+  sim->run_time = get_u32(file, path);
+  sim->queue_idx = get_u32(file, path);
+  sim->blocked_count = get_u32(file, path);
+  sim->total_waiting_time = get_u64(file, path);
+  sim->total_response_time = get_u64(file, path);
+  sim->end_time = get_u32(file, path);
+  sim->cpu_busy_time = get_u32(file, path);
+  sim->overlap_time = get_u32(file, path);
+
+  for (u32 i = 0; i < size; ++i) {
+    data[i].remaining_time = get_u32(file, path);
+    data[i].first_run = get_u32(file, path);
+    data[i].next_burst = get_u32(file, path);
+    data[i].io_remaining = get_u32(file, path);
+    data[i].io_submitted = get_u32(file, path);
+    data[i].io_time = get_u32(file, path);
+    // Past the last burst once a process has finished
+    if (data[i].next_burst > data[i].burst_count) {
+      printf("Checkpoint %s is corrupt\n", path);
+      exit(EINVAL);
+    }
+  }
+
+  get_queue(file, path, &sim->list, data, size);
+  for (u32 d = 0; d < DEVICE_COUNT; ++d) {
+    sim->devices[d].busy_time = get_u32(file, path);
+    sim->devices[d].requests = get_u32(file, path);
+    sim->devices[d].total_queueing_delay = get_u64(file, path);
+    get_queue(file, path, &sim->devices[d].queue, data, size);
+  }
+
+  fclose(file);
+}
+
+// Usage: rr TRACE QUANTUM [-c CHECKPOINT [-e INTERVAL]] [-r CHECKPOINT]
+//
+// -c saves the simulation to CHECKPOINT every INTERVAL time units (a million
+// by default), replacing the previous one. -r resumes from a checkpoint of
+// the same trace instead of starting over. The quantum can differ from the
+// one the checkpoint was made with, so resuming one checkpoint with several
+// quanta compares what-ifs from the same point without simulating up to it
+// each time.
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
+  const char *checkpoint_path = NULL;
+  const char *resume_path = NULL;
+  u32 checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:e:r:")) != -1) {
+    switch (opt) {
+      case 'c':
+        checkpoint_path = optarg;
+        break;
+      case 'e':
+        checkpoint_interval = next_int_from_c_str(optarg);
+        break;
+      case 'r':
+        resume_path = optarg;
+        break;
+      default:
+        return EINVAL;
+    }
+  }
+  if (argc - optind != 2 || checkpoint_interval == 0) {
     return EINVAL;
   }
   struct process *data;
   u32 size;
-  init_processes(argv[1], &data, &size);
-
-  u32 quantum_length = next_int_from_c_str(argv[2]);
+  struct burst *bursts;
+  u64 trace_hash;
+  init_processes(argv[optind], &data, &size, &bursts, &trace_hash);
 
-  struct process_list list;
-  TAILQ_INIT(&list);
+  u32 quantum_length = next_int_from_c_str(argv[optind + 1]);
 
-  u32 total_waiting_time = 0;
-  u32 total_response_time = 0;
+  struct simulation sim = {0};
+  TAILQ_INIT(&sim.list);
 
   /* Your code here */
-  if (size > 0 && quantum_length > 0) {
-    u32 current_time = 0;
-    u32 run_time = 0;
-
-    u32 queue_idx = 0;
+  for (u32 d = 0; d < DEVICE_COUNT; ++d) {
+    TAILQ_INIT(&sim.devices[d].queue);
+  }
 
+  if (size > 0 && quantum_length > 0) {
     struct process *current = NULL;
 
     // I swear to god this better be stable sort 🙏
     qsort(data, size, sizeof(struct process), compare_by_arrival);
 
+    // The checkpoint refers to processes by their place in arrival order,
+    // so it is loaded once they are sorted
+    if (resume_path != NULL) {
+      load_checkpoint(resume_path, &sim, data, size, trace_hash);
+      current = TAILQ_FIRST(&sim.list);
+    }
+    u32 start_time = sim.current_time;
+
     // Exit loop when all processes are done executing.
     //
     // "Runs" a process at the end, so all checking happens at the start
-    while (queue_idx < size || (queue_idx == size && !TAILQ_EMPTY(&list))) {
-      // printf("%d:\n", current_time);
-      // Add new process to list if now is arrival time
-      if (queue_idx < size && data[queue_idx].arrival_time == current_time) {
-        current = insert_and_get_current(&list, &data[queue_idx], current);
+    while (sim.queue_idx < size ||
+           (sim.queue_idx == size && !TAILQ_EMPTY(&sim.list)) ||
+           sim.blocked_count > 0) {
+      // Saved before anything happens at this time, which is where a run
+      // resumed from it carries on
+      if (checkpoint_path != NULL && sim.current_time > start_time &&
+          sim.current_time % checkpoint_interval == 0) {
+        save_checkpoint(checkpoint_path, &sim, data, size, trace_hash);
+      }
 
-        queue_idx++;
+      // printf("%d:\n", sim.current_time);
+      // Add new processes to list if now is their arrival time. Several may
+      // arrive at once.
+      while (sim.queue_idx < size &&
+             data[sim.queue_idx].arrival_time == sim.current_time) {
+        current =
+            insert_and_get_current(&sim.list, &data[sim.queue_idx], current);
+
+        sim.queue_idx++;
       }
 
-      // Switch to next process if current is finished. Null check is necessary
-      // because current does not exist when the list is empty.
+      // Processes whose I/O finished rejoin the list like new arrivals
+      for (u32 d = 0; d < DEVICE_COUNT; ++d) {
+        struct process *woken = TAILQ_FIRST(&sim.devices[d].queue);
+        if (woken == NULL || woken->io_remaining > 0) {
+          continue;
+        }
+
+        TAILQ_REMOVE(&sim.devices[d].queue, woken, pointers);
+        u32 blocked_time = sim.current_time - woken->io_submitted;
+        sim.devices[d].total_queueing_delay +=
+            blocked_time - woken->bursts[woken->next_burst - 1].io_time;
+        woken->io_time += blocked_time;
+        sim.blocked_count--;
+
+        current = insert_and_get_current(&sim.list, woken, current);
+      }
+
+      // Switch to next process if current's CPU burst is finished. Null check
+      // is necessary because current does not exist when the list is empty.
       if (current != NULL && current->remaining_time == 0) {
-        total_waiting_time +=
-            current_time - current->arrival_time - current->burst_time;
-        current = remove_and_get_next(&list, current);
-        run_time = 0;
+        struct process *finished = current;
+        current = remove_and_get_next(&sim.list, current);
+        sim.run_time = 0;
+
+        const struct burst *burst = &finished->bursts[finished->next_burst++];
+        if (burst->io_time > 0) {
+          // Blocks until its device has served it
+          struct device *device = &sim.devices[burst->device];
+          TAILQ_INSERT_TAIL(&device->queue, finished, pointers);
+          device->requests++;
+          finished->io_remaining = burst->io_time;
+          finished->io_submitted = sim.current_time;
+          finished->remaining_time =
+              finished->bursts[finished->next_burst].cpu_time;
+          sim.blocked_count++;
+        } else {
+          // Time neither running nor blocked was spent waiting in the list
+          sim.total_waiting_time += sim.current_time - finished->arrival_time -
+                                    finished->burst_time - finished->io_time;
+          sim.end_time = sim.current_time;
+        }
       }
 
-      // Interrupt process when it uses up a quantum
-      if (run_time == quantum_length) {
+      // Interrupt process when it uses up a quantum. A run resumed with a
+      // shorter quantum may find it already used up.
+      if (sim.run_time >= quantum_length) {
         struct process *timed_out_process = current;
-        current = remove_and_get_next(&list, current);
-        current = insert_and_get_current(&list, timed_out_process, current);
+        current = remove_and_get_next(&sim.list, current);
+        current = insert_and_get_current(&sim.list, timed_out_process, current);
 
-        run_time = 0;
+        sim.run_time = 0;
       }
 
       // "Run" current process if it exists
       if (current != NULL) {
         if (current->first_run == true) {
           // printf("pid %d arrived: %d, now: %d\n", current->pid,
-          //        current->arrival_time, current_time);
-          total_response_time += current_time - current->arrival_time;
+          //        current->arrival_time, sim.current_time);
+          sim.total_response_time += sim.current_time - current->arrival_time;
           current->first_run = false;
         }
 
         current->remaining_time--;
-        run_time++;
+        sim.run_time++;
+        sim.cpu_busy_time++;
+      }
+
+      // Every device serves one time unit of a request, independently of the
+      // CPU
+      bool io_busy = false;
+      for (u32 d = 0; d < DEVICE_COUNT; ++d) {
+        struct process *served = TAILQ_FIRST(&sim.devices[d].queue);
+        if (served == NULL) {
+          continue;
+        }
+
+        served->io_remaining--;
+        sim.devices[d].busy_time++;
+        io_busy = true;
+        // A finished request stays first until its process is woken
+        if (DEVICE_DISCIPLINES[d] == ROUND_ROBIN && served->io_remaining > 0) {
+          TAILQ_REMOVE(&sim.devices[d].queue, served, pointers);
+          TAILQ_INSERT_TAIL(&sim.devices[d].queue, served, pointers);
+        }
       }
-      current_time++;
-      // printf("run_time: %d\n", run_time);
+      if (current != NULL && io_busy) {
+        sim.overlap_time++;
+      }
+
+      sim.current_time++;
+      // printf("run_time: %d\n", sim.run_time);
     }
   }
 
   /* End of "Your code here" */
 
   printf("Average waiting time: %.2f\n",
-         (float)total_waiting_time / (float)size);
+         (float)sim.total_waiting_time / (float)size);
   printf("Average response time: %.2f\n",
-         (float)total_response_time / (float)size);
+         (float)sim.total_response_time / (float)size);
+
+  // Only traces with I/O get the utilization report, so CPU-only traces
+  // print exactly what they used to
+  u32 io_requests = 0;
+  for (u32 d = 0; d < DEVICE_COUNT; ++d) {
+    io_requests += sim.devices[d].requests;
+  }
+  if (io_requests > 0 && sim.end_time > 0) {
+    printf("Total time: %u\n", sim.end_time);
+    printf("CPU utilization: %.2f%%\n",
+           100.0f * (float)sim.cpu_busy_time / (float)sim.end_time);
+    for (u32 d = 0; d < DEVICE_COUNT; ++d) {
+      if (sim.devices[d].requests == 0) {
+        continue;
+      }
+      printf("%s utilization: %.2f%%, average queueing delay: %.2f over %u "
+             "requests\n",
+             DEVICE_NAMES[d],
+             100.0f * (float)sim.devices[d].busy_time / (float)sim.end_time,
+             (float)sim.devices[d].total_queueing_delay /
+                 (float)sim.devices[d].requests,
+             sim.devices[d].requests);
+    }
+    // Time the CPU and devices would have taken in turns on top of the total
+    printf("CPU and I/O overlap: %u, %.2f%% of total time\n", sim.overlap_time,
+           100.0f * (float)sim.overlap_time / (float)sim.end_time);
+  }
 
   free(data);
+  free(bursts);
   return 0;
 }
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "hash-table-base.h"
+
+/* Where the time goes in a table, per bucket. The counters are only kept
+   when built with -DHASH_TABLE_STATS, otherwise the tables compile exactly
+   as before and only the chain lengths are filled in. */
+struct hash_table_bucket_stats {
+  uint64_t acquisitions;
+  /* Acquisitions that found the mutex held, and how long they waited */
+  uint64_t contended;
+  uint64_t wait_ns;
+  uint64_t lookups;
+  uint64_t strcmps;
+  /* Counted when the stats are collected */
+  uint32_t chain_length;
+};
+
+/* Copy out every bucket's stats. Call them while no other thread uses the
+   table. */
+struct hash_table_v1;
+struct hash_table_v2;
+void hash_table_v1_stats_collect(
+    struct hash_table_v1 *hash_table,
+    struct hash_table_bucket_stats buckets[HASH_TABLE_CAPACITY]);
+void hash_table_v2_stats_collect(
+    struct hash_table_v2 *hash_table,
+    struct hash_table_bucket_stats buckets[HASH_TABLE_CAPACITY]);
+
+#ifdef HASH_TABLE_STATS
+
+static inline uint64_t hash_table_stats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Only a failed trylock pays for the clock. The counters are updated with
+   the mutex held. */
+static inline void hash_table_stats_lock(
+    pthread_mutex_t *mutex, struct hash_table_bucket_stats *stats) {
+  int error = pthread_mutex_trylock(mutex);
+  if (error == EBUSY) {
+    uint64_t start = hash_table_stats_now();
+    error = pthread_mutex_lock(mutex);
+    stats->contended++;
+    stats->wait_ns += hash_table_stats_now() - start;
+  }
+  if (error != 0) {
+    exit(error);
+  }
+  stats->acquisitions++;
+}
+
+/* Lookups run without the mutex */
+static inline void hash_table_stats_lookup(
+    struct hash_table_bucket_stats *stats, uint64_t strcmps) {
+  __atomic_fetch_add(&stats->lookups, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&stats->strcmps, strcmps, __ATOMIC_RELAXED);
+}
+
+#endif
+
+#define HASH_TABLE_STATS_CHAINS 16
+#define HASH_TABLE_STATS_COLUMNS 64
+#define HASH_TABLE_STATS_HOTTEST 10
+
+/* What the heat map shades by: how often a bucket was used if that was
+   counted, otherwise how long its chain is */
+static inline uint64_t hash_table_stats_heat(
+    const struct hash_table_bucket_stats *bucket) {
+#ifdef HASH_TABLE_STATS
+  return bucket->acquisitions + bucket->lookups;
+#else
+  return bucket->chain_length;
+#endif
+}
+
+/* Totals, a histogram of chain lengths, a map of every bucket shaded by
+   heat and the hottest buckets. A variance to mean ratio of chain lengths
+   well above 1 means bernstein_hash spreads the keys unevenly. */
+static inline void hash_table_stats_report(
+    const struct hash_table_bucket_stats buckets[HASH_TABLE_CAPACITY],
+    FILE *out) {
+  static const char RAMP[] = " .:-=+*#%@";
+  const int levels = sizeof(RAMP) - 2;
+
+  struct hash_table_bucket_stats total = {0};
+  uint64_t chains[HASH_TABLE_STATS_CHAINS + 1] = {0};
+  uint64_t squares = 0;
+  uint64_t max_heat = 0;
+  for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+    const struct hash_table_bucket_stats *bucket = &buckets[i];
+    total.acquisitions += bucket->acquisitions;
+    total.contended += bucket->contended;
+    total.wait_ns += bucket->wait_ns;
+    total.lookups += bucket->lookups;
+    total.strcmps += bucket->strcmps;
+    total.chain_length += bucket->chain_length;
+    uint32_t length = bucket->chain_length;
+    chains[length < HASH_TABLE_STATS_CHAINS ? length
+                                            : HASH_TABLE_STATS_CHAINS]++;
+    squares += (uint64_t)length * length;
+    uint64_t heat = hash_table_stats_heat(bucket);
+    if (heat > max_heat) {
+      max_heat = heat;
+    }
+  }
+
+  double load = (double)total.chain_length / HASH_TABLE_CAPACITY;
+  double variance = (double)squares / HASH_TABLE_CAPACITY - load * load;
+  fprintf(out, "%u keys in %u buckets, %.2f per bucket, ",
+          total.chain_length, HASH_TABLE_CAPACITY, load);
+  fprintf(out, "chain length variance to mean %.2f\n",
+          load > 0 ? variance / load : 0.0);
+#ifdef HASH_TABLE_STATS
+  fprintf(out, "%llu lookups, %.2f strcmp calls each\n",
+          (unsigned long long)total.lookups,
+          total.lookups > 0 ? (double)total.strcmps / total.lookups : 0.0);
+  fprintf(out,
+          "%llu lock acquisitions, %llu contended (%.1f%%), %.3f ms waiting "
+          "(%.1f us per contended acquisition)\n",
+          (unsigned long long)total.acquisitions,
+          (unsigned long long)total.contended,
+          total.acquisitions > 0 ? 100.0 * total.contended / total.acquisitions
+                                 : 0.0,
+          total.wait_ns / 1e6,
+          total.contended > 0 ? total.wait_ns / 1e3 / total.contended : 0.0);
+#else
+  fprintf(out, "Built without -DHASH_TABLE_STATS, so only chains are shown\n");
+#endif
+
+  fprintf(out, "\nchain    buckets\n");
+  for (int i = 0; i <= HASH_TABLE_STATS_CHAINS; ++i) {
+    if (chains[i] > 0) {
+      fprintf(out, "%5d%s %10llu\n", i,
+              i == HASH_TABLE_STATS_CHAINS ? "+" : " ",
+              (unsigned long long)chains[i]);
+    }
+  }
+
+  /* Shaded on a log scale, since a few hot buckets would wash out the rest
+     on a linear one */
+  int max_bits = 64 - __builtin_clzll(max_heat | 1);
+  fprintf(out, "\nheat map, %d buckets per row, '%c' to '%c' up to %llu\n",
+          HASH_TABLE_STATS_COLUMNS, RAMP[1], RAMP[levels],
+          (unsigned long long)max_heat);
+  for (size_t row = 0; row < HASH_TABLE_CAPACITY;
+       row += HASH_TABLE_STATS_COLUMNS) {
+    fprintf(out, "%6zu ", row);
+    for (size_t i = row;
+         i < row + HASH_TABLE_STATS_COLUMNS && i < HASH_TABLE_CAPACITY; ++i) {
+      uint64_t heat = hash_table_stats_heat(&buckets[i]);
+      int level = 0;
+      if (heat > 0) {
+        int bits = 64 - __builtin_clzll(heat);
+        level = max_bits == 1 ? levels
+                              : 1 + (bits - 1) * (levels - 1) / (max_bits - 1);
+      }
+      fputc(RAMP[level], out);
+    }
+    fputc('\n', out);
+  }
+
+  /* Picked by repeated scans, there are only a few */
+  bool picked[HASH_TABLE_CAPACITY] = {0};
+  fprintf(out, "\nbucket  chain  acquired  contended   wait_ms    lookups  "
+               "strcmp/lookup\n");
+  for (int n = 0; n < HASH_TABLE_STATS_HOTTEST; ++n) {
+    size_t hottest = HASH_TABLE_CAPACITY;
+    for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+      if (!picked[i] && (hottest == HASH_TABLE_CAPACITY ||
+                         hash_table_stats_heat(&buckets[i]) >
+                             hash_table_stats_heat(&buckets[hottest]))) {
+        hottest = i;
+      }
+    }
+    const struct hash_table_bucket_stats *bucket = &buckets[hottest];
+    if (hash_table_stats_heat(bucket) == 0) {
+      break;
+    }
+    picked[hottest] = true;
+    fprintf(out, "%6zu %6u %9llu %10llu %9.3f %10llu %14.2f\n", hottest,
+            bucket->chain_length, (unsigned long long)bucket->acquisitions,
+            (unsigned long long)bucket->contended, bucket->wait_ns / 1e6,
+            (unsigned long long)bucket->lookups,
+            bucket->lookups > 0 ? (double)bucket->strcmps / bucket->lookups
+                                : 0.0);
+  }
+}
@@ -5,6 +5,7 @@
 #include <sys/queue.h>
 
 #include "hash-table-base.h"
+#include "hash-table-stats.h"
 
 struct list_entry {
   const char *key;
@@ -16,6 +17,9 @@ SLIST_HEAD(list_head, list_entry);
 
 struct hash_table_entry {
   struct list_head list_head;
+#ifdef HASH_TABLE_STATS
+  struct hash_table_bucket_stats stats;
+#endif
 };
 
 struct hash_table_v1 {
@@ -56,13 +60,24 @@ static struct list_entry *get_list_entry(struct hash_table_v1 *hash_table,
   assert(key != NULL);
 
   struct list_entry *entry = NULL;
+#ifdef HASH_TABLE_STATS
+  uint64_t strcmps = 0;
+#endif
 
   SLIST_FOREACH(entry, list_head, pointers) {
+#ifdef HASH_TABLE_STATS
+    ++strcmps;
+#endif
     if (strcmp(entry->key, key) == 0) {
-      return entry;
+      break;
     }
   }
-  return NULL;
+#ifdef HASH_TABLE_STATS
+  /* list_head is the first member of its bucket */
+  hash_table_stats_lookup(&((struct hash_table_entry *)list_head)->stats,
+                          strcmps);
+#endif
+  return entry;
 }
 
 bool hash_table_v1_contains(struct hash_table_v1 *hash_table, const char *key) {
@@ -75,27 +90,33 @@ bool hash_table_v1_contains(struct hash_table_v1 *hash_table, const char *key) {
 
 void hash_table_v1_add_entry(struct hash_table_v1 *hash_table, const char *key,
                              uint32_t value) {
+  struct hash_table_entry *hash_table_entry =
+      get_hash_table_entry(hash_table, key);
+
+  /* The one mutex's contention is charged to the bucket being changed */
+#ifdef HASH_TABLE_STATS
+  hash_table_stats_lock(&mutex, &hash_table_entry->stats);
+  int error = 0;
+#else
   int error = pthread_mutex_lock(&mutex);
   if (error != 0) {
     exit(error);
   }
+#endif
 
-  struct hash_table_entry *hash_table_entry =
-      get_hash_table_entry(hash_table, key);
   struct list_head *list_head = &hash_table_entry->list_head;
   struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
 
   /* Update the value if it already exists */
   if (list_entry != NULL) {
     list_entry->value = value;
-    return;
+  } else {
+    list_entry = calloc(1, sizeof(struct list_entry));
+    list_entry->key = key;
+    list_entry->value = value;
+    SLIST_INSERT_HEAD(list_head, list_entry, pointers);
   }
 
-  list_entry = calloc(1, sizeof(struct list_entry));
-  list_entry->key = key;
-  list_entry->value = value;
-  SLIST_INSERT_HEAD(list_head, list_entry, pointers);
-
   error = pthread_mutex_unlock(&mutex);
   if (error != 0) {
     exit(error);
@@ -112,6 +133,23 @@ uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
   return list_entry->value;
 }
 
+void hash_table_v1_stats_collect(
+    struct hash_table_v1 *hash_table,
+    struct hash_table_bucket_stats buckets[HASH_TABLE_CAPACITY]) {
+  for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+    struct hash_table_entry *entry = &hash_table->entries[i];
+#ifdef HASH_TABLE_STATS
+    buckets[i] = entry->stats;
+#else
+    buckets[i] = (struct hash_table_bucket_stats){0};
+#endif
+    struct list_entry *list_entry = NULL;
+    SLIST_FOREACH(list_entry, &entry->list_head, pointers) {
+      ++buckets[i].chain_length;
+    }
+  }
+}
+
 void hash_table_v1_destroy(struct hash_table_v1 *hash_table) {
   for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
     struct hash_table_entry *entry = &hash_table->entries[i];
@@ -4,7 +4,16 @@
 #include <string.h>
 #include <sys/queue.h>
 
-#include "hash-table-base.h"
+#include "hash-table-stats.h"
+#include "hash-table-v2.h"
+
+/* Pending additions a combiner holds before it merges them. A power of 2,
+   and merged once three quarters full so probes stay short. */
+#define COMBINER_SLOTS 256
+#define COMBINER_MAX_USED (COMBINER_SLOTS * 3 / 4)
+/* Additions a combiner takes before merging even if it isn't full, so the
+   shared table never lags far behind on hot keys */
+#define COMBINER_BATCH 4096
 
 struct list_entry {
   const char *key;
@@ -17,6 +26,9 @@ SLIST_HEAD(list_head, list_entry);
 struct hash_table_entry {
   struct list_head list_head;
   pthread_mutex_t mutex;
+#ifdef HASH_TABLE_STATS
+  struct hash_table_bucket_stats stats;
+#endif
 };
 
 struct hash_table_v2 {
@@ -54,13 +66,24 @@ static struct list_entry *get_list_entry(struct hash_table_v2 *hash_table,
   assert(key != NULL);
 
   struct list_entry *entry = NULL;
+#ifdef HASH_TABLE_STATS
+  uint64_t strcmps = 0;
+#endif
 
   SLIST_FOREACH(entry, list_head, pointers) {
+#ifdef HASH_TABLE_STATS
+    ++strcmps;
+#endif
     if (strcmp(entry->key, key) == 0) {
-      return entry;
+      break;
     }
   }
-  return NULL;
+#ifdef HASH_TABLE_STATS
+  /* list_head is the first member of its bucket */
+  hash_table_stats_lookup(&((struct hash_table_entry *)list_head)->stats,
+                          strcmps);
+#endif
+  return entry;
 }
 
 bool hash_table_v2_contains(struct hash_table_v2 *hash_table, const char *key) {
@@ -71,15 +94,39 @@ bool hash_table_v2_contains(struct hash_table_v2 *hash_table, const char *key) {
   return list_entry != NULL;
 }
 
-void hash_table_v2_add_entry(struct hash_table_v2 *hash_table, const char *key,
-                             uint32_t value) {
-  struct hash_table_entry *hash_table_entry =
-      get_hash_table_entry(hash_table, key);
-
+static void lock_entry(struct hash_table_entry *hash_table_entry) {
+#ifdef HASH_TABLE_STATS
+  hash_table_stats_lock(&hash_table_entry->mutex, &hash_table_entry->stats);
+#else
   int error = pthread_mutex_lock(&hash_table_entry->mutex);
   if (error != 0) {
     exit(error);
   }
+#endif
+}
+
+static void unlock_entry(struct hash_table_entry *hash_table_entry) {
+  int error = pthread_mutex_unlock(&hash_table_entry->mutex);
+  if (error != 0) {
+    exit(error);
+  }
+}
+
+static struct list_entry *insert_list_entry(struct list_head *list_head,
+                                            const char *key, uint32_t value) {
+  struct list_entry *list_entry = calloc(1, sizeof(struct list_entry));
+  assert(list_entry != NULL);
+  list_entry->key = key;
+  list_entry->value = value;
+  SLIST_INSERT_HEAD(list_head, list_entry, pointers);
+  return list_entry;
+}
+
+void hash_table_v2_add_entry(struct hash_table_v2 *hash_table, const char *key,
+                             uint32_t value) {
+  struct hash_table_entry *hash_table_entry =
+      get_hash_table_entry(hash_table, key);
+  lock_entry(hash_table_entry);
 
   struct list_head *list_head = &hash_table_entry->list_head;
   struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
@@ -87,20 +134,157 @@ void hash_table_v2_add_entry(struct hash_table_v2 *hash_table, const char *key,
   /* Update the value if it already exists */
   if (list_entry != NULL) {
     list_entry->value = value;
-    return;
+  } else {
+    insert_list_entry(list_head, key, value);
   }
 
-  list_entry = calloc(1, sizeof(struct list_entry));
-  list_entry->key = key;
-  list_entry->value = value;
-  SLIST_INSERT_HEAD(list_head, list_entry, pointers);
+  unlock_entry(hash_table_entry);
+}
 
-  error = pthread_mutex_unlock(&hash_table_entry->mutex);
-  if (error != 0) {
-    exit(error);
+uint32_t hash_table_v2_upsert(struct hash_table_v2 *hash_table,
+                              const char *key, hash_table_v2_update update,
+                              void *arg) {
+  struct hash_table_entry *hash_table_entry =
+      get_hash_table_entry(hash_table, key);
+  lock_entry(hash_table_entry);
+
+  struct list_head *list_head = &hash_table_entry->list_head;
+  struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+  uint32_t value;
+  if (list_entry != NULL) {
+    value = update(list_entry->value, true, arg);
+    list_entry->value = value;
+  } else {
+    value = update(0, false, arg);
+    insert_list_entry(list_head, key, value);
+  }
+
+  unlock_entry(hash_table_entry);
+  return value;
+}
+
+/* The caller holds the bucket's mutex */
+static uint32_t add_locked(struct hash_table_v2 *hash_table,
+                           struct hash_table_entry *hash_table_entry,
+                           const char *key, uint32_t delta) {
+  struct list_head *list_head = &hash_table_entry->list_head;
+  struct list_entry *list_entry = get_list_entry(hash_table, key, list_head);
+  if (list_entry == NULL) {
+    insert_list_entry(list_head, key, delta);
+    return 0;
+  }
+  uint32_t value = list_entry->value;
+  list_entry->value = value + delta;
+  return value;
+}
+
+uint32_t hash_table_v2_fetch_add(struct hash_table_v2 *hash_table,
+                                 const char *key, uint32_t delta) {
+  struct hash_table_entry *hash_table_entry =
+      get_hash_table_entry(hash_table, key);
+  lock_entry(hash_table_entry);
+  uint32_t value = add_locked(hash_table, hash_table_entry, key, delta);
+  unlock_entry(hash_table_entry);
+  return value;
+}
+
+struct combiner_slot {
+  const char *key;
+  uint32_t hash;
+  uint32_t delta;
+};
+
+struct hash_table_v2_combiner {
+  struct hash_table_v2 *hash_table;
+  /* Open addressing with linear probing, NULL keys are free */
+  struct combiner_slot slots[COMBINER_SLOTS];
+  size_t used;
+  /* Additions since the last merge */
+  size_t added;
+};
+
+struct hash_table_v2_combiner *
+hash_table_v2_combiner_create(struct hash_table_v2 *hash_table) {
+  struct hash_table_v2_combiner *combiner =
+      calloc(1, sizeof(struct hash_table_v2_combiner));
+  assert(combiner != NULL);
+  combiner->hash_table = hash_table;
+  return combiner;
+}
+
+static uint32_t slot_bucket(const struct combiner_slot *slot) {
+  return slot->hash % HASH_TABLE_CAPACITY;
+}
+
+static int compare_buckets(const void *left, const void *right) {
+  uint32_t l = slot_bucket(left);
+  uint32_t r = slot_bucket(right);
+  return (l > r) - (l < r);
+}
+
+void hash_table_v2_combiner_flush(struct hash_table_v2_combiner *combiner) {
+  /* Sorted by bucket, so each bucket's mutex is taken once per batch */
+  struct combiner_slot pending[COMBINER_MAX_USED];
+  size_t count = 0;
+  for (size_t i = 0; i < COMBINER_SLOTS; ++i) {
+    if (combiner->slots[i].key != NULL) {
+      pending[count++] = combiner->slots[i];
+      combiner->slots[i].key = NULL;
+    }
+  }
+  combiner->used = 0;
+  combiner->added = 0;
+  qsort(pending, count, sizeof(struct combiner_slot), compare_buckets);
+
+  struct hash_table_v2 *hash_table = combiner->hash_table;
+  for (size_t i = 0; i < count;) {
+    uint32_t bucket = slot_bucket(&pending[i]);
+    struct hash_table_entry *hash_table_entry = &hash_table->entries[bucket];
+    lock_entry(hash_table_entry);
+    for (; i < count && slot_bucket(&pending[i]) == bucket; ++i) {
+      add_locked(hash_table, hash_table_entry, pending[i].key,
+                 pending[i].delta);
+    }
+    unlock_entry(hash_table_entry);
   }
 }
 
+void hash_table_v2_combiner_add(struct hash_table_v2_combiner *combiner,
+                                const char *key, uint32_t delta) {
+  assert(key != NULL);
+  uint32_t hash = bernstein_hash(key);
+  size_t index = hash & (COMBINER_SLOTS - 1);
+  struct combiner_slot *slot = &combiner->slots[index];
+  while (slot->key != NULL &&
+         (slot->hash != hash || strcmp(slot->key, key) != 0)) {
+    index = (index + 1) & (COMBINER_SLOTS - 1);
+    slot = &combiner->slots[index];
+  }
+
+  if (slot->key != NULL) {
+    slot->delta += delta;
+  } else {
+    if (combiner->used == COMBINER_MAX_USED) {
+      hash_table_v2_combiner_flush(combiner);
+      /* Everything is free again, so the key's first choice is too */
+      slot = &combiner->slots[hash & (COMBINER_SLOTS - 1)];
+    }
+    slot->key = key;
+    slot->hash = hash;
+    slot->delta = delta;
+    ++combiner->used;
+  }
+
+  if (++combiner->added == COMBINER_BATCH) {
+    hash_table_v2_combiner_flush(combiner);
+  }
+}
+
+void hash_table_v2_combiner_destroy(struct hash_table_v2_combiner *combiner) {
+  hash_table_v2_combiner_flush(combiner);
+  free(combiner);
+}
+
 uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
                                  const char *key) {
   struct hash_table_entry *hash_table_entry =
@@ -111,6 +295,23 @@ uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
   return list_entry->value;
 }
 
+void hash_table_v2_stats_collect(
+    struct hash_table_v2 *hash_table,
+    struct hash_table_bucket_stats buckets[HASH_TABLE_CAPACITY]) {
+  for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+    struct hash_table_entry *entry = &hash_table->entries[i];
+#ifdef HASH_TABLE_STATS
+    buckets[i] = entry->stats;
+#else
+    buckets[i] = (struct hash_table_bucket_stats){0};
+#endif
+    struct list_entry *list_entry = NULL;
+    SLIST_FOREACH(list_entry, &entry->list_head, pointers) {
+      ++buckets[i].chain_length;
+    }
+  }
+}
+
 void hash_table_v2_destroy(struct hash_table_v2 *hash_table) {
   for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
     struct hash_table_entry *entry = &hash_table->entries[i];
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "hash-table-base.h"
+
+/* Read-modify-write of a key's value, for tables that count things per key.
+   Each call holds the key's bucket mutex for the whole update. */
+
+/* Returns a key's new value given its old one, which is 0 if `found` is
+   false */
+typedef uint32_t (*hash_table_v2_update)(uint32_t value, bool found,
+                                         void *arg);
+
+/* Inserts the key if it is missing. Returns the new value. */
+uint32_t hash_table_v2_upsert(struct hash_table_v2 *hash_table,
+                              const char *key, hash_table_v2_update update,
+                              void *arg);
+
+/* Adds `delta` to the key's value, inserting it at 0 first if it is missing.
+   Returns the value from before. */
+uint32_t hash_table_v2_fetch_add(struct hash_table_v2 *hash_table,
+                                 const char *key, uint32_t delta);
+
+/* A thread's private table of pending additions. A thread that hits the
+   same keys over and over adds to its combiner instead, and only takes the
+   shared table's mutexes to merge a batch, once per bucket. Additions
+   aren't visible in the shared table until they are merged. */
+struct hash_table_v2_combiner;
+
+struct hash_table_v2_combiner *
+hash_table_v2_combiner_create(struct hash_table_v2 *hash_table);
+/* Merges on its own whenever the private table fills up */
+void hash_table_v2_combiner_add(struct hash_table_v2_combiner *combiner,
+                                const char *key, uint32_t delta);
+void hash_table_v2_combiner_flush(struct hash_table_v2_combiner *combiner);
+/* Flushes anything still pending */
+void hash_table_v2_combiner_destroy(struct hash_table_v2_combiner *combiner);
@@ -0,0 +1,100 @@
+#include <endian.h>
+#include <string.h>
+
+#include "bitmap.h"
+
+u64 bitmap_word(const u8 *bitmap, u32 index) {
+  u64 word;
+  memcpy(&word, bitmap + index * sizeof(u64), sizeof(u64));
+  return le64toh(word);
+}
+
+void bitmap_store(u8 *bitmap, u32 index, u64 word) {
+  word = htole64(word);
+  memcpy(bitmap + index * sizeof(u64), &word, sizeof(u64));
+}
+
+bool bitmap_test(const u8 *bitmap, u32 bit) {
+  return bitmap[bit / 8] & (1U << bit % 8);
+}
+
+/* Bits [start, end) of a word, with 0 <= start < end <= 64 */
+static u64 word_mask(u32 start, u32 end) {
+  u64 below_end = end == 64 ? ~0ULL : (1ULL << end) - 1;
+  return below_end & (~0ULL << start);
+}
+
+static void bitmap_apply(u8 *bitmap, u32 index, u64 mask, bool set) {
+  u64 word = bitmap_word(bitmap, index);
+  bitmap_store(bitmap, index, set ? word | mask : word & ~mask);
+}
+
+/* Sets or clears bits [start, end), filling whole words in between */
+static void bitmap_fill(u8 *bitmap, u32 start, u32 end, bool set) {
+  if (start >= end) {
+    return;
+  }
+  u32 first = start / 64;
+  u32 last = (end - 1) / 64;
+  if (first == last) {
+    bitmap_apply(bitmap, first, word_mask(start % 64, (end - 1) % 64 + 1), set);
+    return;
+  }
+
+  bitmap_apply(bitmap, first, word_mask(start % 64, 64), set);
+  memset(bitmap + (first + 1) * sizeof(u64), set ? 0xFF : 0,
+         (last - first - 1) * sizeof(u64));
+  bitmap_apply(bitmap, last, word_mask(0, (end - 1) % 64 + 1), set);
+}
+
+void bitmap_set_range(u8 *bitmap, u32 start, u32 end) {
+  bitmap_fill(bitmap, start, end, true);
+}
+
+void bitmap_clear_range(u8 *bitmap, u32 start, u32 end) {
+  bitmap_fill(bitmap, start, end, false);
+}
+
+u32 bitmap_count(const u8 *bitmap, u32 start, u32 end) {
+  u32 count = 0;
+  while (start < end) {
+    u32 bit = start % 64;
+    u32 stop = end - start < 64 - bit ? bit + (end - start) : 64;
+    count += __builtin_popcountll(bitmap_word(bitmap, start / 64) &
+                                  word_mask(bit, stop));
+    start += stop - bit;
+  }
+  return count;
+}
+
+u32 bitmap_next(const u8 *bitmap, u32 start, u32 end, bool set) {
+  if (start >= end) {
+    return end;
+  }
+  u32 index = start / 64;
+  u64 word = bitmap_word(bitmap, index) ^ (set ? 0 : ~0ULL);
+  word &= ~0ULL << (start % 64);
+  while (word == 0) {
+    if (++index * 64 >= end) {
+      return end;
+    }
+    word = bitmap_word(bitmap, index) ^ (set ? 0 : ~0ULL);
+  }
+  u32 bit = index * 64 + __builtin_ctzll(word);
+  return bit < end ? bit : end;
+}
+
+u32 bitmap_find_clear(const u8 *bitmap, u32 start, u32 end, u32 count,
+                      u32 *length) {
+  while (start < end) {
+    u32 run_start = bitmap_next(bitmap, start, end, false);
+    u32 run_end = bitmap_next(bitmap, run_start, end, true);
+    if (run_start < end && run_end - run_start >= count) {
+      *length = run_end - run_start;
+      return run_start;
+    }
+    start = run_end;
+  }
+  *length = 0;
+  return end;
+}
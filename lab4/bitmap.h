@@ -0,0 +1,32 @@
+/* Block and inode bitmaps, handled a 64-bit word at a time, for building
+   images and for checking them */
+
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+
+#include "ext2.h"
+
+/* Bit i of an ext2 bitmap is bit i % 8 of byte i / 8, so it is bit i % 64 of
+   a little-endian word. Bitmaps are whole words long, which block-sized
+   ones always are. */
+u64 bitmap_word(const u8 *bitmap, u32 index);
+void bitmap_store(u8 *bitmap, u32 index, u64 word);
+
+bool bitmap_test(const u8 *bitmap, u32 bit);
+
+/* These take bits [start, end) */
+void bitmap_set_range(u8 *bitmap, u32 start, u32 end);
+void bitmap_clear_range(u8 *bitmap, u32 start, u32 end);
+/* Number of set bits */
+u32 bitmap_count(const u8 *bitmap, u32 start, u32 end);
+/* First bit that is set, or clear if `set` is false. Returns `end` if there
+   is none. */
+u32 bitmap_next(const u8 *bitmap, u32 start, u32 end, bool set);
+/* Start of the first run of at least `count` clear bits, with the run's whole
+   length in `length`. Returns `end` if there is none. */
+u32 bitmap_find_clear(const u8 *bitmap, u32 start, u32 end, u32 count,
+                      u32 *length);
+
+#endif
@@ -1,21 +1,35 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <dirent.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/random.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
-typedef uint8_t u8;
-typedef uint16_t u16;
-typedef uint32_t u32;
-typedef int16_t i16;
-typedef int32_t i32;
+#include <linux/io_uring.h>
+
+#include "bitmap.h"
+#include "ext2-read.h"
+#include "ext2.h"
 
+/* linux/io_uring.h brings in the kernel's own, of the same size */
+#undef BLOCK_SIZE
 #define BLOCK_SIZE 1024
 #define BLOCK_OFFSET(i) ((i)*BLOCK_SIZE)
 #define NUM_BLOCKS 1024
@@ -40,123 +54,12 @@ typedef int32_t i32;
 #define NUM_FREE_INODES (NUM_INODES - LAST_INO)
 const u32 NUM_USED_DIRS = 2;
 
-/* http://www.nongnu.org/ext2-doc/ext2.html */
-/* http://www.science.smith.edu/~nhowe/262/oldlabs/ext2.html */
-
-#define EXT2_BAD_INO 1
-#define EXT2_ROOT_INO 2
-#define EXT2_GOOD_OLD_FIRST_INO 11
-
-#define EXT2_GOOD_OLD_REV 0
-
-#define EXT2_S_IFSOCK 0xC000
-#define EXT2_S_IFLNK 0xA000
-#define EXT2_S_IFREG 0x8000
-#define EXT2_S_IFBLK 0x6000
-#define EXT2_S_IFDIR 0x4000
-#define EXT2_S_IFCHR 0x2000
-#define EXT2_S_IFIFO 0x1000
-#define EXT2_S_ISUID 0x0800
-#define EXT2_S_ISGID 0x0400
-#define EXT2_S_ISVTX 0x0200
-#define EXT2_S_IRUSR 0x0100
-#define EXT2_S_IWUSR 0x0080
-#define EXT2_S_IXUSR 0x0040
-#define EXT2_S_IRGRP 0x0020
-#define EXT2_S_IWGRP 0x0010
-#define EXT2_S_IXGRP 0x0008
-#define EXT2_S_IROTH 0x0004
-#define EXT2_S_IWOTH 0x0002
-#define EXT2_S_IXOTH 0x0001
-
-#define EXT2_NDIR_BLOCKS 12
-#define EXT2_IND_BLOCK EXT2_NDIR_BLOCKS
-#define EXT2_DIND_BLOCK (EXT2_IND_BLOCK + 1)
-#define EXT2_TIND_BLOCK (EXT2_DIND_BLOCK + 1)
-#define EXT2_N_BLOCKS (EXT2_TIND_BLOCK + 1)
-
-#define EXT2_NAME_LEN 255
-const u32 EXT2_SUPER_MAGIC = 0xEF53;
 const u32 EXT2_ERRORS_CONTINUE = 1;
 
 const u32 BITS_PER_BYTE = 8;
 const u8 FREE = 0;
 const u8 USED = ~0;
 
-struct ext2_superblock {
-  u32 s_inodes_count;
-  u32 s_blocks_count;
-  u32 s_r_blocks_count;
-  u32 s_free_blocks_count;
-  u32 s_free_inodes_count;
-  u32 s_first_data_block;
-  u32 s_log_block_size;
-  i32 s_log_frag_size;
-  u32 s_blocks_per_group;
-  u32 s_frags_per_group;
-  u32 s_inodes_per_group;
-  u32 s_mtime;
-  u32 s_wtime;
-  u16 s_mnt_count;
-  i16 s_max_mnt_count;
-  u16 s_magic;
-  u16 s_state;
-  u16 s_errors;
-  u16 s_minor_rev_level;
-  u32 s_lastcheck;
-  u32 s_checkinterval;
-  u32 s_creator_os;
-  u32 s_rev_level;
-  u16 s_def_resuid;
-  u16 s_def_resgid;
-  u32 s_pad[5];
-  u8 s_uuid[16];
-  u8 s_volume_name[16];
-  u32 s_reserved[229];
-};
-
-struct ext2_block_group_descriptor {
-  u32 bg_block_bitmap;
-  u32 bg_inode_bitmap;
-  u32 bg_inode_table;
-  u16 bg_free_blocks_count;
-  u16 bg_free_inodes_count;
-  u16 bg_used_dirs_count;
-  u16 bg_pad;
-  u32 bg_reserved[3];
-};
-
-struct ext2_inode {
-  u16 i_mode;
-  u16 i_uid;
-  u32 i_size;
-  u32 i_atime;
-  u32 i_ctime;
-  u32 i_mtime;
-  u32 i_dtime;
-  u16 i_gid;
-  u16 i_links_count;
-  u32 i_blocks;
-  u32 i_flags;
-  u32 i_reserved1;
-  u32 i_block[EXT2_N_BLOCKS];
-  u32 i_version;
-  u32 i_file_acl;
-  u32 i_dir_acl;
-  u32 i_faddr;
-  u8 i_frag;
-  u8 i_fsize;
-  u16 i_pad1;
-  u32 i_reserved2[2];
-};
-
-struct ext2_dir_entry {
-  u32 inode;
-  u16 rec_len;
-  u16 name_len;
-  u8 name[EXT2_NAME_LEN];
-};
-
 #define errno_exit(str) \
   do {                  \
     int err = errno;    \
@@ -178,12 +81,12 @@ struct ext2_dir_entry {
     }                                        \
   } while (0)
 
-#define dir_entry_write(entry, fd)                \
+/* Copies the entry without the unused tail of its name, then moves `cursor`
+   past its record */
+#define dir_entry_write(entry, cursor)            \
   do {                                            \
-    size_t size = entry.rec_len;                  \
-    if (write(file_desc, &entry, size) != size) { \
-      errno_exit("write");                        \
-    }                                             \
+    memcpy(cursor, &entry, 8 + (entry).name_len); \
+    (cursor) += (entry).rec_len;                  \
   } while (0)
 
 #define BIT_USED(number, position) ((number) |= (1ULL << (position)))
@@ -197,12 +100,7 @@ u32 get_current_time() {
   return t;
 }
 
-void write_superblock(int file_desc) {
-  off_t offset = lseek(file_desc, (off_t)BLOCK_OFFSET(1), SEEK_SET);
-  if (offset == -1) {
-    errno_exit("lseek");
-  }
-
+void write_superblock(u8 *image) {
   u32 current_time = get_current_time();
 
   struct ext2_superblock superblock = {0};
@@ -256,18 +154,10 @@ void write_superblock(int file_desc) {
 
   memcpy(&superblock.s_volume_name, "cs111-base", 10);
 
-  ssize_t size = sizeof(superblock);
-  if (write(file_desc, &superblock, size) != size) {
-    errno_exit("write");
-  }
+  memcpy(image + BLOCK_OFFSET(1), &superblock, sizeof(superblock));
 }
 
-void write_block_group_descriptor_table(int file_desc) {
-  off_t offset = lseek(file_desc, (off_t)BLOCK_OFFSET(2), SEEK_SET);
-  if (offset == -1) {
-    errno_exit("lseek");
-  }
-
+void write_block_group_descriptor_table(u8 *image) {
   struct ext2_block_group_descriptor block_group_descriptor = {0};
 
   /* These are intentionally incorrectly set as 0, you should set them
@@ -279,93 +169,37 @@ void write_block_group_descriptor_table(int file_desc) {
   block_group_descriptor.bg_free_inodes_count = NUM_FREE_INODES;
   block_group_descriptor.bg_used_dirs_count = NUM_USED_DIRS;
 
-  ssize_t size = sizeof(block_group_descriptor);
-  if (write(file_desc, &block_group_descriptor, size) != size) {
-    errno_exit("write");
-  }
+  memcpy(image + BLOCK_OFFSET(2), &block_group_descriptor,
+         sizeof(block_group_descriptor));
 }
 
-void write_block_bitmap(int file_desc) {
-  off_t offset =
-      lseek(file_desc, (off_t)BLOCK_OFFSET(BLOCK_BITMAP_BLOCKNO), SEEK_SET);
-  if (offset == -1) {
-    errno_exit("lseek");
-  }
-
-  u8 bitmap[BLOCK_SIZE];
-  u8 byte = 0;
-
-  const u32 FREE_START = 23;  // Block number 24
-  const u32 FREE_END = 1022;  // Block number 1023
-
-  // Loops through every bit
-  for (u32 bit = 0; bit < BLOCK_SIZE * BITS_PER_BYTE; bit++) {
-    const u32 idx = bit / BITS_PER_BYTE;
-    const u32 position = bit % BITS_PER_BYTE;
-
-    if (bit >= FREE_START && bit <= FREE_END) {
-      BIT_FREE(byte, position);
-    } else {
-      BIT_USED(byte, position);
-    }
-
-    bitmap[idx] = byte;
-  }
+void write_block_bitmap(u8 *image) {
+  u8 *bitmap = image + BLOCK_OFFSET(BLOCK_BITMAP_BLOCKNO);
 
-  ssize_t size = sizeof(bitmap);
-  if (write(file_desc, &bitmap, size) != size) {
-    errno_exit("write");
-  }
+  /* Bit 0 is the superblock's block. Bits past the last block are padding
+     and marked used. */
+  bitmap_set_range(bitmap, 0, LAST_BLOCK);
+  bitmap_clear_range(bitmap, LAST_BLOCK, NUM_BLOCKS - SUPERBLOCK_BLOCKNO);
+  bitmap_set_range(bitmap, NUM_BLOCKS - SUPERBLOCK_BLOCKNO,
+                   BLOCK_SIZE * BITS_PER_BYTE);
 }
 
-void write_inode_bitmap(int file_desc) {
-  off_t offset =
-      lseek(file_desc, (off_t)BLOCK_OFFSET(INODE_BITMAP_BLOCKNO), SEEK_SET);
-  if (offset == -1) {
-    errno_exit("lseek");
-  }
-
-  u8 bitmap[BLOCK_SIZE];
-  u8 byte = 0;
-
-  const u32 FREE_START = 13;  // Inode number 14
-  const u32 FREE_END = 127;   // Inode number 128
-
-  // Loops through every bit
-  for (u32 bit = 0; bit < BLOCK_SIZE * BITS_PER_BYTE; bit++) {
-    const u32 idx = bit / BITS_PER_BYTE;
-    const u32 position = bit % BITS_PER_BYTE;
-
-    if (bit >= FREE_START && bit <= FREE_END) {
-      BIT_FREE(byte, position);
-    } else {
-      BIT_USED(byte, position);
-    }
-
-    bitmap[idx] = byte;
-  }
+void write_inode_bitmap(u8 *image) {
+  u8 *bitmap = image + BLOCK_OFFSET(INODE_BITMAP_BLOCKNO);
 
-  ssize_t size = sizeof(bitmap);
-  if (write(file_desc, &bitmap, size) != size) {
-    errno_exit("write");
-  }
+  /* Bit 0 is inode 1 */
+  bitmap_set_range(bitmap, 0, LAST_INO);
+  bitmap_clear_range(bitmap, LAST_INO, NUM_INODES);
+  bitmap_set_range(bitmap, NUM_INODES, BLOCK_SIZE * BITS_PER_BYTE);
 }
 
-void write_inode(int file_desc, u32 index, struct ext2_inode *inode) {
-  off_t offset = (off_t)BLOCK_OFFSET(INODE_TABLE_BLOCKNO) +
-                 (index - 1) * sizeof(struct ext2_inode);
-  offset = lseek(file_desc, offset, SEEK_SET);
-  if (offset == -1) {
-    errno_exit("lseek");
-  }
-
-  ssize_t size = sizeof(struct ext2_inode);
-  if (write(file_desc, inode, size) != size) {
-    errno_exit("write");
-  }
+void write_inode(u8 *image, u32 index, struct ext2_inode *inode) {
+  size_t offset = BLOCK_OFFSET(INODE_TABLE_BLOCKNO) +
+                  (index - 1) * sizeof(struct ext2_inode);
+  memcpy(image + offset, inode, sizeof(struct ext2_inode));
 }
 
-void write_inode_table(int file_desc) {
+void write_inode_table(u8 *image) {
   u32 current_time = get_current_time();
   const u32 NORMAL_USER = 1000;
   const u32 HELLO_WORLD_SIZE = strlen("hello-world\n");
@@ -385,7 +219,7 @@ void write_inode_table(int file_desc) {
   lost_and_found_inode.i_links_count = 2;
   lost_and_found_inode.i_blocks = 2; /* 1024 bytes in total */
   lost_and_found_inode.i_block[0] = LOST_AND_FOUND_DIR_BLOCKNO;
-  write_inode(file_desc, LOST_AND_FOUND_INO, &lost_and_found_inode);
+  write_inode(image, LOST_AND_FOUND_INO, &lost_and_found_inode);
 
   /* You should add your 3 other inodes in this function and delete this
      comment */
@@ -402,7 +236,7 @@ void write_inode_table(int file_desc) {
   root.i_links_count = 3;
   root.i_blocks = 2; /* 1024 bytes in total */
   root.i_block[0] = ROOT_DIR_BLOCKNO;
-  write_inode(file_desc, EXT2_ROOT_INO, &root);
+  write_inode(image, EXT2_ROOT_INO, &root);
 
   struct ext2_inode hello_world_file = {0};
   hello_world_file.i_mode =
@@ -417,7 +251,7 @@ void write_inode_table(int file_desc) {
   hello_world_file.i_links_count = 1;
   hello_world_file.i_blocks = 2; /* 1024 bytes in total */
   hello_world_file.i_block[0] = HELLO_WORLD_FILE_BLOCKNO;
-  write_inode(file_desc, HELLO_WORLD_INO, &hello_world_file);
+  write_inode(image, HELLO_WORLD_INO, &hello_world_file);
 
   struct ext2_inode hello_symlink = {0};
   hello_symlink.i_mode =
@@ -432,112 +266,3732 @@ void write_inode_table(int file_desc) {
   hello_symlink.i_links_count = 1;
   hello_symlink.i_blocks = 0;
   memcpy(hello_symlink.i_block, hello_world_path, strlen(hello_world_path));
-  write_inode(file_desc, HELLO_INO, &hello_symlink);
+  write_inode(image, HELLO_INO, &hello_symlink);
 }
 
-void write_root_dir_block(int file_desc) {
-  off_t offset = (off_t)BLOCK_OFFSET(ROOT_DIR_BLOCKNO);
-  offset = lseek(file_desc, offset, SEEK_SET);
-  if (offset == -1) {
-    errno_exit("lseek");
-  }
+void write_root_dir_block(u8 *image) {
+  u8 *cursor = image + BLOCK_OFFSET(ROOT_DIR_BLOCKNO);
 
   ssize_t bytes_remaining = BLOCK_SIZE;
 
   struct ext2_dir_entry current_entry = {0};
   dir_entry_set(current_entry, EXT2_ROOT_INO, ".");
-  dir_entry_write(current_entry, file_desc);
+  dir_entry_write(current_entry, cursor);
 
   bytes_remaining -= current_entry.rec_len;
 
   struct ext2_dir_entry parent_entry = {0};
   dir_entry_set(parent_entry, EXT2_ROOT_INO, "..");
-  dir_entry_write(parent_entry, file_desc);
+  dir_entry_write(parent_entry, cursor);
 
   bytes_remaining -= parent_entry.rec_len;
 
   struct ext2_dir_entry lost_and_found = {0};
   dir_entry_set(lost_and_found, LOST_AND_FOUND_INO, "lost+found");
-  dir_entry_write(lost_and_found, file_desc);
+  dir_entry_write(lost_and_found, cursor);
 
   bytes_remaining -= lost_and_found.rec_len;
 
   struct ext2_dir_entry hello_world_file = {0};
   dir_entry_set(hello_world_file, HELLO_WORLD_INO, "hello-world");
-  dir_entry_write(hello_world_file, file_desc);
+  dir_entry_write(hello_world_file, cursor);
 
   bytes_remaining -= hello_world_file.rec_len;
 
   struct ext2_dir_entry hello_symlink = {0};
   dir_entry_set(hello_symlink, HELLO_INO, "hello");
-  dir_entry_write(hello_symlink, file_desc);
+  dir_entry_write(hello_symlink, cursor);
 
   bytes_remaining -= hello_symlink.rec_len;
 
   struct ext2_dir_entry fill_entry = {0};
   fill_entry.rec_len = bytes_remaining;
-  dir_entry_write(fill_entry, file_desc);
+  dir_entry_write(fill_entry, cursor);
 }
 
-void write_lost_and_found_dir_block(int file_desc) {
-  off_t offset = (off_t)BLOCK_OFFSET(LOST_AND_FOUND_DIR_BLOCKNO);
-  offset = lseek(file_desc, offset, SEEK_SET);
-  if (offset == -1) {
-    errno_exit("lseek");
-  }
+void write_lost_and_found_dir_block(u8 *image) {
+  u8 *cursor = image + BLOCK_OFFSET(LOST_AND_FOUND_DIR_BLOCKNO);
 
   ssize_t bytes_remaining = BLOCK_SIZE;
 
   struct ext2_dir_entry current_entry = {0};
   dir_entry_set(current_entry, LOST_AND_FOUND_INO, ".");
-  dir_entry_write(current_entry, file_desc);
+  dir_entry_write(current_entry, cursor);
 
   bytes_remaining -= current_entry.rec_len;
 
   struct ext2_dir_entry parent_entry = {0};
   dir_entry_set(parent_entry, EXT2_ROOT_INO, "..");
-  dir_entry_write(parent_entry, file_desc);
+  dir_entry_write(parent_entry, cursor);
 
   bytes_remaining -= parent_entry.rec_len;
 
   struct ext2_dir_entry fill_entry = {0};
   fill_entry.rec_len = bytes_remaining;
-  dir_entry_write(fill_entry, file_desc);
+  dir_entry_write(fill_entry, cursor);
+}
+
+void write_hello_world_file_block(u8 *image) {
+  const char contents[] = "Hello world\n";
+  memcpy(image + BLOCK_OFFSET(HELLO_WORLD_FILE_BLOCKNO), contents,
+         sizeof(contents));
+}
+
+/* Building an image from a directory tree */
+
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE 4096
+#define MIN_BLOCKS_PER_GROUP 256
+#define MIN_INODE_RATIO 1024
+#define MAX_INODE_RATIO (64 * 1024 * 1024)
+/* Symlinks shorter than this live in i_block instead of a data block */
+#define EXT2_FAST_SYMLINK_LEN sizeof(((struct ext2_inode *)0)->i_block)
+#define DEFAULT_HEADROOM_PERCENT 10
+#define COPY_BUFFER_BLOCKS 256
+#define CACHE_WINDOW_SIZE (8 * 1024 * 1024)
+/* Runs at least this long are copied with copy_file_range */
+#define COPY_RANGE_MIN_SIZE (64 * 1024)
+/* Files up to URING_SLOT_SIZE go through io_uring, URING_DEPTH of them in
+   flight per thread by default */
+#define URING_DEPTH 64
+#define URING_MAX_DEPTH 1024
+#define URING_SLOT_SIZE (64 * 1024)
+#define URING_MIN_ENTRIES 128
+#define NO_NODE UINT32_MAX
+
+#define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
+
+/* Sizes from the command line, checked and completed by geometry_init */
+struct geometry {
+  u32 block_size;
+  u32 blocks_per_group;
+  u32 inode_size;
+  /* Bytes of image per inode, or 0 to only fit the tree plus headroom */
+  u32 inode_ratio;
+
+  u32 log_block_size; /* block_size is 1024 << log_block_size */
+  /* Block 0 is the boot block with 1 KiB blocks, otherwise the superblock
+     shares it */
+  u32 first_data_block;
+  u32 pointers_per_block;
+  u32 inodes_per_block;
+};
+
+struct tree_node {
+  u64 size;
+  size_t name; /* Offset into the name arena */
+  union {
+    size_t target; /* Symlink target, also in the name arena */
+    dev_t rdev;
+  };
+  /* Identity of the source file, only kept when it has several links */
+  dev_t host_dev;
+  ino_t host_ino;
+  u32 parent;
+  /* Children of a directory are contiguous, sorted by name */
+  u32 first_child;
+  u32 child_count;
+  u32 ino;
+  /* Data and indirect blocks, allocated in order from the extents starting
+     at index `extent` */
+  u32 extent;
+  u32 block_count;
+  u32 links;
+  u32 uid;
+  u32 gid;
+  u32 atime;
+  u32 ctime;
+  u32 mtime;
+  u16 mode;
+  u8 name_len;
+  /* Another name for an inode that is written out by an earlier node */
+  bool hard_link;
+  /* Directory laid out with a hashed index */
+  bool indexed;
+};
+
+struct link_slot {
+  dev_t dev;
+  ino_t ino;
+  u32 node;
+};
+
+struct tree {
+  struct tree_node *nodes;
+  u32 node_count;
+  u32 node_capacity;
+
+  char *names;
+  size_t names_len;
+  size_t names_capacity;
+
+  /* Open addressing on (st_dev, st_ino) of files with more than one link */
+  struct link_slot *links;
+  size_t link_count;
+  size_t link_capacity;
+
+  int root_fd;
+  u32 last_ino;
+  u64 content_blocks;
+  bool large_files;
+
+  /* Index directories that don't fit in one block */
+  bool dir_index;
+  u32 hash_seed[4];
+
+  struct geometry geometry;
+};
+
+struct layout {
+  u32 blocks_count;
+  u32 group_count;
+  u32 inodes_per_group;
+  u32 inode_table_blocks;
+  u32 descriptor_blocks;
+};
+
+struct group_state {
+  u32 first_block;
+  u32 data_start;
+  u32 end; /* One past the last block */
+  u32 free_blocks;
+  u32 used_dirs;
+  /* Entries of the builder's `order` for nodes that start in this group */
+  u32 first_node;
+  u32 node_end;
+  /* Bitmaps and inode table, written out once everything is allocated */
+  u8 *metadata;
+};
+
+/* Command line settings for building from a directory tree */
+struct tree_options {
+  const char *source;
+  const char *image;
+  /* Where to list the runs of blocks that were written, if anywhere */
+  const char *map_path;
+  struct geometry geometry;
+  u32 headroom_percent;
+  u32 thread_count;
+  bool stats;
+  bool sparse;
+  bool dir_index;
+  /* Rewrite what changed in an existing image instead of starting over */
+  bool update;
+  /* Write identical files once, and report duplicate blocks */
+  bool dedup;
+  /* Small files in flight per thread with io_uring, 0 for synchronous I/O */
+  u32 queue_depth;
+};
+
+/* A run of consecutive blocks */
+struct extent {
+  u32 start;
+  u32 length;
+};
+
+/* Each worker's blocks are allocated mostly in increasing order, so they are
+   staged in a window and written out sequentially as it fills. The window
+   only ever covers blocks allocated to the worker, one after another. */
+struct block_cache {
+  u8 *window;
+  u32 capacity; /* In blocks */
+  u32 first;
+  u32 end; /* One past the last block allocated into the window */
+};
+
+/* A file on its way through the ring. It is opened into the fixed file with
+   the same index as its slot, read into the slot's buffer and written from
+   there, one write per run of blocks. */
+struct uring_file {
+  u32 node;
+  u32 length;
+  /* Completions still to come */
+  u32 pending;
+  bool failed;
+  /* Still in the fixed file table */
+  bool open;
+  u32 run_count;
+  struct extent runs[URING_SLOT_SIZE / MIN_BLOCK_SIZE];
+};
+
+struct uring {
+  int fd;
+  u32 depth;
+  /* The submission and completion rings share one mapping */
+  u8 *rings;
+  size_t rings_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  u32 *sq_tail;
+  u32 *sq_array;
+  u32 sq_mask;
+  u32 sq_entries;
+  u32 *cq_head;
+  u32 *cq_tail;
+  struct io_uring_cqe *cqes;
+  u32 cq_mask;
+  u32 cq_entries;
+
+  /* Queued and not yet handed to the kernel */
+  u32 unsubmitted;
+  u32 unsubmitted_files;
+  /* Queued and not yet completed */
+  u32 in_flight;
+
+  /* Registered as one buffer, URING_SLOT_SIZE per slot */
+  u8 *buffers;
+  char (*paths)[PATH_MAX];
+  struct uring_file *files;
+  u32 *free_slots;
+  u32 free_count;
+  /* Set once the kernel turns down opening into fixed files */
+  bool unsupported;
+};
+
+struct worker;
+
+/* Everything here is set up before the workers start, apart from the group
+   each of them fills next */
+struct builder {
+  int fd;
+  struct tree *tree;
+  struct layout layout;
+  struct group_state *groups;
+  u32 current_time;
+  u8 uuid[16];
+  struct ext2_block_group_descriptor *descriptors;
+  struct ext2_superblock superblock;
+
+  /* Kept in step with the group bitmaps as plan_blocks allocates */
+  u32 free_blocks;
+  /* Group the last allocation went to, where the next search starts */
+  u32 alloc_goal;
+  struct extent *extents;
+  size_t extent_count;
+  size_t extent_capacity;
+  /* Nodes sorted by the group they start in */
+  u32 *order;
+
+  /* Leave all-zero blocks as holes in the image */
+  bool sparse;
+  /* Hash file data blocks for the dedup report */
+  bool dedup;
+
+  u32 thread_count;
+  _Atomic u32 next_group;
+  void (*group_task)(struct worker *, u32);
+};
+
+/* State private to one thread */
+struct worker {
+  struct builder *builder;
+  pthread_t thread;
+
+  struct block_cache cache;
+  u8 *fallback;
+  /* Position in the current node's extents */
+  u32 extent;
+  u32 extent_used;
+  u32 last_block;
+  /* Cleared once the kernel refuses copy_file_range for these files */
+  bool copy_range;
+  /* NULL when small files are copied synchronously too */
+  struct uring *uring;
+
+  /* Directory the last regular file was opened from */
+  u32 dir_node;
+  int dir_fd;
+
+  /* I/O done while writing the image, for -s */
+  u64 syscalls;
+  u64 bytes_written;
+  /* Blocks written, for -m */
+  struct extent *written;
+  size_t written_count;
+  size_t written_capacity;
+  /* Hashes of the file data blocks written that weren't all zero, for -D */
+  u64 *block_hashes;
+  size_t block_hash_count;
+  size_t block_hash_capacity;
+  u64 zero_blocks;
+};
+
+/* Maps logical blocks of one file to physical blocks as they are allocated.
+   Indirect blocks are allocated just before the first block they map. */
+struct block_mapper {
+  u32 i_block[EXT2_N_BLOCKS];
+  u64 next;
+  /* Index 0 is the table i_block points to, deeper levels follow it */
+  u32 tables[3][MAX_BLOCK_SIZE / sizeof(u32)];
+  u32 table_blocks[3];
+};
+
+void *grow_array(void *array, size_t *capacity, size_t needed, size_t size) {
+  if (needed <= *capacity) {
+    return array;
+  }
+
+  size_t new_capacity = *capacity == 0 ? 1024 : *capacity;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+  array = realloc(array, new_capacity * size);
+  if (array == NULL) {
+    errno_exit("realloc");
+  }
+  *capacity = new_capacity;
+  return array;
+}
+
+size_t tree_add_string(struct tree *tree, const char *str, size_t len) {
+  tree->names = grow_array(tree->names, &tree->names_capacity,
+                           tree->names_len + len + 1, 1);
+  size_t offset = tree->names_len;
+  memcpy(tree->names + offset, str, len);
+  tree->names[offset + len] = '\0';
+  tree->names_len += len + 1;
+  return offset;
+}
+
+u32 tree_add_node(struct tree *tree) {
+  size_t capacity = tree->node_capacity;
+  tree->nodes = grow_array(tree->nodes, &capacity, tree->node_count + 1,
+                           sizeof(struct tree_node));
+  tree->node_capacity = capacity;
+
+  u32 index = tree->node_count++;
+  memset(&tree->nodes[index], 0, sizeof(struct tree_node));
+  tree->nodes[index].first_child = NO_NODE;
+  return index;
+}
+
+const char *node_name(const struct tree *tree, u32 node) {
+  return tree->names + tree->nodes[node].name;
 }
 
-void write_hello_world_file_block(int file_desc) {
-  if ((lseek(file_desc, (off_t)BLOCK_OFFSET(HELLO_WORLD_FILE_BLOCKNO),
-             SEEK_SET)) == -1) {
-    errno_exit("lseek");
+/* Returns the node first seen with the same source file, or NO_NODE after
+   remembering `node` as the first */
+u32 tree_find_link(struct tree *tree, dev_t dev, ino_t ino, u32 node) {
+  if ((tree->link_count + 1) * 2 > tree->link_capacity) {
+    struct link_slot *old = tree->links;
+    size_t old_capacity = tree->link_capacity;
+
+    tree->link_capacity = old_capacity == 0 ? 1024 : old_capacity * 2;
+    tree->links = calloc(tree->link_capacity, sizeof(struct link_slot));
+    if (tree->links == NULL) {
+      errno_exit("calloc");
+    }
+    tree->link_count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old[i].node != 0) {
+        tree_find_link(tree, old[i].dev, old[i].ino, old[i].node);
+      }
+    }
+    free(old);
   }
 
-  const char contents[] = "Hello world\n";
-  if (write(file_desc, contents, sizeof(contents)) != sizeof(contents)) {
-    errno_exit("write");
+  size_t slot =
+      (ino * 0x9E3779B97F4A7C15ULL ^ dev) & (tree->link_capacity - 1);
+  /* Node 0 is the root directory, so 0 marks an empty slot */
+  while (tree->links[slot].node != 0) {
+    if (tree->links[slot].dev == dev && tree->links[slot].ino == ino) {
+      return tree->links[slot].node;
+    }
+    slot = (slot + 1) & (tree->link_capacity - 1);
   }
+
+  tree->links[slot].dev = dev;
+  tree->links[slot].ino = ino;
+  tree->links[slot].node = node;
+  tree->link_count++;
+  return NO_NODE;
 }
 
-int main() {
-  int file_desc = open("cs111-base.img", O_CREAT | O_WRONLY, 0666);
-  if (file_desc == -1) {
-    errno_exit("open");
+void node_set_stat(struct tree_node *node, const struct stat *st) {
+  node->mode = st->st_mode;
+  node->uid = st->st_uid;
+  node->gid = st->st_gid;
+  node->atime = st->st_atim.tv_sec;
+  node->ctime = st->st_ctim.tv_sec;
+  node->mtime = st->st_mtim.tv_sec;
+  node->links = 1;
+}
+
+/* Writes the path of `node` relative to the source root into `path` */
+void node_path(const struct tree *tree, u32 node, char *path, size_t size) {
+  if (node == 0) {
+    snprintf(path, size, ".");
+    return;
   }
 
-  if (ftruncate(file_desc, 0)) {
-    errno_exit("ftruncate");
+  node_path(tree, tree->nodes[node].parent, path, size);
+  size_t len = strlen(path);
+  if (len + 1 + tree->nodes[node].name_len + 1 > size) {
+    fprintf(stderr, "%s/%s: path too long\n", path, node_name(tree, node));
+    exit(ENAMETOOLONG);
   }
-  if (ftruncate(file_desc, NUM_BLOCKS * BLOCK_SIZE)) {
-    errno_exit("ftruncate");
+  path[len] = '/';
+  memcpy(path + len + 1, node_name(tree, node), tree->nodes[node].name_len + 1);
+}
+
+int compare_names(const void *left, const void *right, void *tree) {
+  const struct tree_node *l = left;
+  const struct tree_node *r = right;
+  return strcmp(((struct tree *)tree)->names + l->name,
+                ((struct tree *)tree)->names + r->name);
+}
+
+/* Reads every entry of a directory into a contiguous run of child nodes */
+void tree_scan_dir(struct tree *tree, u32 dir) {
+  char path[PATH_MAX];
+  node_path(tree, dir, path, sizeof(path));
+
+  int dir_fd = openat(tree->root_fd, path, O_RDONLY | O_DIRECTORY);
+  if (dir_fd == -1) {
+    errno_exit(path);
+  }
+  DIR *stream = fdopendir(dir_fd);
+  if (stream == NULL) {
+    errno_exit("fdopendir");
+  }
+
+  u32 first_child = tree->node_count;
+  struct dirent *entry;
+  errno = 0;
+  while ((entry = readdir(stream)) != NULL) {
+    const char *name = entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+    /* The image gets its own lost+found */
+    if (dir == 0 && strcmp(name, "lost+found") == 0) {
+      continue;
+    }
+
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+      errno_exit(name);
+    }
+
+    u32 child = tree_add_node(tree);
+    struct tree_node *node = &tree->nodes[child];
+    node_set_stat(node, &st);
+    node->parent = dir;
+    node->name_len = strlen(name);
+    node->name = tree_add_string(tree, name, node->name_len);
+
+    if (S_ISREG(st.st_mode)) {
+      node->size = st.st_size;
+    } else if (S_ISLNK(st.st_mode)) {
+      char target[MAX_BLOCK_SIZE + 1];
+      ssize_t len = readlinkat(dir_fd, name, target, sizeof(target));
+      if (len == -1) {
+        errno_exit(name);
+      }
+      if (len > tree->geometry.block_size) {
+        fprintf(stderr, "%s: symlink target longer than a block\n", name);
+        exit(ENAMETOOLONG);
+      }
+      node->size = len;
+      node->target = tree_add_string(tree, target, len);
+    } else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
+      node->rdev = st.st_rdev;
+    }
+
+    if (!S_ISDIR(st.st_mode) && st.st_nlink > 1) {
+      node->host_dev = st.st_dev;
+      node->host_ino = st.st_ino;
+    }
+    errno = 0;
+  }
+  if (errno != 0) {
+    errno_exit("readdir");
+  }
+  closedir(stream);
+
+  if (dir == 0) {
+    u32 child = tree_add_node(tree);
+    struct tree_node *node = &tree->nodes[child];
+    node->mode = EXT2_S_IFDIR | EXT2_S_IRUSR | EXT2_S_IWUSR | EXT2_S_IXUSR;
+    node->links = 1;
+    node->parent = dir;
+    node->name_len = strlen("lost+found");
+    node->name = tree_add_string(tree, "lost+found", node->name_len);
+    node->ino = LOST_AND_FOUND_INO;
+  }
+
+  /* Sorting makes the image independent of readdir order */
+  u32 child_count = tree->node_count - first_child;
+  if (child_count > 0) {
+    qsort_r(&tree->nodes[first_child], child_count, sizeof(struct tree_node),
+            compare_names, tree);
+    tree->nodes[dir].first_child = first_child;
+  }
+  tree->nodes[dir].child_count = child_count;
+}
+
+/* Breadth first, so every directory's children are contiguous and get
+   consecutive inode numbers */
+void tree_scan(struct tree *tree, const char *source) {
+  tree->root_fd = open(source, O_RDONLY | O_DIRECTORY);
+  if (tree->root_fd == -1) {
+    errno_exit(source);
+  }
+
+  struct stat st;
+  if (fstat(tree->root_fd, &st) == -1) {
+    errno_exit("fstat");
+  }
+  u32 root = tree_add_node(tree);
+  node_set_stat(&tree->nodes[root], &st);
+  tree->nodes[root].ino = EXT2_ROOT_INO;
+
+  for (u32 dir = 0; dir < tree->node_count; dir++) {
+    if (S_ISDIR(tree->nodes[dir].mode) &&
+        tree->nodes[dir].ino != LOST_AND_FOUND_INO) {
+      tree_scan_dir(tree, dir);
+    }
+  }
+
+  /* Hard links share the inode of the first name found for them */
+  tree->last_ino = EXT2_GOOD_OLD_FIRST_INO;
+  for (u32 i = 1; i < tree->node_count; i++) {
+    struct tree_node *node = &tree->nodes[i];
+    if (node->ino == LOST_AND_FOUND_INO) {
+      continue;
+    }
+
+    u32 first = NO_NODE;
+    if (node->host_ino != 0) {
+      first = tree_find_link(tree, node->host_dev, node->host_ino, i);
+    }
+
+    if (first == NO_NODE) {
+      node->ino = ++tree->last_ino;
+    } else {
+      node->ino = tree->nodes[first].ino;
+      node->hard_link = true;
+      tree->nodes[first].links++;
+    }
+  }
+}
+
+/* MurmurHash3's 128-bit variant, fed a piece at a time. Only the last
+   piece may have a length that isn't a multiple of 16. */
+struct content_hash {
+  u64 h1;
+  u64 h2;
+  u64 length;
+};
+
+#define HASH_C1 0x87c37b91114253d5ULL
+#define HASH_C2 0x4cf5ad432745937fULL
+
+u64 rol64(u64 x, u32 r) { return (x << r) | (x >> (64 - r)); }
+
+u64 hash_fmix(u64 k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+void content_hash_update(struct content_hash *hash, const u8 *data,
+                         size_t length) {
+  u64 h1 = hash->h1;
+  u64 h2 = hash->h2;
+  size_t blocks = length / 16;
+  for (size_t i = 0; i < blocks; i++) {
+    u64 k1 = bitmap_word(data, 2 * i);
+    u64 k2 = bitmap_word(data, 2 * i + 1);
+
+    k1 *= HASH_C1;
+    k1 = rol64(k1, 31);
+    k1 *= HASH_C2;
+    h1 ^= k1;
+    h1 = rol64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= HASH_C2;
+    k2 = rol64(k2, 33);
+    k2 *= HASH_C1;
+    h2 ^= k2;
+    h2 = rol64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  /* The tail, little-endian like the words above */
+  const u8 *tail = data + blocks * 16;
+  u32 tail_length = length % 16;
+  u64 k1 = 0;
+  u64 k2 = 0;
+  for (u32 i = tail_length; i > 8; i--) {
+    k2 = k2 << 8 | tail[i - 1];
+  }
+  for (u32 i = tail_length < 8 ? tail_length : 8; i > 0; i--) {
+    k1 = k1 << 8 | tail[i - 1];
+  }
+  if (tail_length > 8) {
+    k2 *= HASH_C2;
+    k2 = rol64(k2, 33);
+    k2 *= HASH_C1;
+    h2 ^= k2;
+  }
+  if (tail_length > 0) {
+    k1 *= HASH_C1;
+    k1 = rol64(k1, 31);
+    k1 *= HASH_C2;
+    h1 ^= k1;
+  }
+
+  hash->h1 = h1;
+  hash->h2 = h2;
+  hash->length += length;
+}
+
+void content_hash_final(const struct content_hash *hash, u64 digest[2]) {
+  u64 h1 = hash->h1 ^ hash->length;
+  u64 h2 = hash->h2 ^ hash->length;
+  h1 += h2;
+  h2 += h1;
+  h1 = hash_fmix(h1);
+  h2 = hash_fmix(h2);
+  h1 += h2;
+  h2 += h1;
+  digest[0] = h1;
+  digest[1] = h2;
+}
+
+/* A regular file that might have the same contents as another */
+struct dedup_file {
+  u64 digest[2];
+  u32 node;
+};
+
+/* What dedup_tree and the workers found, for the report */
+struct dedup_stats {
+  u32 linked;
+  u64 linked_bytes;
+  /* Same contents as another file, but different inode fields */
+  u32 kept_apart;
+  u64 hashed_bytes;
+};
+
+int compare_dedup_sizes(const void *left, const void *right, void *tree) {
+  const struct tree_node *nodes = ((const struct tree *)tree)->nodes;
+  const struct dedup_file *l = left;
+  const struct dedup_file *r = right;
+  u64 l_size = nodes[l->node].size;
+  u64 r_size = nodes[r->node].size;
+  if (l_size != r_size) {
+    return (l_size > r_size) - (l_size < r_size);
+  }
+  return (l->node > r->node) - (l->node < r->node);
+}
+
+/* Whether two files can share an inode, losing nothing but ctime and
+   atime */
+bool same_inode_fields(const struct tree_node *l, const struct tree_node *r) {
+  return l->mode == r->mode && l->uid == r->uid && l->gid == r->gid &&
+         l->mtime == r->mtime;
+}
+
+/* Files with the same contents end up together, and among them, the files
+   that can share an inode. The earliest node comes first. */
+int compare_dedup_files(const void *left, const void *right, void *tree) {
+  const struct tree_node *nodes = ((const struct tree *)tree)->nodes;
+  const struct dedup_file *l = left;
+  const struct dedup_file *r = right;
+  const struct tree_node *ln = &nodes[l->node];
+  const struct tree_node *rn = &nodes[r->node];
+  const u64 l_keys[] = {ln->size, l->digest[0], l->digest[1], ln->mode,
+                        ln->uid,  ln->gid,      ln->mtime,    l->node};
+  const u64 r_keys[] = {rn->size, r->digest[0], r->digest[1], rn->mode,
+                        rn->uid,  rn->gid,      rn->mtime,    r->node};
+  for (u32 i = 0; i < sizeof(l_keys) / sizeof(l_keys[0]); i++) {
+    if (l_keys[i] != r_keys[i]) {
+      return (l_keys[i] > r_keys[i]) - (l_keys[i] < r_keys[i]);
+    }
+  }
+  return 0;
+}
+
+int open_node(const struct tree *tree, u32 node, char *path,
+              size_t path_size) {
+  node_path(tree, node, path, path_size);
+  int fd = openat(tree->root_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    errno_exit(path);
+  }
+  return fd;
+}
+
+/* Fills buf, with zeros past the end of a file that shrank since it was
+   scanned, as they're what gets copied */
+void read_scanned(int fd, const char *path, u8 *buf, size_t want) {
+  size_t filled = 0;
+  while (filled < want) {
+    ssize_t bytes_read = read(fd, buf + filled, want - filled);
+    if (bytes_read == -1) {
+      errno_exit(path);
+    }
+    if (bytes_read == 0) {
+      memset(buf + filled, 0, want - filled);
+      break;
+    }
+    filled += bytes_read;
+  }
+}
+
+void hash_file(const struct tree *tree, u32 node, u8 *buf, size_t buf_size,
+               u64 digest[2]) {
+  char path[PATH_MAX];
+  int fd = open_node(tree, node, path, sizeof(path));
+
+  /* Only the size that was scanned, which is all that gets copied */
+  struct content_hash hash = {0};
+  u64 remaining = tree->nodes[node].size;
+  while (remaining > 0) {
+    size_t want = remaining < buf_size ? remaining : buf_size;
+    read_scanned(fd, path, buf, want);
+    content_hash_update(&hash, buf, want);
+    remaining -= want;
+  }
+  close(fd);
+  content_hash_final(&hash, digest);
+}
+
+/* The digest isn't cryptographic, so files are only linked once their
+   bytes match. Both have the same scanned size. */
+bool same_file_bytes(const struct tree *tree, u32 left, u32 right, u8 *buf,
+                     size_t buf_size) {
+  char l_path[PATH_MAX];
+  char r_path[PATH_MAX];
+  int l_fd = open_node(tree, left, l_path, sizeof(l_path));
+  int r_fd = open_node(tree, right, r_path, sizeof(r_path));
+
+  u8 *l_buf = buf;
+  u8 *r_buf = buf + buf_size / 2;
+  bool same = true;
+  u64 remaining = tree->nodes[left].size;
+  while (same && remaining > 0) {
+    size_t want = remaining < buf_size / 2 ? remaining : buf_size / 2;
+    read_scanned(l_fd, l_path, l_buf, want);
+    read_scanned(r_fd, r_path, r_buf, want);
+    same = memcmp(l_buf, r_buf, want) == 0;
+    remaining -= want;
+  }
+  close(l_fd);
+  close(r_fd);
+  return same;
+}
+
+/* Gives inodes consecutive numbers again once some have gone, in the order
+   tree_scan gave them */
+void tree_renumber(struct tree *tree) {
+  u32 *new_inos = calloc(tree->last_ino + 1, sizeof(u32));
+  if (new_inos == NULL) {
+    errno_exit("calloc");
+  }
+
+  u32 last_ino = EXT2_GOOD_OLD_FIRST_INO;
+  for (u32 i = 0; i < tree->node_count; i++) {
+    struct tree_node *node = &tree->nodes[i];
+    if (!node->hard_link && node->ino > EXT2_GOOD_OLD_FIRST_INO) {
+      new_inos[node->ino] = ++last_ino;
+      node->ino = last_ino;
+    }
+  }
+  for (u32 i = 0; i < tree->node_count; i++) {
+    struct tree_node *node = &tree->nodes[i];
+    if (node->hard_link) {
+      node->ino = new_inos[node->ino];
+    }
   }
+  tree->last_ino = last_ino;
+  free(new_inos);
+}
+
+/* Makes files with the same contents and inode fields hard links to one
+   inode, so their data is written once. Only files the same size as
+   another file are read to hash them, and only ones whose digests match
+   are compared byte for byte. */
+void dedup_tree(struct tree *tree, struct dedup_stats *stats) {
+  struct dedup_file *files = NULL;
+  size_t count = 0;
+  size_t capacity = 0;
+  for (u32 i = 0; i < tree->node_count; i++) {
+    const struct tree_node *node = &tree->nodes[i];
+    if (S_ISREG(node->mode) && !node->hard_link && node->size > 0) {
+      files =
+          grow_array(files, &capacity, count + 1, sizeof(struct dedup_file));
+      files[count++] = (struct dedup_file){{0, 0}, i};
+    }
+  }
+  qsort_r(files, count, sizeof(struct dedup_file), compare_dedup_sizes, tree);
+
+  const size_t buf_size = (size_t)COPY_BUFFER_BLOCKS * MAX_BLOCK_SIZE;
+  u8 *buf = malloc(buf_size);
+  if (buf == NULL) {
+    errno_exit("malloc");
+  }
+  size_t candidates = 0;
+  for (size_t i = 0; i < count;) {
+    u64 size = tree->nodes[files[i].node].size;
+    size_t end = i + 1;
+    while (end < count && tree->nodes[files[end].node].size == size) {
+      end++;
+    }
+    if (end - i > 1) {
+      for (; i < end; i++) {
+        hash_file(tree, files[i].node, buf, buf_size, files[i].digest);
+        stats->hashed_bytes += size;
+        files[candidates++] = files[i];
+      }
+    }
+    i = end;
+  }
+  qsort_r(files, candidates, sizeof(struct dedup_file), compare_dedup_files,
+          tree);
+
+  /* The inode each linked file's own inode is replaced with */
+  u32 *replaced = calloc(tree->last_ino + 1, sizeof(u32));
+  if (replaced == NULL) {
+    errno_exit("calloc");
+  }
+  size_t first = 0;
+  for (size_t i = 1; i < candidates; i++) {
+    struct tree_node *node = &tree->nodes[files[i].node];
+    struct tree_node *kept = &tree->nodes[files[first].node];
+    bool same_contents =
+        node->size == kept->size &&
+        memcmp(files[i].digest, files[first].digest, sizeof(files[i].digest)) ==
+            0;
+    if (!same_contents || !same_inode_fields(node, kept)) {
+      if (same_contents) {
+        stats->kept_apart++;
+      }
+      first = i;
+      continue;
+    }
+    /* A digest collision starts a new group, like different contents */
+    if (!same_file_bytes(tree, files[first].node, files[i].node, buf,
+                         buf_size)) {
+      first = i;
+      continue;
+    }
+
+    replaced[node->ino] = kept->ino;
+    kept->links += node->links;
+    node->hard_link = true;
+    stats->linked++;
+    stats->linked_bytes += node->size;
+  }
+  free(buf);
+  free(files);
+
+  /* Names that were already hard links to a replaced inode follow it */
+  for (u32 i = 0; i < tree->node_count; i++) {
+    struct tree_node *node = &tree->nodes[i];
+    if (node->hard_link && replaced[node->ino] != 0) {
+      node->ino = replaced[node->ino];
+    }
+  }
+  free(replaced);
+  tree_renumber(tree);
+}
+
+u32 dir_entry_length(u32 name_len) { return 8 + DIV_ROUND_UP(name_len, 4) * 4; }
+
+/* Appends entries to consecutive directory blocks, or only counts the blocks
+   if `blocks` is NULL */
+struct dir_packer {
+  u8 *blocks;
+  u32 block_size;
+  u32 block_count;
+  u32 offset;
+  struct ext2_dir_entry *last;
+};
+
+/* Entries can't span blocks, so the last one takes up the slack */
+void dir_packer_finish(struct dir_packer *packer) {
+  if (packer->last != NULL) {
+    packer->last->rec_len += packer->block_size - packer->offset;
+  }
+}
+
+/* Returns whether the entry had to start a new block */
+bool dir_packer_add(struct dir_packer *packer, u32 ino, const char *name,
+                    u32 name_len) {
+  u32 rec_len = dir_entry_length(name_len);
+  bool new_block = packer->offset + rec_len > packer->block_size;
+  if (new_block) {
+    dir_packer_finish(packer);
+    packer->block_count++;
+    packer->offset = 0;
+  }
+
+  if (packer->blocks != NULL) {
+    struct ext2_dir_entry *entry =
+        (struct ext2_dir_entry *)(packer->blocks +
+                                  (packer->block_count - 1) *
+                                      packer->block_size +
+                                  packer->offset);
+    entry->inode = ino;
+    entry->rec_len = rec_len;
+    entry->name_len = name_len;
+    memcpy(entry->name, name, name_len);
+    packer->last = entry;
+  }
+  packer->offset += rec_len;
+  return new_block;
+}
+
+/* Packs ".", ".." and every child into blocks, returning the number of
+   blocks used. Only counts them if `blocks` is NULL. */
+u32 pack_dir(const struct tree *tree, u32 dir, u8 *blocks) {
+  const struct tree_node *node = &tree->nodes[dir];
+  struct dir_packer packer = {blocks, tree->geometry.block_size, 1, 0, NULL};
+
+  dir_packer_add(&packer, node->ino, ".", 1);
+  dir_packer_add(&packer, tree->nodes[node->parent].ino, "..", 2);
+  for (u32 i = 0; i < node->child_count; i++) {
+    u32 child = node->first_child + i;
+    dir_packer_add(&packer, tree->nodes[child].ino, node_name(tree, child),
+                   tree->nodes[child].name_len);
+  }
+  dir_packer_finish(&packer);
+  return packer.block_count;
+}
 
-  write_superblock(file_desc);
-  write_block_group_descriptor_table(file_desc);
-  write_block_bitmap(file_desc);
-  write_inode_bitmap(file_desc);
-  write_inode_table(file_desc);
-  write_root_dir_block(file_desc);
-  write_lost_and_found_dir_block(file_desc);
-  write_hello_world_file_block(file_desc);
+u32 rol32(u32 word, u32 shift) { return word << shift | word >> (32 - shift); }
+
+/* The three rounds of MD4 over 8 words of input, as dir_index hashes */
+void half_md4_transform(u32 buf[4], const u32 in[8]) {
+  static const u8 words[3][8] = {
+      {0, 1, 2, 3, 4, 5, 6, 7},
+      {1, 3, 5, 7, 0, 2, 4, 6},
+      {3, 7, 2, 6, 1, 5, 0, 4},
+  };
+  static const u8 shifts[3][4] = {
+      {3, 7, 11, 19},
+      {3, 5, 9, 13},
+      {3, 9, 11, 15},
+  };
+  static const u32 constants[3] = {0, 013240474631, 015666365641};
+  u32 v[4];
+  memcpy(v, buf, sizeof(v));
+
+  for (u32 round = 0; round < 3; round++) {
+    for (u32 step = 0; step < 8; step++) {
+      /* Each step updates the word before the last one */
+      u32 a = (4 - step % 4) % 4;
+      u32 x = v[(a + 1) % 4];
+      u32 y = v[(a + 2) % 4];
+      u32 z = v[(a + 3) % 4];
+      u32 f = round == 0   ? z ^ (x & (y ^ z))
+              : round == 1 ? (x & y) + ((x ^ y) & z)
+                           : x ^ y ^ z;
+      v[a] = rol32(v[a] + f + in[words[round][step]] + constants[round],
+                   shifts[round][step % 4]);
+    }
+  }
+
+  for (u32 i = 0; i < 4; i++) {
+    buf[i] += v[i];
+  }
+}
+
+/* Packs up to `count` words of the name, big-endian within each word and
+   padded out with its length */
+void dx_name_words(const u8 *name, i32 len, u32 *words, i32 count) {
+  u32 pad = (u32)len | (u32)len << 8;
+  pad |= pad << 16;
+  u32 val = pad;
+
+  if (len > count * 4) {
+    len = count * 4;
+  }
+  for (i32 i = 0; i < len; i++) {
+    val = name[i] + (val << 8);
+    if (i % 4 == 3) {
+      *words++ = val;
+      val = pad;
+      count--;
+    }
+  }
+  if (--count >= 0) {
+    *words++ = val;
+  }
+  while (--count >= 0) {
+    *words++ = pad;
+  }
+}
+
+/* Half MD4 of the name with its bytes taken as unsigned, matching
+   EXT2_FLAGS_UNSIGNED_HASH */
+u32 dx_hash(const u32 seed[4], const char *name, u32 name_len) {
+  u32 buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+  if (seed[0] | seed[1] | seed[2] | seed[3]) {
+    memcpy(buf, seed, sizeof(buf));
+  }
+
+  const u8 *bytes = (const u8 *)name;
+  for (i32 len = name_len; len > 0; len -= 32, bytes += 32) {
+    u32 in[8];
+    dx_name_words(bytes, len, in, 8);
+    half_md4_transform(buf, in);
+  }
+
+  /* The low bit flags collisions in the index, and the largest hash is
+     reserved to mark the end of the directory */
+  u32 hash = buf[1] & ~1U;
+  return hash == 0xFFFFFFFE ? 0xFFFFFFFC : hash;
+}
+
+struct dx_name {
+  u32 hash;
+  u32 node;
+};
+
+int compare_dx_names(const void *left, const void *right) {
+  const struct dx_name *l = left;
+  const struct dx_name *r = right;
+  if (l->hash != r->hash) {
+    return l->hash < r->hash ? -1 : 1;
+  }
+  return (l->node > r->node) - (l->node < r->node);
+}
+
+/* Points an index block at `count` consecutive blocks from `first`. The
+   count and limit take the place of the first hash, which is implied. */
+void dx_fill(u8 *at, u32 limit, const u32 *hashes, u32 first, u32 count) {
+  struct ext2_dx_entry *entries = (struct ext2_dx_entry *)at;
+  for (u32 i = 0; i < count; i++) {
+    entries[i].hash = hashes[i];
+    entries[i].block = first + i;
+  }
+
+  struct ext2_dx_countlimit *countlimit = (struct ext2_dx_countlimit *)at;
+  countlimit->limit = limit;
+  countlimit->count = count;
+}
+
+/* Lays out a dir_index directory: the root block, a level of index nodes if
+   the root can't point at every leaf, then leaves holding the children in
+   hash order. Returns the number of blocks, or 0 if the directory is too big
+   to index. Only counts them if `blocks` is NULL. */
+u32 pack_htree(const struct tree *tree, u32 dir, u8 *blocks) {
+  const struct tree_node *node = &tree->nodes[dir];
+  struct dx_name *names = malloc(node->child_count * sizeof(*names));
+  u32 *leaf_hashes = malloc(node->child_count * sizeof(u32));
+  if (names == NULL || leaf_hashes == NULL) {
+    errno_exit("malloc");
+  }
+
+  for (u32 i = 0; i < node->child_count; i++) {
+    u32 child = node->first_child + i;
+    names[i].hash = dx_hash(tree->hash_seed, node_name(tree, child),
+                            tree->nodes[child].name_len);
+    names[i].node = child;
+  }
+  qsort(names, node->child_count, sizeof(*names), compare_dx_names);
+
+  /* Each leaf starts at the hash of its first entry. When equal hashes
+     spill over into the next leaf, its low bit says to keep looking. */
+  const u32 block_size = tree->geometry.block_size;
+  struct dir_packer packer = {NULL, block_size, 1, 0, NULL};
+  leaf_hashes[0] = 0;
+  for (u32 i = 0; i < node->child_count; i++) {
+    if (dir_packer_add(&packer, 0, NULL,
+                       tree->nodes[names[i].node].name_len)) {
+      leaf_hashes[packer.block_count - 1] =
+          names[i].hash | (names[i].hash == names[i - 1].hash);
+    }
+  }
+  u32 leaf_count = packer.block_count;
+
+  /* Index entries that fit in the root after ".", ".." and the root info,
+     and in a node after its empty entry */
+  const u32 root_limit = (block_size - 32) / sizeof(struct ext2_dx_entry);
+  const u32 node_limit = (block_size - 8) / sizeof(struct ext2_dx_entry);
+  u32 index_nodes = leaf_count <= root_limit
+                        ? 0
+                        : DIV_ROUND_UP(leaf_count, node_limit);
+  u32 first_leaf = 1 + index_nodes;
+  if (index_nodes > root_limit) {
+    first_leaf = leaf_count = 0;
+  }
+
+  if (blocks != NULL && leaf_count != 0) {
+    struct dir_packer root = {blocks, block_size, 1, 0, NULL};
+    dir_packer_add(&root, node->ino, ".", 1);
+    dir_packer_add(&root, tree->nodes[node->parent].ino, "..", 2);
+    dir_packer_finish(&root);
+
+    struct ext2_dx_root_info *info =
+        (struct ext2_dx_root_info *)(blocks + root.offset);
+    info->hash_version = EXT2_HASH_HALF_MD4;
+    info->info_length = sizeof(*info);
+    info->indirect_levels = index_nodes > 0;
+    u8 *root_entries = blocks + root.offset + sizeof(*info);
+
+    if (index_nodes == 0) {
+      dx_fill(root_entries, root_limit, leaf_hashes, first_leaf, leaf_count);
+    } else {
+      for (u32 i = 0; i < index_nodes; i++) {
+        u32 first = i * node_limit;
+        u32 count = leaf_count - first < node_limit ? leaf_count - first
+                                                    : node_limit;
+        /* An empty entry covering the whole block */
+        u8 *index_block = blocks + (size_t)(1 + i) * block_size;
+        ((struct ext2_dir_entry *)index_block)->rec_len = block_size;
+        dx_fill(index_block + 8, node_limit, leaf_hashes + first,
+                first_leaf + first, count);
+        /* Each node starts where its first leaf does */
+        leaf_hashes[i] = leaf_hashes[first];
+      }
+      dx_fill(root_entries, root_limit, leaf_hashes, 1, index_nodes);
+    }
+
+    struct dir_packer leaves = {blocks + (size_t)first_leaf * block_size,
+                                block_size, 1, 0, NULL};
+    for (u32 i = 0; i < node->child_count; i++) {
+      const struct tree_node *child = &tree->nodes[names[i].node];
+      dir_packer_add(&leaves, child->ino, node_name(tree, names[i].node),
+                     child->name_len);
+    }
+    dir_packer_finish(&leaves);
+  }
+
+  free(names);
+  free(leaf_hashes);
+  return first_leaf + leaf_count;
+}
+
+/* Data blocks plus the indirect blocks needed to map them */
+u64 mapped_blocks(const struct geometry *geometry, u64 data_blocks) {
+  const u64 per_block = geometry->pointers_per_block;
+  u64 total = data_blocks;
+
+  if (data_blocks <= EXT2_NDIR_BLOCKS) {
+    return total;
+  }
+  u64 remaining = data_blocks - EXT2_NDIR_BLOCKS;
+
+  total += 1;
+  if (remaining <= per_block) {
+    return total;
+  }
+  remaining -= per_block;
+
+  u64 double_mapped = remaining < per_block * per_block
+                          ? remaining
+                          : per_block * per_block;
+  total += 1 + DIV_ROUND_UP(double_mapped, per_block);
+  remaining -= double_mapped;
+  if (remaining == 0) {
+    return total;
+  }
+
+  total += 1 + DIV_ROUND_UP(remaining, per_block * per_block) +
+           DIV_ROUND_UP(remaining, per_block);
+  return total;
+}
+
+/* Limited by what the block pointers reach, and by i_blocks counting 512
+   byte sectors in 32 bits */
+bool file_fits(const struct geometry *geometry, u64 data_blocks) {
+  const u64 per_block = geometry->pointers_per_block;
+  u64 reachable = EXT2_NDIR_BLOCKS + per_block + per_block * per_block +
+                  per_block * per_block * per_block;
+  return data_blocks <= reachable &&
+         mapped_blocks(geometry, data_blocks) * (geometry->block_size / 512) <=
+             UINT32_MAX;
+}
+
+/* Blocks each inode needs, summed up to size the image */
+void tree_count_blocks(struct tree *tree) {
+  const struct geometry *geometry = &tree->geometry;
+  for (u32 i = 0; i < tree->node_count; i++) {
+    struct tree_node *node = &tree->nodes[i];
+    if (node->hard_link) {
+      continue;
+    }
+
+    u64 data_blocks = 0;
+    if (S_ISDIR(node->mode)) {
+      data_blocks = pack_dir(tree, i, NULL);
+      /* A directory that fits in one block is searched quickly enough */
+      if (tree->dir_index && data_blocks > 1) {
+        u32 indexed_blocks = pack_htree(tree, i, NULL);
+        if (indexed_blocks != 0) {
+          data_blocks = indexed_blocks;
+          node->indexed = true;
+        }
+      }
+      node->size = (u64)data_blocks * geometry->block_size;
+      /* Every subdirectory's ".." links back here */
+      if (i != 0) {
+        tree->nodes[node->parent].links++;
+      }
+      node->links++;
+    } else if (S_ISREG(node->mode)) {
+      data_blocks = DIV_ROUND_UP(node->size, geometry->block_size);
+      if (!file_fits(geometry, data_blocks)) {
+        fprintf(stderr, "%s: too large for ext2\n", node_name(tree, i));
+        exit(EFBIG);
+      }
+      if (node->size > INT32_MAX) {
+        tree->large_files = true;
+      }
+    } else if (S_ISLNK(node->mode) && node->size >= EXT2_FAST_SYMLINK_LEN) {
+      data_blocks = 1;
+    }
+
+    node->block_count = mapped_blocks(geometry, data_blocks);
+    tree->content_blocks += node->block_count;
+  }
+}
+
+/* With sparse_super, only groups 0, 1 and powers of 3, 5 and 7 keep a copy
+   of the superblock and descriptors */
+bool group_has_super(u32 group) {
+  if (group <= 1) {
+    return true;
+  }
+  for (u32 base = 3; base <= 7; base += 2) {
+    u64 power = base;
+    while (power < group) {
+      power *= base;
+    }
+    if (power == group) {
+      return true;
+    }
+  }
+  return false;
+}
+
+u32 group_metadata_blocks(const struct layout *layout, u32 group) {
+  u32 blocks = 2 + layout->inode_table_blocks;
+  if (group_has_super(group)) {
+    blocks += 1 + layout->descriptor_blocks;
+  }
+  return blocks;
+}
+
+/* Where a group's blocks are, which only depends on the layout */
+void group_bounds(struct builder *builder, u32 group) {
+  const struct geometry *geometry = &builder->tree->geometry;
+  const struct layout *layout = &builder->layout;
+  struct group_state *state = &builder->groups[group];
+  state->first_block =
+      geometry->first_data_block + group * geometry->blocks_per_group;
+  state->data_start = state->first_block + group_metadata_blocks(layout, group);
+  state->end = group == layout->group_count - 1
+                   ? layout->blocks_count
+                   : state->first_block + geometry->blocks_per_group;
+}
+
+/* Finds the fewest block groups that fit the tree plus headroom */
+void plan_layout(struct builder *builder, u32 headroom_percent) {
+  const struct tree *tree = builder->tree;
+  const struct geometry *geometry = &tree->geometry;
+  struct layout *layout = &builder->layout;
+  const u32 bitmap_bits = geometry->block_size * 8;
+  /* Inode tables take whole blocks and inode bitmaps whole bytes */
+  const u32 inode_align =
+      geometry->inodes_per_block > 8 ? geometry->inodes_per_block : 8;
+
+  u64 inodes = tree->last_ino + (u64)tree->last_ino * headroom_percent / 100;
+  u64 data = tree->content_blocks +
+             tree->content_blocks * headroom_percent / 100 + 1;
+
+  u32 groups = 1;
+  u64 blocks = 0;
+  while (true) {
+    u64 inodes_per_group =
+        DIV_ROUND_UP(DIV_ROUND_UP(inodes, groups), inode_align) * inode_align;
+    if (inodes_per_group > bitmap_bits) {
+      /* The inode bitmap is a single block */
+      groups = DIV_ROUND_UP(inodes, bitmap_bits);
+      continue;
+    }
+    layout->group_count = groups;
+    layout->inodes_per_group = inodes_per_group;
+    layout->inode_table_blocks =
+        inodes_per_group / geometry->inodes_per_block;
+    layout->descriptor_blocks =
+        DIV_ROUND_UP(groups * sizeof(struct ext2_block_group_descriptor),
+                     geometry->block_size);
+
+    if (group_metadata_blocks(layout, 0) >= geometry->blocks_per_group) {
+      if (inodes_per_group == inode_align) {
+        fprintf(stderr, "Block groups are too small for their metadata\n");
+        exit(EINVAL);
+      }
+      /* Spread the inode tables thinner */
+      groups++;
+      continue;
+    }
+
+    u64 metadata = 0;
+    for (u32 group = 0; group < groups; group++) {
+      metadata += group_metadata_blocks(layout, group);
+    }
+    blocks = geometry->first_data_block + metadata + data;
+
+    u32 needed = DIV_ROUND_UP(blocks - geometry->first_data_block,
+                              geometry->blocks_per_group);
+    if (needed > groups) {
+      groups = needed;
+      continue;
+    }
+
+    /* Like mke2fs, at least one inode for every inode_ratio bytes. This
+       settles since the inode tables take up less than half of that. */
+    if (geometry->inode_ratio != 0) {
+      u64 ratio_inodes = blocks * geometry->block_size / geometry->inode_ratio;
+      if (ratio_inodes > inodes) {
+        inodes = ratio_inodes;
+        continue;
+      }
+    }
+    break;
+  }
+
+  /* More groups than the blocks need, e.g. for lots of tiny files. The last
+     group still has to hold its own metadata. */
+  u64 last_start = geometry->first_data_block +
+                   (u64)(groups - 1) * geometry->blocks_per_group;
+  u64 last_minimum = last_start + group_metadata_blocks(layout, groups - 1) + 1;
+  if (blocks < last_minimum) {
+    blocks = last_minimum;
+  }
+
+  if (blocks > UINT32_MAX) {
+    fprintf(stderr, "Source tree is too large for an ext2 image\n");
+    exit(EFBIG);
+  }
+  layout->blocks_count = blocks;
+
+  builder->groups = calloc(groups, sizeof(struct group_state));
+  if (builder->groups == NULL) {
+    errno_exit("calloc");
+  }
+  for (u32 group = 0; group < groups; group++) {
+    struct group_state *state = &builder->groups[group];
+    group_bounds(builder, group);
+    state->free_blocks = state->end - state->data_start;
+    builder->free_blocks += state->free_blocks;
+
+    state->metadata =
+        calloc(2 + layout->inode_table_blocks, geometry->block_size);
+    if (state->metadata == NULL) {
+      errno_exit("calloc");
+    }
+    /* Bits past the end of the group are padding and marked used */
+    bitmap_set_range(state->metadata, 0,
+                     state->data_start - state->first_block);
+    bitmap_set_range(state->metadata, state->end - state->first_block,
+                     bitmap_bits);
+  }
+}
+
+void record_written(struct worker *worker, u32 block, u32 count) {
+  if (worker->written_count > 0) {
+    struct extent *last = &worker->written[worker->written_count - 1];
+    if (last->start + last->length == block) {
+      last->length += count;
+      return;
+    }
+  }
+  worker->written =
+      grow_array(worker->written, &worker->written_capacity,
+                 worker->written_count + 1, sizeof(struct extent));
+  worker->written[worker->written_count++] = (struct extent){block, count};
+}
+
+void pwrite_blocks(struct worker *worker, const u8 *buf, u32 count,
+                   u32 block) {
+  const u32 block_size = worker->builder->tree->geometry.block_size;
+  size_t size = (size_t)count * block_size;
+  off_t position = (off_t)block * block_size;
+  if (pwrite(worker->builder->fd, buf, size, position) != (ssize_t)size) {
+    errno_exit("pwrite");
+  }
+  worker->syscalls++;
+  worker->bytes_written += size;
+  record_written(worker, block, count);
+}
+
+bool block_is_zero(const u8 *buf, u32 block_size) {
+  for (u32 i = 0; i < block_size / sizeof(u64); i++) {
+    if (bitmap_word(buf, i) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Writes whole blocks. Sparse images only get the runs that aren't all
+   zero, the image was truncated to size so the rest reads back as zero. */
+void image_pwrite(struct worker *worker, const void *buf, size_t size,
+                  u32 block) {
+  const u8 *blocks = buf;
+  const u32 block_size = worker->builder->tree->geometry.block_size;
+  u32 count = size / block_size;
+  if (!worker->builder->sparse) {
+    pwrite_blocks(worker, blocks, count, block);
+    return;
+  }
+
+  u32 run_start = 0;
+  for (u32 i = 0; i <= count; i++) {
+    if (i < count &&
+        !block_is_zero(blocks + (size_t)i * block_size, block_size)) {
+      continue;
+    }
+    if (i > run_start) {
+      pwrite_blocks(worker, blocks + (size_t)run_start * block_size,
+                    i - run_start, block + run_start);
+    }
+    run_start = i + 1;
+  }
+}
+
+/* Every block in the window is filled before it is flushed, except indirect
+   blocks that are still being filled in. Those are rewritten later. */
+void cache_flush(struct worker *worker) {
+  struct block_cache *cache = &worker->cache;
+  if (cache->end > cache->first) {
+    size_t size = (size_t)(cache->end - cache->first) *
+                  worker->builder->tree->geometry.block_size;
+    image_pwrite(worker, cache->window, size, cache->first);
+  }
+  cache->first = cache->end;
+}
+
+/* Restarts the window at `block`, after everything before it */
+void cache_restart(struct worker *worker, u32 block) {
+  cache_flush(worker);
+  worker->cache.first = worker->cache.end = block;
+}
+
+/* Takes blocks [block, block + count) out of the window, for when they are
+   written some other way. Runs are filled in the order they are allocated,
+   so whatever comes after them in the window isn't filled yet and can be
+   dropped. */
+void cache_skip(struct worker *worker, u32 block, u32 count) {
+  struct block_cache *cache = &worker->cache;
+  u32 run_end = block + count;
+  if (run_end <= cache->first || block >= cache->end) {
+    return;
+  }
+  if (block > cache->first) {
+    image_pwrite(worker, cache->window,
+                 (size_t)(block - cache->first) *
+                     worker->builder->tree->geometry.block_size,
+                 cache->first);
+  }
+  cache->first = run_end;
+  if (cache->end < run_end) {
+    cache->end = run_end;
+  }
+}
+
+/* Returns where `count` blocks from `block` live in the window, or NULL if
+   the window has already moved past them */
+u8 *cache_slot(struct worker *worker, u32 block, u32 count) {
+  const struct block_cache *cache = &worker->cache;
+  if (block < cache->first || block + count > cache->end) {
+    return NULL;
+  }
+  return cache->window + (size_t)(block - cache->first) *
+                             worker->builder->tree->geometry.block_size;
+}
+
+/* Reads up to `size` bytes, zero filling whatever the file no longer has */
+void read_full(struct worker *worker, int source_fd, u8 *buf, size_t size) {
+  size_t filled = 0;
+  while (filled < size) {
+    ssize_t bytes_read = read(source_fd, buf + filled, size - filled);
+    if (bytes_read == -1) {
+      errno_exit("read");
+    }
+    worker->syscalls++;
+    if (bytes_read == 0) {
+      /* Truncated since it was scanned */
+      memset(buf + filled, 0, size - filled);
+      break;
+    }
+    filled += bytes_read;
+  }
+}
+
+/* Copies a run of file data without it passing through user space, which
+   becomes a reflink on filesystems that share extents. Returns false if the
+   kernel can't do it for these files. */
+bool copy_range(struct worker *worker, int source_fd, u32 block,
+                size_t length) {
+  if (!worker->copy_range) {
+    return false;
+  }
+
+  const u32 block_size = worker->builder->tree->geometry.block_size;
+  /* The window must not later overwrite what lands here */
+  cache_skip(worker, block, DIV_ROUND_UP(length, block_size));
+
+  loff_t position = (loff_t)block * block_size;
+  size_t copied = 0;
+  while (copied < length) {
+    ssize_t bytes_copied = copy_file_range(
+        source_fd, NULL, worker->builder->fd, &position, length - copied, 0);
+    worker->syscalls++;
+    if (bytes_copied == -1) {
+      if (copied == 0 && (errno == EXDEV || errno == EINVAL ||
+                          errno == EOPNOTSUPP || errno == ENOSYS)) {
+        worker->copy_range = false;
+        return false;
+      }
+      errno_exit("copy_file_range");
+    }
+    if (bytes_copied == 0) {
+      /* Truncated since it was scanned, the image is already zero here */
+      break;
+    }
+    copied += bytes_copied;
+  }
+  worker->bytes_written += copied;
+  record_written(worker, block, DIV_ROUND_UP(copied, block_size));
+  return true;
+}
+
+void hash_blocks(struct worker *worker, const u8 *blocks, u32 count) {
+  const u32 block_size = worker->builder->tree->geometry.block_size;
+  for (u32 i = 0; i < count; i++) {
+    const u8 *block = blocks + (size_t)i * block_size;
+    if (block_is_zero(block, block_size)) {
+      worker->zero_blocks++;
+      continue;
+    }
+    struct content_hash hash = {0};
+    u64 digest[2];
+    content_hash_update(&hash, block, block_size);
+    content_hash_final(&hash, digest);
+    worker->block_hashes =
+        grow_array(worker->block_hashes, &worker->block_hash_capacity,
+                   worker->block_hash_count + 1, sizeof(u64));
+    worker->block_hashes[worker->block_hash_count++] = digest[0];
+  }
+}
+
+/* Fills `count` consecutive blocks with `length` bytes from `source_fd`, or
+   from `data` if it is -1, and zero pads the rest */
+void fill_blocks(struct worker *worker, u32 block, u32 count, int source_fd,
+                 const u8 *data, size_t length) {
+  size_t size = (size_t)count * worker->builder->tree->geometry.block_size;
+
+  if (source_fd != -1 && size >= COPY_RANGE_MIN_SIZE &&
+      copy_range(worker, source_fd, block, length)) {
+    return;
+  }
+
+  u8 *dest = cache_slot(worker, block, count);
+  if (dest == NULL) {
+    /* Allocated before the window moved on, like most indirect blocks */
+    cache_skip(worker, block, count);
+    dest = worker->fallback;
+  }
+
+  if (source_fd == -1) {
+    memcpy(dest, data, length);
+  } else {
+    read_full(worker, source_fd, dest, length);
+  }
+  memset(dest + length, 0, size - length);
+  if (source_fd != -1 && worker->builder->dedup) {
+    hash_blocks(worker, dest, count);
+  }
+
+  /* The window may have moved on by flushing these blocks before they were
+     filled, so even a sparse image needs the zero blocks written */
+  if (dest == worker->fallback) {
+    pwrite_blocks(worker, worker->fallback, count, block);
+  }
+}
+
+/* Hands out the current node's blocks in the order plan_blocks gave them */
+u32 alloc_block(struct worker *worker) {
+  const struct extent *extent = &worker->builder->extents[worker->extent];
+  if (worker->extent_used == extent->length) {
+    extent = &worker->builder->extents[++worker->extent];
+    worker->extent_used = 0;
+  }
+  u32 block = extent->start + worker->extent_used++;
+
+  /* The window only grows while allocation is sequential */
+  struct block_cache *cache = &worker->cache;
+  if (block != worker->last_block + 1 ||
+      block >= cache->first + cache->capacity) {
+    cache_restart(worker, block);
+  }
+  cache->end = block + 1;
+  worker->last_block = block;
+  return block;
+}
+
+/* Adds to the extents of the node whose first extent is `first` */
+void add_extent(struct builder *builder, u32 first, u32 start, u32 length) {
+  if (builder->extent_count > first) {
+    struct extent *last = &builder->extents[builder->extent_count - 1];
+    if (last->start + last->length == start) {
+      last->length += length;
+      return;
+    }
+  }
+  builder->extents =
+      grow_array(builder->extents, &builder->extent_capacity,
+                 builder->extent_count + 1, sizeof(struct extent));
+  builder->extents[builder->extent_count++] = (struct extent){start, length};
+}
+
+/* Takes `length` blocks from bit `bit` of a group's block bitmap */
+void group_take(struct builder *builder, u32 group, u32 bit, u32 length) {
+  struct group_state *state = &builder->groups[group];
+  bitmap_set_range(state->metadata, bit, bit + length);
+  state->free_blocks -= length;
+  builder->free_blocks -= length;
+  builder->alloc_goal = group;
+}
+
+/* First fit, from the group the last allocation went to. A node gets one
+   extent if any group has a run long enough, otherwise it is spread over
+   the first free runs found. */
+void plan_node_blocks(struct builder *builder, struct tree_node *node) {
+  const u32 group_count = builder->layout.group_count;
+  u32 remaining = node->block_count;
+  node->extent = builder->extent_count;
+  if (remaining == 0) {
+    return;
+  }
+  if (remaining > builder->free_blocks) {
+    fprintf(stderr, "Ran out of blocks\n");
+    exit(ENOSPC);
+  }
+
+  for (u32 i = 0; i < group_count; i++) {
+    u32 group = (builder->alloc_goal + i) % group_count;
+    const struct group_state *state = &builder->groups[group];
+    if (state->free_blocks < remaining) {
+      continue;
+    }
+    u32 end = state->end - state->first_block;
+    u32 length;
+    u32 bit = bitmap_find_clear(state->metadata, 0, end, remaining, &length);
+    if (bit != end) {
+      add_extent(builder, node->extent, state->first_block + bit, remaining);
+      group_take(builder, group, bit, remaining);
+      return;
+    }
+  }
+
+  for (u32 i = 0; remaining > 0; i++) {
+    u32 group = (builder->alloc_goal + i) % group_count;
+    const struct group_state *state = &builder->groups[group];
+    u32 end = state->end - state->first_block;
+    u32 bit = 0;
+    while (remaining > 0 && state->free_blocks > 0) {
+      u32 length;
+      bit = bitmap_find_clear(state->metadata, bit, end, 1, &length);
+      u32 taken = length < remaining ? length : remaining;
+      add_extent(builder, node->extent, state->first_block + bit, taken);
+      group_take(builder, group, bit, taken);
+      remaining -= taken;
+      bit += taken;
+    }
+  }
+}
+
+/* Decides which blocks every inode gets, so that groups can then be filled
+   independently. Each group is handed the nodes whose blocks start in it,
+   and the used directories are counted up front. */
+void plan_blocks(struct builder *builder) {
+  const struct tree *tree = builder->tree;
+  const u32 group_count = builder->layout.group_count;
+  u32 *node_groups = calloc(tree->node_count, sizeof(u32));
+  builder->order = calloc(tree->node_count, sizeof(u32));
+  if (node_groups == NULL || builder->order == NULL) {
+    errno_exit("calloc");
+  }
+
+  for (u32 i = 0; i < tree->node_count; i++) {
+    struct tree_node *node = &tree->nodes[i];
+    u32 inode_group = (node->ino - 1) / builder->layout.inodes_per_group;
+    node_groups[i] = inode_group;
+    if (node->hard_link) {
+      continue;
+    }
+    if (S_ISDIR(node->mode)) {
+      builder->groups[inode_group].used_dirs++;
+    }
+
+    plan_node_blocks(builder, node);
+    if (node->block_count > 0) {
+      u32 start = builder->extents[node->extent].start;
+      node_groups[i] = (start - tree->geometry.first_data_block) /
+                       tree->geometry.blocks_per_group;
+    }
+  }
+
+  /* Counting sort, keeping node order within each group */
+  for (u32 i = 0; i < tree->node_count; i++) {
+    builder->groups[node_groups[i]].node_end++;
+  }
+  u32 position = 0;
+  for (u32 group = 0; group < group_count; group++) {
+    struct group_state *state = &builder->groups[group];
+    state->first_node = position;
+    position += state->node_end;
+    state->node_end = state->first_node;
+  }
+  for (u32 i = 0; i < tree->node_count; i++) {
+    builder->order[builder->groups[node_groups[i]].node_end++] = i;
+  }
+  free(node_groups);
+}
+
+u32 group_bitmap_block(const struct builder *builder, u32 group) {
+  const struct group_state *state = &builder->groups[group];
+  return state->first_block +
+         (group_has_super(group) ? 1 + builder->layout.descriptor_blocks : 0);
+}
+
+void mapper_flush(struct worker *worker, struct block_mapper *mapper,
+                  u32 level) {
+  if (mapper->table_blocks[level] != 0) {
+    fill_blocks(worker, mapper->table_blocks[level], 1, -1,
+                (const u8 *)mapper->tables[level],
+                worker->builder->tree->geometry.block_size);
+  }
+}
+
+/* Allocates the next logical block of a file, along with any indirect blocks
+   it is the first to need */
+u32 mapper_next(struct worker *worker, struct block_mapper *mapper) {
+  const u64 per_block = worker->builder->tree->geometry.pointers_per_block;
+  u64 logical = mapper->next++;
+
+  if (logical < EXT2_NDIR_BLOCKS) {
+    mapper->i_block[logical] = alloc_block(worker);
+    return mapper->i_block[logical];
+  }
+  logical -= EXT2_NDIR_BLOCKS;
+
+  u32 root = EXT2_IND_BLOCK;
+  u32 depth = 1;
+  if (logical >= per_block) {
+    logical -= per_block;
+    root = EXT2_DIND_BLOCK;
+    depth = 2;
+    if (logical >= per_block * per_block) {
+      logical -= per_block * per_block;
+      root = EXT2_TIND_BLOCK;
+      depth = 3;
+    }
+  }
+
+  u32 index[3];
+  for (u32 level = depth; level > 0; level--) {
+    index[level - 1] = logical % per_block;
+    logical /= per_block;
+  }
+
+  /* A table is new whenever the indices below it are all back at zero, and
+     then so is every table below it */
+  u32 first_new = depth;
+  while (first_new > 0 && index[first_new - 1] == 0) {
+    first_new--;
+  }
+  for (u32 level = first_new; level < depth; level++) {
+    mapper_flush(worker, mapper, level);
+
+    u32 table = alloc_block(worker);
+    if (level == 0) {
+      mapper->i_block[root] = table;
+    } else {
+      mapper->tables[level - 1][index[level - 1]] = table;
+    }
+    mapper->table_blocks[level] = table;
+    memset(mapper->tables[level], 0, sizeof(mapper->tables[level]));
+  }
+
+  u32 block = alloc_block(worker);
+  mapper->tables[depth - 1][index[depth - 1]] = block;
+  return block;
+}
+
+void mapper_finish(struct worker *worker, struct block_mapper *mapper) {
+  for (u32 level = 0; level < 3; level++) {
+    mapper_flush(worker, mapper, level);
+  }
+}
+
+/* Copies `size` bytes into newly allocated blocks, from `source_fd` or from
+   `data` if it is -1 */
+void emit_contents(struct worker *worker, struct ext2_inode *inode,
+                   int source_fd, const u8 *data, u64 size) {
+  const struct geometry *geometry = &worker->builder->tree->geometry;
+  const size_t max_chunk = (size_t)COPY_BUFFER_BLOCKS * geometry->block_size;
+  struct block_mapper mapper = {0};
+  u32 blocks[COPY_BUFFER_BLOCKS];
+  u64 copied = 0;
+
+  while (copied < size) {
+    size_t chunk = size - copied < max_chunk ? size - copied : max_chunk;
+    u32 count = DIV_ROUND_UP(chunk, geometry->block_size);
+    for (u32 i = 0; i < count; i++) {
+      blocks[i] = mapper_next(worker, &mapper);
+    }
+
+    /* Each run of consecutive blocks is read straight into the window */
+    for (u32 i = 0; i < count;) {
+      u32 run = 1;
+      while (i + run < count && blocks[i + run] == blocks[i] + run) {
+        run++;
+      }
+      size_t offset = (size_t)i * geometry->block_size;
+      size_t length = chunk - offset < (size_t)run * geometry->block_size
+                          ? chunk - offset
+                          : (size_t)run * geometry->block_size;
+      fill_blocks(worker, blocks[i], run, source_fd,
+                  source_fd == -1 ? data + copied + offset : NULL, length);
+      i += run;
+    }
+
+    copied += chunk;
+  }
+
+  mapper_finish(worker, &mapper);
+  memcpy(inode->i_block, mapper.i_block, sizeof(mapper.i_block));
+  inode->i_blocks =
+      mapped_blocks(geometry, mapper.next) * (geometry->block_size / 512);
+}
+
+int open_source_file(struct worker *worker, u32 node) {
+  const struct tree *tree = worker->builder->tree;
+  u32 parent = tree->nodes[node].parent;
+
+  if (worker->dir_node != parent) {
+    char path[PATH_MAX];
+    node_path(tree, parent, path, sizeof(path));
+
+    if (worker->dir_fd != -1) {
+      close(worker->dir_fd);
+      worker->syscalls++;
+    }
+    worker->dir_fd =
+        openat(tree->root_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (worker->dir_fd == -1) {
+      errno_exit(path);
+    }
+    worker->syscalls++;
+    worker->dir_node = parent;
+  }
+
+  int source_fd =
+      openat(worker->dir_fd, node_name(tree, node), O_RDONLY | O_CLOEXEC);
+  if (source_fd == -1) {
+    errno_exit(node_name(tree, node));
+  }
+  worker->syscalls++;
+  return source_fd;
+}
+
+/* There is no liburing to lean on, so these are the raw system calls */
+int uring_register(struct uring *uring, u32 opcode, const void *arg,
+                   u32 count) {
+  return syscall(__NR_io_uring_register, uring->fd, opcode, arg, count);
+}
+
+void uring_free(struct uring *uring) {
+  if (uring->sqes != NULL) {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if (uring->rings != NULL) {
+    munmap(uring->rings, uring->rings_size);
+  }
+  if (uring->fd != -1) {
+    close(uring->fd);
+  }
+  free(uring->buffers);
+  free(uring->paths);
+  free(uring->files);
+  free(uring->free_slots);
+  free(uring);
+}
+
+/* Maps the rings and registers the buffers and the image. Returns false
+   with errno set if the kernel can't. */
+bool uring_setup(struct uring *uring, int image_fd) {
+  /* Each file takes an open, a read, a write per run and a close */
+  struct io_uring_params params = {0};
+  u32 entries = uring->depth * 4 < URING_MIN_ENTRIES ? URING_MIN_ENTRIES
+                                                     : uring->depth * 4;
+  uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (uring->fd == -1) {
+    return false;
+  }
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    errno = EOPNOTSUPP;
+    return false;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(u32);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  uring->rings_size = sq_size > cq_size ? sq_size : cq_size;
+  uring->rings = mmap(NULL, uring->rings_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+  if (uring->rings == MAP_FAILED) {
+    uring->rings = NULL;
+    return false;
+  }
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if (uring->sqes == MAP_FAILED) {
+    uring->sqes = NULL;
+    return false;
+  }
+  uring->sq_tail = (u32 *)(uring->rings + params.sq_off.tail);
+  uring->sq_array = (u32 *)(uring->rings + params.sq_off.array);
+  uring->sq_mask = *(u32 *)(uring->rings + params.sq_off.ring_mask);
+  uring->sq_entries = params.sq_entries;
+  uring->cq_head = (u32 *)(uring->rings + params.cq_off.head);
+  uring->cq_tail = (u32 *)(uring->rings + params.cq_off.tail);
+  uring->cqes = (struct io_uring_cqe *)(uring->rings + params.cq_off.cqes);
+  uring->cq_mask = *(u32 *)(uring->rings + params.cq_off.ring_mask);
+  uring->cq_entries = params.cq_entries;
+
+  /* Registered buffers are pinned once instead of on every read and write */
+  struct iovec buffers = {uring->buffers,
+                          (size_t)uring->depth * URING_SLOT_SIZE};
+  if (uring_register(uring, IORING_REGISTER_BUFFERS, &buffers, 1) == -1) {
+    return false;
+  }
+
+  /* Each slot gets an empty fixed file to open into, and the image goes
+     last */
+  int *fds = malloc((uring->depth + 1) * sizeof(int));
+  if (fds == NULL) {
+    errno_exit("malloc");
+  }
+  for (u32 i = 0; i < uring->depth; i++) {
+    fds[i] = -1;
+  }
+  fds[uring->depth] = image_fd;
+  int err = uring_register(uring, IORING_REGISTER_FILES, fds, uring->depth + 1);
+  free(fds);
+  return err != -1;
+}
+
+/* A ring that keeps up to `depth` files in flight, or NULL with errno set
+   if the kernel can't set one up, so the caller falls back to synchronous
+   I/O */
+struct uring *uring_create(u32 depth, int image_fd) {
+  struct uring *uring = calloc(1, sizeof(*uring));
+  if (uring == NULL) {
+    errno_exit("calloc");
+  }
+  uring->fd = -1;
+  uring->depth = depth;
+  uring->buffers = malloc((size_t)depth * URING_SLOT_SIZE);
+  uring->paths = malloc(depth * sizeof(*uring->paths));
+  uring->files = calloc(depth, sizeof(*uring->files));
+  uring->free_slots = malloc(depth * sizeof(u32));
+  if (uring->buffers == NULL || uring->paths == NULL || uring->files == NULL ||
+      uring->free_slots == NULL) {
+    errno_exit("malloc");
+  }
+  for (u32 i = 0; i < depth; i++) {
+    uring->free_slots[i] = depth - 1 - i;
+  }
+  uring->free_count = depth;
+
+  if (!uring_setup(uring, image_fd)) {
+    int err = errno;
+    uring_free(uring);
+    errno = err;
+    return NULL;
+  }
+  return uring;
+}
+
+/* Hands everything queued to the kernel, and waits for at least `wait`
+   completions */
+void uring_enter(struct worker *worker, u32 wait) {
+  struct uring *uring = worker->uring;
+  do {
+    int submitted =
+        syscall(__NR_io_uring_enter, uring->fd, uring->unsubmitted, wait,
+                wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      errno_exit("io_uring_enter");
+    }
+    worker->syscalls++;
+    uring->unsubmitted -= submitted;
+  } while (uring->unsubmitted > 0);
+  uring->unsubmitted_files = 0;
+}
+
+void uring_queue(struct uring *uring, const struct io_uring_sqe *sqe) {
+  u32 tail = *uring->sq_tail;
+  u32 index = tail & uring->sq_mask;
+  uring->sqes[index] = *sqe;
+  uring->sq_array[index] = index;
+  /* The kernel must see the entry before the tail that covers it */
+  __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  uring->unsubmitted++;
+  uring->in_flight++;
+}
+
+/* Operations are tagged with their file's slot and their step in its
+   chain: the open, the read, the writes and then the close */
+u64 uring_tag(u32 slot, u32 step) { return (u64)slot << 32 | step; }
+
+/* Puts a finished file's slot back. A file whose chain broke, say because
+   it shrank since it was scanned, is copied again synchronously. */
+void uring_retire(struct worker *worker, u32 slot) {
+  struct uring *uring = worker->uring;
+  struct uring_file *file = &uring->files[slot];
+  const u32 block_size = worker->builder->tree->geometry.block_size;
+  u8 *buffer = uring->buffers + (size_t)slot * URING_SLOT_SIZE;
+
+  if (file->open) {
+    /* The close was cancelled along with the rest of the chain */
+    int fd = -1;
+    struct io_uring_files_update update = {.offset = slot,
+                                           .fds = (u64)(uintptr_t)&fd};
+    if (uring_register(uring, IORING_REGISTER_FILES_UPDATE, &update, 1) ==
+        -1) {
+      errno_exit("io_uring_register");
+    }
+    worker->syscalls++;
+    file->open = false;
+  }
+
+  if (file->failed) {
+    int source_fd = open_source_file(worker, file->node);
+    read_full(worker, source_fd, buffer, file->length);
+    close(source_fd);
+    worker->syscalls++;
+    size_t offset = 0;
+    for (u32 i = 0; i < file->run_count; i++) {
+      pwrite_blocks(worker, buffer + offset, file->runs[i].length,
+                    file->runs[i].start);
+      offset += (size_t)file->runs[i].length * block_size;
+    }
+  }
+  if (worker->builder->dedup) {
+    hash_blocks(worker, buffer, DIV_ROUND_UP(file->length, block_size));
+  }
+  uring->free_slots[uring->free_count++] = slot;
+}
+
+void uring_complete(struct worker *worker, const struct io_uring_cqe *cqe) {
+  struct uring *uring = worker->uring;
+  u32 slot = cqe->user_data >> 32;
+  u32 step = (u32)cqe->user_data;
+  struct uring_file *file = &uring->files[slot];
+  const u32 block_size = worker->builder->tree->geometry.block_size;
+
+  uring->in_flight--;
+  if (step == 0) {
+    if (cqe->res >= 0) {
+      file->open = true;
+    } else {
+      file->failed = true;
+      /* Kernels before 5.15 can't open into a fixed file */
+      if (cqe->res == -EINVAL) {
+        uring->unsupported = true;
+      }
+    }
+  } else if (step == 1) {
+    /* A short read breaks the chain too */
+    if (cqe->res != (i32)file->length) {
+      file->failed = true;
+    }
+  } else if (step < 2 + file->run_count) {
+    if (cqe->res == (i32)(file->runs[step - 2].length * block_size)) {
+      worker->bytes_written += cqe->res;
+    } else {
+      file->failed = true;
+    }
+  } else if (cqe->res == 0) {
+    file->open = false;
+  }
+
+  if (--file->pending == 0) {
+    uring_retire(worker, slot);
+  }
+}
+
+void uring_reap(struct worker *worker) {
+  struct uring *uring = worker->uring;
+  u32 head = *uring->cq_head;
+  u32 tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    uring_complete(worker, &uring->cqes[head & uring->cq_mask]);
+  }
+  __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+void uring_wait(struct worker *worker) {
+  uring_enter(worker, 1);
+  uring_reap(worker);
+}
+
+/* Waits for every file in flight */
+void uring_drain(struct worker *worker) {
+  while (worker->uring->free_count < worker->uring->depth) {
+    uring_wait(worker);
+  }
+}
+
+/* Allocates a small regular file's blocks and queues a chain that opens,
+   reads and writes it without waiting. Returns false, having done nothing,
+   for files that are copied synchronously instead. */
+bool uring_emit(struct worker *worker, u32 index, struct ext2_inode *inode) {
+  struct uring *uring = worker->uring;
+  const struct tree *tree = worker->builder->tree;
+  const struct geometry *geometry = &tree->geometry;
+  const struct tree_node *node = &tree->nodes[index];
+  if (uring == NULL || uring->unsupported || node->size == 0 ||
+      node->size > URING_SLOT_SIZE) {
+    return false;
+  }
+
+  /* Enough room for the longest chain this file could need */
+  u32 count = DIV_ROUND_UP(node->size, geometry->block_size);
+  while (uring->free_count == 0 ||
+         uring->in_flight + count + 3 > uring->cq_entries) {
+    uring_wait(worker);
+  }
+  if (uring->unsubmitted + count + 3 > uring->sq_entries) {
+    uring_enter(worker, 0);
+  }
+
+  u32 slot = uring->free_slots[--uring->free_count];
+  struct uring_file *file = &uring->files[slot];
+  u8 *buffer = uring->buffers + (size_t)slot * URING_SLOT_SIZE;
+  *file = (struct uring_file){.node = index, .length = node->size};
+
+  struct block_mapper mapper = {0};
+  for (u32 i = 0; i < count; i++) {
+    u32 block = mapper_next(worker, &mapper);
+    u32 last = file->run_count - 1;
+    if (file->run_count > 0 &&
+        file->runs[last].start + file->runs[last].length == block) {
+      file->runs[last].length++;
+    } else {
+      file->runs[file->run_count++] = (struct extent){block, 1};
+    }
+  }
+  memcpy(inode->i_block, mapper.i_block, sizeof(mapper.i_block));
+  inode->i_blocks =
+      mapped_blocks(geometry, mapper.next) * (geometry->block_size / 512);
+
+  memset(buffer + node->size, 0,
+         (size_t)count * geometry->block_size - node->size);
+  node_path(tree, index, uring->paths[slot], PATH_MAX);
+
+  /* Direct descriptors can't be opened close-on-exec */
+  uring_queue(uring, &(struct io_uring_sqe){
+                         .opcode = IORING_OP_OPENAT,
+                         .flags = IOSQE_IO_LINK,
+                         .fd = tree->root_fd,
+                         .addr = (u64)(uintptr_t)uring->paths[slot],
+                         .open_flags = O_RDONLY,
+                         .file_index = slot + 1,
+                         .user_data = uring_tag(slot, 0),
+                     });
+  uring_queue(uring, &(struct io_uring_sqe){
+                         .opcode = IORING_OP_READ_FIXED,
+                         .flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE,
+                         .fd = slot,
+                         .addr = (u64)(uintptr_t)buffer,
+                         .len = node->size,
+                         .buf_index = 0,
+                         .user_data = uring_tag(slot, 1),
+                     });
+  /* A slot's worth of blocks needs at most the one indirect block, right
+     after the direct ones. It goes through the window, filled once the
+     runs before it are out of the way, since cache_skip drops anything
+     filled past the run it skips. */
+  u32 table = mapper.i_block[EXT2_IND_BLOCK];
+  size_t offset = 0;
+  for (u32 i = 0; i < file->run_count; i++) {
+    const struct extent *run = &file->runs[i];
+    if (table != 0 && offset >= EXT2_NDIR_BLOCKS * geometry->block_size) {
+      mapper_finish(worker, &mapper);
+      table = 0;
+    }
+    /* The window must not later overwrite what lands here */
+    cache_skip(worker, run->start, run->length);
+    record_written(worker, run->start, run->length);
+    uring_queue(uring, &(struct io_uring_sqe){
+                           .opcode = IORING_OP_WRITE_FIXED,
+                           .flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE,
+                           .fd = uring->depth,
+                           .addr = (u64)(uintptr_t)(buffer + offset),
+                           .len = run->length * geometry->block_size,
+                           .off = (u64)run->start * geometry->block_size,
+                           .buf_index = 0,
+                           .user_data = uring_tag(slot, 2 + i),
+                       });
+    offset += (size_t)run->length * geometry->block_size;
+  }
+  if (table != 0) {
+    mapper_finish(worker, &mapper);
+  }
+  uring_queue(uring, &(struct io_uring_sqe){
+                         .opcode = IORING_OP_CLOSE,
+                         .file_index = slot + 1,
+                         .user_data = uring_tag(slot, 2 + file->run_count),
+                     });
+  file->pending = file->run_count + 3;
+
+  /* Submitted in batches, so the ring never runs dry while the next files
+     are queued */
+  if (++uring->unsubmitted_files >= uring->depth / 8 + 1) {
+    uring_enter(worker, 0);
+  }
+  return true;
+}
+
+/* Every inode has its own slot, so no locking is needed */
+void write_tree_inode(struct builder *builder, u32 ino,
+                      const struct ext2_inode *inode) {
+  const struct geometry *geometry = &builder->tree->geometry;
+  u32 group = (ino - 1) / builder->layout.inodes_per_group;
+  u32 index = (ino - 1) % builder->layout.inodes_per_group;
+  u8 *inode_table =
+      builder->groups[group].metadata + 2 * geometry->block_size;
+
+  /* Larger inodes are left zero past the rev 0 fields */
+  memcpy(inode_table + (size_t)index * geometry->inode_size, inode,
+         sizeof(*inode));
+}
+
+/* Everything in a node's inode apart from the blocks holding its contents */
+void node_inode(const struct builder *builder, const struct tree_node *node,
+                struct ext2_inode *inode) {
+  memset(inode, 0, sizeof(*inode));
+  inode->i_mode = node->mode;
+  inode->i_uid = node->uid;
+  inode->i_uid_high = node->uid >> 16;
+  inode->i_gid = node->gid;
+  inode->i_gid_high = node->gid >> 16;
+  inode->i_size = node->size;
+  inode->i_dir_acl = node->size >> 32; /* i_size_high for regular files */
+  inode->i_atime = node->atime;
+  inode->i_ctime = node->ctime;
+  inode->i_mtime = node->mtime;
+  inode->i_links_count = node->links;
+
+  if (node->ino == LOST_AND_FOUND_INO) {
+    inode->i_atime = inode->i_ctime = inode->i_mtime = builder->current_time;
+  }
+
+  if (S_ISDIR(node->mode) && node->indexed) {
+    inode->i_flags |= EXT2_INDEX_FL;
+  } else if (S_ISLNK(node->mode) && node->size < EXT2_FAST_SYMLINK_LEN) {
+    memcpy(inode->i_block, builder->tree->names + node->target, node->size);
+  } else if (S_ISCHR(node->mode) || S_ISBLK(node->mode)) {
+    u32 major = major(node->rdev);
+    u32 minor = minor(node->rdev);
+    if (major < 256 && minor < 256) {
+      inode->i_block[0] = major << 8 | minor;
+    } else {
+      inode->i_block[1] = (minor & 0xFF) | major << 8 | (minor & ~0xFFU) << 12;
+    }
+  }
+}
+
+/* A directory's blocks, laid out the way tree_count_blocks counted them */
+u8 *dir_blocks(const struct tree *tree, u32 index) {
+  const struct tree_node *node = &tree->nodes[index];
+  u32 block_size = tree->geometry.block_size;
+  u8 *blocks = calloc(node->size / block_size, block_size);
+  if (blocks == NULL) {
+    errno_exit("calloc");
+  }
+  if (node->indexed) {
+    pack_htree(tree, index, blocks);
+  } else {
+    pack_dir(tree, index, blocks);
+  }
+  return blocks;
+}
+
+void emit_node(struct worker *worker, u32 index) {
+  struct builder *builder = worker->builder;
+  const struct tree *tree = builder->tree;
+  const struct tree_node *node = &tree->nodes[index];
+
+  struct ext2_inode inode;
+  node_inode(builder, node, &inode);
+
+  worker->extent = node->extent;
+  worker->extent_used = 0;
+
+  if (S_ISREG(node->mode) && uring_emit(worker, index, &inode)) {
+    /* Written once the ring gets to it */
+  } else if (S_ISREG(node->mode)) {
+    int source_fd = open_source_file(worker, index);
+    emit_contents(worker, &inode, source_fd, NULL, node->size);
+    close(source_fd);
+    worker->syscalls++;
+  } else if (S_ISDIR(node->mode)) {
+    u8 *blocks = dir_blocks(tree, index);
+    emit_contents(worker, &inode, -1, blocks, node->size);
+    free(blocks);
+  } else if (S_ISLNK(node->mode) && node->size >= EXT2_FAST_SYMLINK_LEN) {
+    emit_contents(worker, &inode, -1, (const u8 *)tree->names + node->target,
+                  node->size);
+  }
+
+  write_tree_inode(builder, node->ino, &inode);
+}
+
+void emit_group(struct worker *worker, u32 group) {
+  const struct builder *builder = worker->builder;
+  const struct group_state *state = &builder->groups[group];
+
+  for (u32 i = state->first_node; i < state->node_end; i++) {
+    u32 node = builder->order[i];
+    if (!builder->tree->nodes[node].hard_link) {
+      emit_node(worker, node);
+    }
+  }
+  if (worker->uring != NULL) {
+    uring_drain(worker);
+  }
+  cache_flush(worker);
+}
+
+u32 group_used_inodes(const struct builder *builder, u32 group) {
+  u32 first_ino = group * builder->layout.inodes_per_group + 1;
+  if (builder->tree->last_ino < first_ino) {
+    return 0;
+  }
+  u32 used = builder->tree->last_ino - first_ino + 1;
+  return used < builder->layout.inodes_per_group
+             ? used
+             : builder->layout.inodes_per_group;
+}
+
+/* Descriptors and the superblock only need the counts from plan_blocks */
+void prepare_tree_metadata(struct builder *builder) {
+  const struct geometry *geometry = &builder->tree->geometry;
+  const struct layout *layout = &builder->layout;
+  const u32 bitmap_bits = geometry->block_size * 8;
+  u32 free_inodes = 0;
+
+  builder->descriptors =
+      calloc(layout->descriptor_blocks, geometry->block_size);
+  if (builder->descriptors == NULL) {
+    errno_exit("calloc");
+  }
+
+  for (u32 group = 0; group < layout->group_count; group++) {
+    const struct group_state *state = &builder->groups[group];
+    u32 block_bitmap = group_bitmap_block(builder, group);
+
+    struct ext2_block_group_descriptor *descriptor =
+        &builder->descriptors[group];
+    descriptor->bg_block_bitmap = block_bitmap;
+    descriptor->bg_inode_bitmap = block_bitmap + 1;
+    descriptor->bg_inode_table = block_bitmap + 2;
+    descriptor->bg_free_blocks_count = state->free_blocks;
+    descriptor->bg_free_inodes_count =
+        layout->inodes_per_group - group_used_inodes(builder, group);
+    descriptor->bg_used_dirs_count = state->used_dirs;
+
+    free_inodes += descriptor->bg_free_inodes_count;
+
+    assert(bitmap_count(state->metadata, 0, bitmap_bits) ==
+           bitmap_bits - state->free_blocks);
+  }
+
+  struct ext2_superblock *superblock = &builder->superblock;
+  memset(superblock, 0, sizeof(*superblock));
+  superblock->s_inodes_count = layout->inodes_per_group * layout->group_count;
+  superblock->s_blocks_count = layout->blocks_count;
+  superblock->s_free_blocks_count = builder->free_blocks;
+  superblock->s_free_inodes_count = free_inodes;
+  superblock->s_first_data_block = geometry->first_data_block;
+  superblock->s_log_block_size = geometry->log_block_size;
+  superblock->s_log_frag_size = geometry->log_block_size;
+  superblock->s_blocks_per_group = geometry->blocks_per_group;
+  superblock->s_frags_per_group = geometry->blocks_per_group;
+  superblock->s_inodes_per_group = layout->inodes_per_group;
+  superblock->s_wtime = builder->current_time;
+  superblock->s_max_mnt_count = -1;
+  superblock->s_magic = EXT2_SUPER_MAGIC;
+  superblock->s_state = 1;
+  superblock->s_errors = EXT2_ERRORS_CONTINUE;
+  superblock->s_lastcheck = builder->current_time;
+  superblock->s_rev_level = EXT2_DYNAMIC_REV;
+  superblock->s_first_ino = EXT2_GOOD_OLD_FIRST_INO;
+  superblock->s_inode_size = geometry->inode_size;
+  superblock->s_feature_ro_compat = EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER;
+  if (builder->tree->large_files) {
+    superblock->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+  }
+  memcpy(superblock->s_uuid, builder->uuid, sizeof(superblock->s_uuid));
+  if (builder->tree->dir_index) {
+    superblock->s_feature_compat |= EXT2_FEATURE_COMPAT_DIR_INDEX;
+    memcpy(superblock->s_hash_seed, builder->tree->hash_seed,
+           sizeof(superblock->s_hash_seed));
+    superblock->s_def_hash_version = EXT2_HASH_HALF_MD4;
+    superblock->s_flags |= EXT2_FLAGS_UNSIGNED_HASH;
+  }
+}
+
+/* Bitmaps, then the group's metadata in one call since it is contiguous */
+void write_group_metadata(struct worker *worker, u32 group) {
+  const struct builder *builder = worker->builder;
+  const struct geometry *geometry = &builder->tree->geometry;
+  const struct layout *layout = &builder->layout;
+  const struct group_state *state = &builder->groups[group];
+
+  /* The block bitmap is already filled in by plan_blocks */
+  u8 *bitmap = state->metadata + geometry->block_size;
+  bitmap_set_range(bitmap, 0, group_used_inodes(builder, group));
+  bitmap_set_range(bitmap, layout->inodes_per_group, geometry->block_size * 8);
+
+  /* The superblock is always 1024 bytes into the image, so with larger
+     blocks the first copy is partway into block 0 */
+  u8 superblock_block[MAX_BLOCK_SIZE] = {0};
+  struct iovec iov[3];
+  int iov_count = 0;
+  if (group_has_super(group)) {
+    struct ext2_superblock superblock = builder->superblock;
+    superblock.s_block_group_nr = group;
+    u32 offset = group == 0 ? 1024 - geometry->first_data_block * 1024 : 0;
+    memcpy(superblock_block + offset, &superblock, sizeof(superblock));
+    iov[iov_count++] = (struct iovec){superblock_block, geometry->block_size};
+    iov[iov_count++] = (struct iovec){
+        builder->descriptors,
+        (size_t)layout->descriptor_blocks * geometry->block_size};
+  }
+  iov[iov_count++] = (struct iovec){
+      state->metadata,
+      (size_t)(2 + layout->inode_table_blocks) * geometry->block_size};
+
+  size_t size = 0;
+  for (int i = 0; i < iov_count; i++) {
+    size += iov[i].iov_len;
+  }
+  if (builder->sparse) {
+    /* Most of a sparse image's inode tables are empty */
+    u32 block = state->first_block;
+    for (int i = 0; i < iov_count; i++) {
+      image_pwrite(worker, iov[i].iov_base, iov[i].iov_len, block);
+      block += iov[i].iov_len / geometry->block_size;
+    }
+    return;
+  }
+
+  off_t position = (off_t)state->first_block * geometry->block_size;
+  if (pwritev(builder->fd, iov, iov_count, position) != (ssize_t)size) {
+    errno_exit("pwritev");
+  }
+  worker->syscalls++;
+  worker->bytes_written += size;
+  record_written(worker, state->first_block, size / geometry->block_size);
+}
+
+/* Groups are handed out one at a time until there are none left */
+void *worker_run(void *arg) {
+  struct worker *worker = arg;
+  struct builder *builder = worker->builder;
+
+  while (true) {
+    u32 group = atomic_fetch_add(&builder->next_group, 1);
+    if (group >= builder->layout.group_count) {
+      break;
+    }
+    builder->group_task(worker, group);
+  }
+  return NULL;
+}
+
+void run_workers(struct builder *builder, struct worker *workers,
+                 void (*group_task)(struct worker *, u32)) {
+  builder->group_task = group_task;
+  atomic_store(&builder->next_group, 0);
+
+  for (u32 i = 1; i < builder->thread_count; i++) {
+    int err = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    if (err != 0) {
+      errno = err;
+      errno_exit("pthread_create");
+    }
+  }
+  /* The calling thread works too */
+  worker_run(&workers[0]);
+  for (u32 i = 1; i < builder->thread_count; i++) {
+    int err = pthread_join(workers[i].thread, NULL);
+    if (err != 0) {
+      errno = err;
+      errno_exit("pthread_join");
+    }
+  }
+}
+
+void worker_init(struct worker *worker, struct builder *builder) {
+  const u32 block_size = builder->tree->geometry.block_size;
+  worker->builder = builder;
+  worker->cache.capacity = CACHE_WINDOW_SIZE / block_size;
+  worker->cache.window = malloc(CACHE_WINDOW_SIZE);
+  worker->fallback = malloc((size_t)COPY_BUFFER_BLOCKS * block_size);
+  if (worker->cache.window == NULL || worker->fallback == NULL) {
+    errno_exit("malloc");
+  }
+  worker->dir_node = NO_NODE;
+  worker->dir_fd = -1;
+  /* copy_file_range would fill in holes in the source, and the dedup
+     report needs to see the data */
+  worker->copy_range = !builder->sparse && !builder->dedup;
+}
+
+double elapsed_seconds(const struct timespec *start) {
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+    errno_exit("clock_gettime");
+  }
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int compare_extents(const void *left, const void *right) {
+  const struct extent *l = left;
+  const struct extent *r = right;
+  return (l->start > r->start) - (l->start < r->start);
+}
+
+/* Every block the workers wrote, as sorted runs that don't touch. Returns
+   the number of runs. */
+size_t written_runs(const struct worker *workers, u32 worker_count,
+                    struct extent **runs) {
+  size_t count = 0;
+  for (u32 i = 0; i < worker_count; i++) {
+    count += workers[i].written_count;
+  }
+  struct extent *extents = calloc(count > 0 ? count : 1, sizeof(struct extent));
+  if (extents == NULL) {
+    errno_exit("calloc");
+  }
+  count = 0;
+  for (u32 i = 0; i < worker_count; i++) {
+    memcpy(extents + count, workers[i].written,
+           workers[i].written_count * sizeof(struct extent));
+    count += workers[i].written_count;
+  }
+  qsort(extents, count, sizeof(struct extent), compare_extents);
+
+  /* Blocks can be written more than once, so runs may overlap */
+  size_t merged = 0;
+  for (size_t i = 0; i < count;) {
+    u64 start = extents[i].start;
+    u64 end = start + extents[i].length;
+    for (i++; i < count && extents[i].start <= end; i++) {
+      if (extents[i].start + extents[i].length > end) {
+        end = extents[i].start + extents[i].length;
+      }
+    }
+    extents[merged++] = (struct extent){start, end - start};
+  }
+  *runs = extents;
+  return merged;
+}
+
+/* One "OFFSET LENGTH" line in bytes per run of blocks that were written.
+   Everything else in the image reads back as zero. */
+void write_block_map(const char *path, const struct worker *workers,
+                     u32 worker_count, u32 block_size) {
+  struct extent *runs;
+  size_t count = written_runs(workers, worker_count, &runs);
+
+  FILE *map = fopen(path, "w");
+  if (map == NULL) {
+    errno_exit(path);
+  }
+  for (size_t i = 0; i < count; i++) {
+    fprintf(map, "%llu %llu\n", (unsigned long long)runs[i].start * block_size,
+            (unsigned long long)runs[i].length * block_size);
+  }
+  if (fclose(map) == EOF) {
+    errno_exit(path);
+  }
+  free(runs);
+}
+
+int compare_u64(const void *left, const void *right) {
+  u64 l = *(const u64 *)left;
+  u64 r = *(const u64 *)right;
+  return (l > r) - (l < r);
+}
+
+/* What dedup_tree linked, and how many of the data blocks written repeat
+   another one. ext2 can't share blocks between inodes, so those are only
+   reported. */
+void print_dedup_report(const struct dedup_stats *stats,
+                        const struct worker *workers, u32 worker_count,
+                        u32 block_size) {
+  const double mib = 1024.0 * 1024.0;
+  size_t count = 0;
+  u64 zero_blocks = 0;
+  for (u32 i = 0; i < worker_count; i++) {
+    count += workers[i].block_hash_count;
+    zero_blocks += workers[i].zero_blocks;
+  }
+  u64 *hashes = malloc((count > 0 ? count : 1) * sizeof(u64));
+  if (hashes == NULL) {
+    errno_exit("malloc");
+  }
+  count = 0;
+  for (u32 i = 0; i < worker_count; i++) {
+    memcpy(hashes + count, workers[i].block_hashes,
+           workers[i].block_hash_count * sizeof(u64));
+    count += workers[i].block_hash_count;
+  }
+  qsort(hashes, count, sizeof(u64), compare_u64);
+
+  u64 repeats = 0;
+  u64 repeated = 0;
+  for (size_t i = 1; i < count; i++) {
+    if (hashes[i] == hashes[i - 1]) {
+      repeats++;
+      if (i == 1 || hashes[i - 1] != hashes[i - 2]) {
+        repeated++;
+      }
+    }
+  }
+  free(hashes);
+
+  fprintf(stderr,
+          "%u files linked to identical ones, %.1f MiB not written "
+          "(%.1f MiB hashed to find them)\n",
+          stats->linked, stats->linked_bytes / mib, stats->hashed_bytes / mib);
+  if (stats->kept_apart > 0) {
+    fprintf(stderr,
+            "%u identical files kept apart, their mode, owner or mtime "
+            "differ\n",
+            stats->kept_apart);
+  }
+  fprintf(stderr,
+          "%llu of %zu data blocks repeat one of %llu others (%.1f MiB), "
+          "%llu more are all zero\n",
+          (unsigned long long)repeats, count, (unsigned long long)repeated,
+          repeats * (double)block_size / mib, (unsigned long long)zero_blocks);
+}
+
+/* Checks the sizes given on the command line and derives the rest */
+void geometry_init(struct geometry *geometry) {
+  u32 block_size = geometry->block_size;
+  if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE ||
+      (block_size & (block_size - 1)) != 0) {
+    fprintf(stderr, "Block size must be 1024, 2048 or 4096\n");
+    exit(EINVAL);
+  }
+
+  if (geometry->blocks_per_group == 0) {
+    geometry->blocks_per_group = block_size * 8;
+  }
+  if (geometry->blocks_per_group < MIN_BLOCKS_PER_GROUP ||
+      geometry->blocks_per_group > block_size * 8 ||
+      geometry->blocks_per_group % 8 != 0) {
+    fprintf(stderr, "Blocks per group must be a multiple of 8 from %u to %u\n",
+            MIN_BLOCKS_PER_GROUP, block_size * 8);
+    exit(EINVAL);
+  }
+
+  u32 inode_size = geometry->inode_size;
+  if (inode_size < sizeof(struct ext2_inode) || inode_size > block_size ||
+      (inode_size & (inode_size - 1)) != 0) {
+    fprintf(stderr, "Inode size must be a power of 2 from %zu to %u\n",
+            sizeof(struct ext2_inode), block_size);
+    exit(EINVAL);
+  }
+
+  u32 inode_ratio = geometry->inode_ratio;
+  if (inode_ratio != 0 &&
+      (inode_ratio < MIN_INODE_RATIO || inode_ratio > MAX_INODE_RATIO ||
+       inode_ratio < 2 * inode_size)) {
+    fprintf(stderr,
+            "Bytes per inode must be from %u to %u, and at least twice the "
+            "inode size\n",
+            MIN_INODE_RATIO, MAX_INODE_RATIO);
+    exit(EINVAL);
+  }
+
+  geometry->log_block_size = __builtin_ctz(block_size / MIN_BLOCK_SIZE);
+  geometry->first_data_block = block_size == MIN_BLOCK_SIZE ? 1 : 0;
+  geometry->pointers_per_block = block_size / sizeof(u32);
+  geometry->inodes_per_block = block_size / inode_size;
+}
+
+void create_from_tree(const struct tree_options *options) {
+  struct timespec start;
+  if (clock_gettime(CLOCK_MONOTONIC, &start) == -1) {
+    errno_exit("clock_gettime");
+  }
+
+  struct tree tree = {0};
+  tree.geometry = options->geometry;
+  tree_scan(&tree, options->source);
+  struct dedup_stats dedup_stats = {0};
+  if (options->dedup) {
+    dedup_tree(&tree, &dedup_stats);
+  }
+  tree.dir_index = options->dir_index;
+  if (tree.dir_index) {
+    if (getrandom(tree.hash_seed, sizeof(tree.hash_seed), 0) !=
+        sizeof(tree.hash_seed)) {
+      errno_exit("getrandom");
+    }
+  }
+  tree_count_blocks(&tree);
+
+  struct builder builder = {0};
+  builder.tree = &tree;
+  builder.current_time = get_current_time();
+  builder.sparse = options->sparse;
+  builder.dedup = options->dedup;
+  if (getrandom(builder.uuid, sizeof(builder.uuid), 0) !=
+      sizeof(builder.uuid)) {
+    errno_exit("getrandom");
+  }
+  plan_layout(&builder, options->headroom_percent);
+  plan_blocks(&builder);
+  prepare_tree_metadata(&builder);
+
+  /* More threads than groups would have nothing to do */
+  builder.thread_count = options->thread_count < builder.layout.group_count
+                             ? options->thread_count
+                             : builder.layout.group_count;
+
+  builder.fd = open(options->image, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+  if (builder.fd == -1) {
+    errno_exit("open");
+  }
+  const u32 block_size = tree.geometry.block_size;
+  if (ftruncate(builder.fd, (off_t)builder.layout.blocks_count * block_size)) {
+    errno_exit("ftruncate");
+  }
+
+  struct worker *workers = calloc(builder.thread_count, sizeof(struct worker));
+  if (workers == NULL) {
+    errno_exit("calloc");
+  }
+  /* Sparse images need to see the data before deciding what to write */
+  u32 ring_count = 0;
+  for (u32 i = 0; i < builder.thread_count; i++) {
+    worker_init(&workers[i], &builder);
+    if (options->queue_depth > 0 && !builder.sparse) {
+      workers[i].uring = uring_create(options->queue_depth, builder.fd);
+      ring_count += workers[i].uring != NULL;
+    }
+  }
+
+  /* Metadata goes last, once every inode is in its table */
+  run_workers(&builder, workers, emit_group);
+  run_workers(&builder, workers, write_group_metadata);
+
+  if (close(builder.fd)) {
+    errno_exit("close");
+  }
+  if (options->map_path != NULL) {
+    write_block_map(options->map_path, workers, builder.thread_count,
+                    tree.geometry.block_size);
+  }
+  if (options->dedup) {
+    print_dedup_report(&dedup_stats, workers, builder.thread_count,
+                       tree.geometry.block_size);
+  }
+
+  u64 syscalls = 0;
+  u64 bytes_written = 0;
+  for (u32 i = 0; i < builder.thread_count; i++) {
+    if (workers[i].dir_fd != -1) {
+      close(workers[i].dir_fd);
+    }
+    if (workers[i].uring != NULL) {
+      uring_free(workers[i].uring);
+    }
+    syscalls += workers[i].syscalls;
+    bytes_written += workers[i].bytes_written;
+    free(workers[i].cache.window);
+    free(workers[i].fallback);
+    free(workers[i].written);
+    free(workers[i].block_hashes);
+  }
+  free(workers);
+
+  if (options->stats) {
+    double seconds = elapsed_seconds(&start);
+    double mib = bytes_written / (1024.0 * 1024.0);
+    fprintf(stderr,
+            "%u inodes, %llu I/O syscalls (%.2f per inode), "
+            "%.1f MiB in %.3f s (%.1f MiB/s) on %u threads, %u with "
+            "io_uring\n",
+            tree.last_ino, (unsigned long long)syscalls,
+            (double)syscalls / tree.last_ino, mib, seconds, mib / seconds,
+            builder.thread_count, ring_count);
+  }
+
+  close(tree.root_fd);
+  for (u32 group = 0; group < builder.layout.group_count; group++) {
+    free(builder.groups[group].metadata);
+  }
+  free(builder.descriptors);
+  free(builder.extents);
+  free(builder.order);
+  free(builder.groups);
+  free(tree.nodes);
+  free(tree.names);
+  free(tree.links);
+}
+
+/* How update_image brings a node's inode up to date. The ones that write
+   out new blocks come last. */
+enum update_action {
+  /* Only the inode itself can have changed */
+  UPDATE_INODE,
+  /* Same blocks, rewriting those whose contents differ */
+  UPDATE_DIFF,
+  /* New blocks, all written out */
+  UPDATE_WRITE,
+  /* A new inode */
+  UPDATE_WRITE_NEW,
+};
+
+/* The image being updated, and how the new tree's nodes relate to it */
+struct update {
+  struct ext2_image image;
+  /* Group metadata as it was read, to tell which blocks changed */
+  u8 *original;
+  /* Inode each node had in the image, or 0 if it is new. Indexed by the
+     number tree_scan gave it, so any name of a hard linked file can keep the
+     old inode for all of them. */
+  u32 *old_inos;
+  enum update_action *actions;
+  /* Bitmap of the image's inodes that some node kept */
+  u8 *claimed;
+
+  u32 added;
+  u32 changed;
+  u32 removed;
+};
+
+/* A directory entry in the image, with its name in `names` */
+struct old_entry {
+  size_t name;
+  u32 name_len;
+  u32 ino;
+};
+
+struct old_dir {
+  struct old_entry *entries;
+  size_t count;
+  size_t capacity;
+  char *names;
+  size_t names_len;
+  size_t names_capacity;
+};
+
+bool bit_is_set(const u8 *bitmap, u32 bit) {
+  return bitmap[bit / 8] & (1U << bit % 8);
+}
+
+/* The inode as it was in the image */
+void read_old_inode(const struct builder *builder, const struct update *update,
+                    u32 ino, struct ext2_inode *inode) {
+  const struct geometry *geometry = &builder->tree->geometry;
+  const struct layout *layout = &builder->layout;
+  u32 group = (ino - 1) / layout->inodes_per_group;
+  u32 index = (ino - 1) % layout->inodes_per_group;
+  const u8 *metadata = update->original + (size_t)group *
+                                              (2 + layout->inode_table_blocks) *
+                                              geometry->block_size;
+  memcpy(inode,
+         metadata + 2 * geometry->block_size +
+             (size_t)index * geometry->inode_size,
+         sizeof(*inode));
+}
+
+/* Takes the layout from the superblock and reads in every group's bitmaps
+   and inode table. Only images laid out the way plan_layout does it can be
+   updated. */
+void load_groups(struct builder *builder, struct update *update,
+                 const char *path) {
+  const struct ext2_image *image = &update->image;
+  const struct geometry *geometry = &builder->tree->geometry;
+  struct layout *layout = &builder->layout;
+  layout->blocks_count = image->superblock.s_blocks_count;
+  layout->group_count = image->group_count;
+  layout->inodes_per_group = image->superblock.s_inodes_per_group;
+  layout->inode_table_blocks = image->inode_table_blocks;
+  layout->descriptor_blocks = image->descriptor_blocks;
+
+  const size_t metadata_size =
+      (size_t)(2 + layout->inode_table_blocks) * geometry->block_size;
+  update->original = malloc(layout->group_count * metadata_size);
+  builder->groups = calloc(layout->group_count, sizeof(struct group_state));
+  if (update->original == NULL || builder->groups == NULL) {
+    errno_exit("malloc");
+  }
+
+  for (u32 group = 0; group < layout->group_count; group++) {
+    struct group_state *state = &builder->groups[group];
+    const struct ext2_block_group_descriptor *descriptor =
+        &image->descriptors[group];
+    group_bounds(builder, group);
+    u32 block_bitmap = group_bitmap_block(builder, group);
+    if (descriptor->bg_block_bitmap != block_bitmap ||
+        descriptor->bg_inode_bitmap != block_bitmap + 1 ||
+        descriptor->bg_inode_table != block_bitmap + 2) {
+      fprintf(stderr, "%s: not laid out by ext2-create\n", path);
+      exit(EINVAL);
+    }
+
+    u8 *original = update->original + group * metadata_size;
+    off_t position = (off_t)block_bitmap * geometry->block_size;
+    if (pread(image->fd, original, metadata_size, position) !=
+        (ssize_t)metadata_size) {
+      errno_exit("pread");
+    }
+    state->metadata = malloc(metadata_size);
+    if (state->metadata == NULL) {
+      errno_exit("malloc");
+    }
+    memcpy(state->metadata, original, metadata_size);
+
+    u32 blocks = state->end - state->first_block;
+    state->free_blocks = blocks - bitmap_count(state->metadata, 0, blocks);
+    state->used_dirs = descriptor->bg_used_dirs_count;
+    builder->free_blocks += state->free_blocks;
+  }
+}
+
+bool collect_entry(const struct ext2_dir_entry *entry, u32 name_len,
+                   void *arg) {
+  struct old_dir *dir = arg;
+  if ((name_len == 1 && entry->name[0] == '.') ||
+      (name_len == 2 && entry->name[0] == '.' && entry->name[1] == '.')) {
+    return false;
+  }
+
+  dir->entries = grow_array(dir->entries, &dir->capacity, dir->count + 1,
+                            sizeof(struct old_entry));
+  dir->names = grow_array(dir->names, &dir->names_capacity,
+                          dir->names_len + name_len, 1);
+  memcpy(dir->names + dir->names_len, entry->name, name_len);
+  dir->entries[dir->count++] =
+      (struct old_entry){dir->names_len, name_len, entry->inode};
+  dir->names_len += name_len;
+  return false;
+}
+
+/* Orders names the way strcmp orders a directory's children */
+int compare_name_bytes(const char *left, u32 left_len, const char *right,
+                       u32 right_len) {
+  int order = memcmp(left, right, left_len < right_len ? left_len : right_len);
+  if (order != 0) {
+    return order;
+  }
+  return (left_len > right_len) - (left_len < right_len);
+}
+
+int compare_old_entries(const void *left, const void *right, void *names) {
+  const struct old_entry *l = left;
+  const struct old_entry *r = right;
+  return compare_name_bytes((const char *)names + l->name, l->name_len,
+                            (const char *)names + r->name, r->name_len);
+}
+
+/* Pairs the children of a directory that was in the image with the entries
+   it had. A child keeps its old inode if it has the same name and type, and
+   no other inode kept it first. */
+void match_dir(struct builder *builder, struct update *update, u32 dir,
+               struct old_dir *old) {
+  const struct tree *tree = builder->tree;
+  const struct tree_node *node = &tree->nodes[dir];
+  struct ext2_inode inode;
+  read_old_inode(builder, update, update->old_inos[node->ino], &inode);
+
+  old->count = 0;
+  old->names_len = 0;
+  int err = ext2_dir_iterate(&update->image, &inode, collect_entry, old);
+  if (err != 0) {
+    char path[PATH_MAX];
+    node_path(tree, dir, path, sizeof(path));
+    fprintf(stderr, "%s in the image: %s\n", path, strerror(err));
+    exit(err);
+  }
+  qsort_r(old->entries, old->count, sizeof(struct old_entry),
+          compare_old_entries, old->names);
+
+  const u8 *inode_bitmaps = NULL;
+  size_t j = 0;
+  for (u32 i = 0; i < node->child_count; i++) {
+    u32 child = node->first_child + i;
+    const struct tree_node *child_node = &tree->nodes[child];
+    int order = 1;
+    while (j < old->count &&
+           (order = compare_name_bytes(
+                node_name(tree, child), child_node->name_len,
+                old->names + old->entries[j].name,
+                old->entries[j].name_len)) > 0) {
+      j++;
+    }
+    if (j == old->count || order != 0 ||
+        update->old_inos[child_node->ino] != 0) {
+      continue;
+    }
+
+    u32 ino = old->entries[j].ino;
+    if (ino < EXT2_GOOD_OLD_FIRST_INO ||
+        ino > builder->layout.inodes_per_group * builder->layout.group_count ||
+        bit_is_set(update->claimed, ino)) {
+      continue;
+    }
+    u32 group = (ino - 1) / builder->layout.inodes_per_group;
+    inode_bitmaps = update->original +
+                    (size_t)group * (2 + builder->layout.inode_table_blocks) *
+                        tree->geometry.block_size +
+                    tree->geometry.block_size;
+    read_old_inode(builder, update, ino, &inode);
+    if (!bit_is_set(inode_bitmaps,
+                    (ino - 1) % builder->layout.inodes_per_group) ||
+        (inode.i_mode & S_IFMT) != (child_node->mode & S_IFMT)) {
+      continue;
+    }
+
+    update->old_inos[child_node->ino] = ino;
+    update->claimed[ino / 8] |= 1U << ino % 8;
+  }
+}
+
+/* Directories come before their children, so each is matched before its
+   children are looked for in it */
+void match_tree(struct builder *builder, struct update *update) {
+  const struct tree *tree = builder->tree;
+  struct old_dir old = {0};
+
+  update->old_inos[EXT2_ROOT_INO] = EXT2_ROOT_INO;
+  update->claimed[EXT2_ROOT_INO / 8] |= 1U << EXT2_ROOT_INO % 8;
+  for (u32 i = 0; i < tree->node_count; i++) {
+    if (S_ISDIR(tree->nodes[i].mode) &&
+        update->old_inos[tree->nodes[i].ino] != 0) {
+      match_dir(builder, update, i, &old);
+    }
+  }
+  free(old.entries);
+  free(old.names);
+}
+
+void release_block(u32 block, void *arg) {
+  struct builder *builder = arg;
+  const struct geometry *geometry = &builder->tree->geometry;
+  if (block < geometry->first_data_block ||
+      block >= builder->layout.blocks_count) {
+    return;
+  }
+  u32 group = (block - geometry->first_data_block) / geometry->blocks_per_group;
+  u32 bit = (block - geometry->first_data_block) % geometry->blocks_per_group;
+  struct group_state *state = &builder->groups[group];
+  if (bit_is_set(state->metadata, bit)) {
+    bitmap_clear_range(state->metadata, bit, bit + 1);
+    state->free_blocks++;
+    builder->free_blocks++;
+  }
+}
+
+/* Frees every block an inode in the image has */
+void release_blocks(struct builder *builder, struct update *update,
+                    const struct ext2_inode *inode) {
+  int err = ext2_inode_blocks(&update->image, inode, release_block, builder);
+  if (err != 0) {
+    fprintf(stderr, "Reading the image: %s\n", strerror(err));
+    exit(err);
+  }
+}
+
+/* Frees the inodes in the image that no node kept, like the kernel does
+   when the last link goes */
+void release_unclaimed(struct builder *builder, struct update *update) {
+  const struct layout *layout = &builder->layout;
+  const u32 block_size = builder->tree->geometry.block_size;
+
+  for (u32 group = 0; group < layout->group_count; group++) {
+    u8 *inode_bitmap = builder->groups[group].metadata + block_size;
+    u32 bit = 0;
+    while ((bit = bitmap_next(inode_bitmap, bit, layout->inodes_per_group,
+                              true)) < layout->inodes_per_group) {
+      u32 ino = group * layout->inodes_per_group + bit + 1;
+      bit++;
+      if (ino < EXT2_GOOD_OLD_FIRST_INO || bit_is_set(update->claimed, ino)) {
+        continue;
+      }
+
+      struct ext2_inode inode;
+      read_old_inode(builder, update, ino, &inode);
+      release_blocks(builder, update, &inode);
+      if (S_ISDIR(inode.i_mode)) {
+        builder->groups[group].used_dirs--;
+      }
+      bitmap_clear_range(inode_bitmap, bit - 1, bit);
+      inode.i_links_count = 0;
+      inode.i_dtime = builder->current_time;
+      write_tree_inode(builder, ino, &inode);
+      update->removed++;
+    }
+  }
+}
+
+/* First free inode, starting from the group `goal` is in */
+u32 alloc_inode(struct builder *builder, u32 goal) {
+  const struct layout *layout = &builder->layout;
+  const u32 block_size = builder->tree->geometry.block_size;
+  u32 first_group = (goal - 1) / layout->inodes_per_group;
+
+  for (u32 i = 0; i < layout->group_count; i++) {
+    u32 group = (first_group + i) % layout->group_count;
+    u8 *inode_bitmap = builder->groups[group].metadata + block_size;
+    u32 bit = bitmap_next(inode_bitmap, 0, layout->inodes_per_group, false);
+    if (bit < layout->inodes_per_group) {
+      bitmap_set_range(inode_bitmap, bit, bit + 1);
+      return group * layout->inodes_per_group + bit + 1;
+    }
+  }
+  fprintf(stderr, "Ran out of inodes\n");
+  exit(ENOSPC);
+}
+
+/* Settles each node's inode number and decides what to rewrite. Nodes that
+   need new blocks get them after every block going away has been freed. */
+void plan_update(struct builder *builder, struct update *update) {
+  struct tree *tree = builder->tree;
+  const struct geometry *geometry = &tree->geometry;
+  const u32 sectors_per_block = geometry->block_size / 512;
+
+  /* Numbers from tree_scan, which hard links are still using */
+  u32 *remap = calloc(tree->last_ino + 1, sizeof(u32));
+  if (remap == NULL) {
+    errno_exit("calloc");
+  }
+
+  for (u32 i = 0; i < tree->node_count; i++) {
+    struct tree_node *node = &tree->nodes[i];
+    if (node->hard_link) {
+      node->ino = remap[node->ino];
+      continue;
+    }
+
+    u32 old_ino = update->old_inos[node->ino];
+    if (old_ino == 0) {
+      u32 ino = alloc_inode(builder, tree->nodes[node->parent].ino);
+      remap[node->ino] = ino;
+      node->ino = ino;
+      if (S_ISDIR(node->mode)) {
+        builder->groups[(ino - 1) / builder->layout.inodes_per_group]
+            .used_dirs++;
+      }
+      update->actions[i] = UPDATE_WRITE_NEW;
+      continue;
+    }
+    remap[node->ino] = old_ino;
+    node->ino = old_ino;
+
+    struct ext2_inode inode;
+    read_old_inode(builder, update, old_ino, &inode);
+    if (inode.i_blocks / sectors_per_block != node->block_count) {
+      release_blocks(builder, update, &inode);
+      update->actions[i] = UPDATE_WRITE;
+    } else if (node->block_count == 0 ||
+               (S_ISREG(node->mode) && node->size == ext2_inode_size(&inode) &&
+                node->mtime == inode.i_mtime)) {
+      update->actions[i] = UPDATE_INODE;
+    } else {
+      update->actions[i] = UPDATE_DIFF;
+    }
+  }
+  free(remap);
+
+  for (u32 i = 0; i < tree->node_count; i++) {
+    struct tree_node *node = &tree->nodes[i];
+    if (!node->hard_link && update->actions[i] >= UPDATE_WRITE) {
+      /* Near the parent, as plan_blocks would have put it */
+      u32 parent_ino = tree->nodes[node->parent].ino;
+      u32 group = (parent_ino - 1) / builder->layout.inodes_per_group;
+      builder->alloc_goal = group < builder->layout.group_count ? group : 0;
+      plan_node_blocks(builder, node);
+    }
+  }
+}
+
+/* Rewrites the runs of an inode's blocks that differ from `size` bytes of
+   `source_fd`, or of `data` if it is -1. The inode keeps the blocks it had.
+   Returns whether anything was rewritten. */
+bool diff_contents(struct worker *worker, struct ext2_image *image,
+                   const struct ext2_inode *inode, int source_fd,
+                   const u8 *data, u64 size) {
+  const u32 block_size = worker->builder->tree->geometry.block_size;
+  const size_t max_chunk = (size_t)COPY_BUFFER_BLOCKS * block_size;
+  u8 *buf = worker->fallback;
+  bool rewritten = false;
+
+  for (u64 done = 0; done < size;) {
+    size_t chunk = size - done < max_chunk ? size - done : max_chunk;
+    u32 count = DIV_ROUND_UP(chunk, block_size);
+    if (source_fd == -1) {
+      memcpy(buf, data + done, chunk);
+    } else {
+      read_full(worker, source_fd, buf, chunk);
+    }
+    memset(buf + chunk, 0, (size_t)count * block_size - chunk);
+
+    /* Differing blocks that are next to each other go out together */
+    u32 run_start = 0;
+    u32 run_block = 0;
+    u32 run_length = 0;
+    for (u32 i = 0; i <= count; i++) {
+      u32 block = 0;
+      bool differs = false;
+      if (i < count) {
+        int err =
+            ext2_map_block(image, inode, done / block_size + i, &block);
+        const u8 *old = err == 0 && block != 0
+                            ? ext2_read_block(image, block)
+                            : NULL;
+        if (old == NULL) {
+          fprintf(stderr, "Reading the image: %s\n",
+                  strerror(err != 0 ? err : block == 0 ? EUCLEAN : errno));
+          exit(EUCLEAN);
+        }
+        differs =
+            memcmp(old, buf + (size_t)i * block_size, block_size) != 0;
+      }
+
+      if (differs && run_length > 0 && block == run_block + run_length &&
+          i == run_start + run_length) {
+        run_length++;
+        continue;
+      }
+      if (run_length > 0) {
+        pwrite_blocks(worker, buf + (size_t)run_start * block_size,
+                      run_length, run_block);
+        rewritten = true;
+        run_length = 0;
+      }
+      if (differs) {
+        run_start = i;
+        run_block = block;
+        run_length = 1;
+      }
+    }
+    done += chunk;
+  }
+  return rewritten;
+}
+
+/* Brings a node that kept its inode and blocks up to date */
+void update_node(struct worker *worker, struct update *update, u32 index) {
+  struct builder *builder = worker->builder;
+  const struct tree *tree = builder->tree;
+  const struct tree_node *node = &tree->nodes[index];
+
+  struct ext2_inode old;
+  read_old_inode(builder, update, node->ino, &old);
+  struct ext2_inode inode;
+  node_inode(builder, node, &inode);
+  /* Not part of the diff, and reading the source to compare it moves it */
+  inode.i_atime = old.i_atime;
+  if (node->ino == LOST_AND_FOUND_INO) {
+    inode.i_ctime = old.i_ctime;
+    inode.i_mtime = old.i_mtime;
+  }
+  if (node->block_count > 0) {
+    memcpy(inode.i_block, old.i_block, sizeof(inode.i_block));
+    inode.i_blocks = old.i_blocks;
+  }
+
+  bool changed = false;
+  if (update->actions[index] == UPDATE_DIFF) {
+    if (S_ISREG(node->mode)) {
+      int source_fd = open_source_file(worker, index);
+      changed = diff_contents(worker, &update->image, &old, source_fd, NULL,
+                              node->size);
+      close(source_fd);
+    } else if (S_ISDIR(node->mode)) {
+      u8 *blocks = dir_blocks(tree, index);
+      changed = diff_contents(worker, &update->image, &old, -1, blocks,
+                              node->size);
+      free(blocks);
+    } else {
+      changed = diff_contents(worker, &update->image, &old, -1,
+                              (const u8 *)tree->names + node->target,
+                              node->size);
+    }
+  }
+
+  if (memcmp(&inode, &old, sizeof(inode)) != 0) {
+    write_tree_inode(builder, node->ino, &inode);
+    changed = true;
+  }
+  if (changed) {
+    update->changed++;
+  }
+}
+
+/* Writes the runs of `count` blocks from `block` that differ from `old` */
+void write_changed_blocks(struct worker *worker, const u8 *buf, const u8 *old,
+                          u32 count, u32 block) {
+  const u32 block_size = worker->builder->tree->geometry.block_size;
+  for (u32 i = 0; i < count;) {
+    if (memcmp(buf + (size_t)i * block_size, old + (size_t)i * block_size,
+               block_size) == 0) {
+      i++;
+      continue;
+    }
+    u32 run = 1;
+    while (i + run < count &&
+           memcmp(buf + (size_t)(i + run) * block_size,
+                  old + (size_t)(i + run) * block_size, block_size) != 0) {
+      run++;
+    }
+    pwrite_blocks(worker, buf + (size_t)i * block_size, run, block + i);
+    i += run;
+  }
+}
+
+/* Writes the bitmap and inode table blocks that changed, then the primary
+   descriptors and superblock. Backup copies are left as they were, like
+   the kernel leaves them. */
+void write_update_metadata(struct worker *worker, struct update *update) {
+  struct builder *builder = worker->builder;
+  const struct geometry *geometry = &builder->tree->geometry;
+  const struct layout *layout = &builder->layout;
+  const u32 metadata_blocks = 2 + layout->inode_table_blocks;
+  u32 free_inodes = 0;
+
+  size_t descriptors_size =
+      (size_t)layout->descriptor_blocks * geometry->block_size;
+  u8 *old_descriptors = calloc(1, descriptors_size);
+  builder->descriptors = calloc(1, descriptors_size);
+  if (old_descriptors == NULL || builder->descriptors == NULL) {
+    errno_exit("calloc");
+  }
+  memcpy(old_descriptors, update->image.descriptors,
+         layout->group_count * sizeof(struct ext2_block_group_descriptor));
+  memcpy(builder->descriptors, old_descriptors, descriptors_size);
+
+  for (u32 group = 0; group < layout->group_count; group++) {
+    const struct group_state *state = &builder->groups[group];
+    write_changed_blocks(
+        worker, state->metadata,
+        update->original +
+            (size_t)group * metadata_blocks * geometry->block_size,
+        metadata_blocks, group_bitmap_block(builder, group));
+
+    struct ext2_block_group_descriptor *descriptor =
+        &builder->descriptors[group];
+    descriptor->bg_free_blocks_count = state->free_blocks;
+    descriptor->bg_free_inodes_count =
+        layout->inodes_per_group -
+        bitmap_count(state->metadata + geometry->block_size, 0,
+                     layout->inodes_per_group);
+    descriptor->bg_used_dirs_count = state->used_dirs;
+    free_inodes += descriptor->bg_free_inodes_count;
+  }
+  write_changed_blocks(worker, (const u8 *)builder->descriptors,
+                       old_descriptors, layout->descriptor_blocks,
+                       geometry->first_data_block + 1);
+  free(old_descriptors);
+
+  struct ext2_superblock *superblock = &builder->superblock;
+  superblock->s_free_blocks_count = builder->free_blocks;
+  superblock->s_free_inodes_count = free_inodes;
+  if (builder->tree->large_files) {
+    superblock->s_feature_ro_compat |= EXT2_FEATURE_RO_COMPAT_LARGE_FILE;
+  }
+  if (worker->written_count > 0 ||
+      memcmp(superblock, &update->image.superblock, sizeof(*superblock)) !=
+          0) {
+    superblock->s_wtime = builder->current_time;
+    if (pwrite(builder->fd, superblock, sizeof(*superblock), 1024) !=
+        sizeof(*superblock)) {
+      errno_exit("pwrite");
+    }
+    worker->syscalls++;
+    worker->bytes_written += sizeof(*superblock);
+    record_written(worker, 1024 / geometry->block_size, 1);
+  }
+}
+
+/* Brings an image made from an earlier version of the tree up to date,
+   rewriting only the inodes, blocks and bitmaps that changed. Nodes keep
+   the inode they had at the same path, so unchanged files and directories
+   aren't touched at all. */
+void update_image(const struct tree_options *options) {
+  struct update update = {0};
+  int err = ext2_open(&update.image, options->image);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", options->image, strerror(err));
+    exit(err);
+  }
+  const struct ext2_superblock *old_superblock = &update.image.superblock;
+  if (old_superblock->s_rev_level != EXT2_DYNAMIC_REV ||
+      old_superblock->s_first_ino != EXT2_GOOD_OLD_FIRST_INO ||
+      old_superblock->s_feature_incompat != 0 ||
+      update.image.inode_size < sizeof(struct ext2_inode)) {
+    fprintf(stderr, "%s: not made by ext2-create\n", options->image);
+    exit(EINVAL);
+  }
+
+  struct tree tree = {0};
+  tree.geometry.block_size = update.image.block_size;
+  tree.geometry.blocks_per_group = old_superblock->s_blocks_per_group;
+  tree.geometry.inode_size = update.image.inode_size;
+  geometry_init(&tree.geometry);
+  tree_scan(&tree, options->source);
+  /* Otherwise files linked by an earlier -D build would be split up */
+  if (options->dedup) {
+    struct dedup_stats dedup_stats = {0};
+    dedup_tree(&tree, &dedup_stats);
+  }
+  tree.dir_index =
+      old_superblock->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX;
+  memcpy(tree.hash_seed, old_superblock->s_hash_seed, sizeof(tree.hash_seed));
+  tree_count_blocks(&tree);
+
+  struct builder builder = {0};
+  builder.tree = &tree;
+  builder.current_time = get_current_time();
+  builder.superblock = *old_superblock;
+  builder.thread_count = 1;
+  load_groups(&builder, &update, options->image);
+
+  update.old_inos = calloc(tree.last_ino + 1, sizeof(u32));
+  update.actions = calloc(tree.node_count, sizeof(enum update_action));
+  update.claimed = calloc(
+      DIV_ROUND_UP(old_superblock->s_inodes_count + 1, 8), 1);
+  if (update.old_inos == NULL || update.actions == NULL ||
+      update.claimed == NULL) {
+    errno_exit("calloc");
+  }
+  match_tree(&builder, &update);
+  release_unclaimed(&builder, &update);
+  plan_update(&builder, &update);
+
+  /* Nothing is written until here, so running out of inodes or blocks
+     leaves the image as it was. The builder isn't sparse, since freed
+     blocks still hold old data and zero blocks have to be written. */
+  builder.fd = open(options->image, O_WRONLY);
+  if (builder.fd == -1) {
+    errno_exit("open");
+  }
+  struct worker worker = {0};
+  worker_init(&worker, &builder);
+
+  for (u32 i = 0; i < tree.node_count; i++) {
+    if (tree.nodes[i].hard_link) {
+      continue;
+    }
+    if (update.actions[i] < UPDATE_WRITE) {
+      update_node(&worker, &update, i);
+    } else {
+      emit_node(&worker, i);
+      if (update.actions[i] == UPDATE_WRITE_NEW) {
+        update.added++;
+      } else {
+        update.changed++;
+      }
+    }
+  }
+  cache_flush(&worker);
+  write_update_metadata(&worker, &update);
+
+  if (close(builder.fd)) {
+    errno_exit("close");
+  }
+  if (options->map_path != NULL) {
+    write_block_map(options->map_path, &worker, 1, tree.geometry.block_size);
+  }
+
+  struct extent *runs;
+  size_t run_count = written_runs(&worker, 1, &runs);
+  u64 touched = 0;
+  for (size_t i = 0; i < run_count; i++) {
+    touched += runs[i].length;
+  }
+  printf("%u added, %u changed, %u removed; %llu of %u blocks touched\n",
+         update.added, update.changed, update.removed,
+         (unsigned long long)touched, builder.layout.blocks_count);
+  free(runs);
+
+  if (worker.dir_fd != -1) {
+    close(worker.dir_fd);
+  }
+  free(worker.cache.window);
+  free(worker.fallback);
+  free(worker.written);
+  ext2_close(&update.image);
+  close(tree.root_fd);
+  for (u32 group = 0; group < builder.layout.group_count; group++) {
+    free(builder.groups[group].metadata);
+  }
+  free(builder.descriptors);
+  free(builder.extents);
+  free(builder.groups);
+  free(update.original);
+  free(update.old_inos);
+  free(update.actions);
+  free(update.claimed);
+  free(tree.nodes);
+  free(tree.names);
+  free(tree.links);
+}
+
+/* Without arguments, writes the fixed cs111-base.img as before */
+int main(int argc, char *argv[]) {
+  struct tree_options options = {0};
+  options.image = "cs111-base.img";
+  options.headroom_percent = DEFAULT_HEADROOM_PERCENT;
+  options.geometry.block_size = MIN_BLOCK_SIZE;
+  options.geometry.inode_size = sizeof(struct ext2_inode);
+  options.queue_depth = URING_DEPTH;
+  long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:o:x:j:sSm:ib:g:I:r:uDq:")) != -1) {
+    switch (opt) {
+    case 'd':
+      options.source = optarg;
+      break;
+    case 'o':
+      options.image = optarg;
+      break;
+    case 'x':
+      options.headroom_percent = strtoul(optarg, NULL, 10);
+      break;
+    case 'j':
+      thread_count = strtol(optarg, NULL, 10);
+      break;
+    case 's':
+      options.stats = true;
+      break;
+    case 'S':
+      options.sparse = true;
+      break;
+    case 'm':
+      options.map_path = optarg;
+      break;
+    case 'i':
+      options.dir_index = true;
+      break;
+    case 'b':
+      options.geometry.block_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'g':
+      options.geometry.blocks_per_group = strtoul(optarg, NULL, 10);
+      break;
+    case 'I':
+      options.geometry.inode_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'r':
+      options.geometry.inode_ratio = strtoul(optarg, NULL, 10);
+      break;
+    case 'u':
+      options.update = true;
+      break;
+    case 'D':
+      options.dedup = true;
+      break;
+    case 'q':
+      options.queue_depth = strtoul(optarg, NULL, 10);
+      if (options.queue_depth > URING_MAX_DEPTH) {
+        fprintf(stderr, "Queue depth must be at most %u\n", URING_MAX_DEPTH);
+        exit(EINVAL);
+      }
+      break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-d SOURCE_DIR] [-o IMAGE] [-x HEADROOM%%] "
+              "[-j THREADS] [-s] [-S] [-m MAP] [-i] [-b BLOCK_SIZE] "
+              "[-g BLOCKS_PER_GROUP] [-I INODE_SIZE] [-r BYTES_PER_INODE] "
+              "[-u] [-D] [-q QUEUE_DEPTH]\n",
+              argv[0]);
+      exit(EINVAL);
+    }
+  }
+
+  if (options.update) {
+    if (options.source == NULL) {
+      fprintf(stderr, "-u needs the new tree given with -d\n");
+      exit(EINVAL);
+    }
+    update_image(&options);
+    return 0;
+  }
+  if (options.source != NULL) {
+    options.thread_count = thread_count < 1 ? 1 : thread_count;
+    geometry_init(&options.geometry);
+    create_from_tree(&options);
+    return 0;
+  }
+  const char *image = options.image;
+
+  int file_desc = open(image, O_CREAT | O_WRONLY, 0666);
+  if (file_desc == -1) {
+    errno_exit("open");
+  }
+
+  if (ftruncate(file_desc, 0)) {
+    errno_exit("ftruncate");
+  }
+
+  /* Built in memory and written with a single call */
+  u8 *contents = calloc(NUM_BLOCKS, BLOCK_SIZE);
+  if (contents == NULL) {
+    errno_exit("calloc");
+  }
+
+  write_superblock(contents);
+  write_block_group_descriptor_table(contents);
+  write_block_bitmap(contents);
+  write_inode_bitmap(contents);
+  write_inode_table(contents);
+  write_root_dir_block(contents);
+  write_lost_and_found_dir_block(contents);
+  write_hello_world_file_block(contents);
+
+  if (pwrite(file_desc, contents, NUM_BLOCKS * BLOCK_SIZE, 0) !=
+      NUM_BLOCKS * BLOCK_SIZE) {
+    errno_exit("pwrite");
+  }
+  free(contents);
 
   if (close(file_desc)) {
     errno_exit("close");
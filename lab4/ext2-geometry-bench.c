@@ -0,0 +1,186 @@
+// Builds an image of a source tree with ext2-create for each geometry, mounts
+// it and measures how fast every file reads back with cold caches. Needs root
+// to mount and drop caches, and ext2-create built in the current directory.
+//
+// Build with `cc -O2 -o ext2-geometry-bench ext2-geometry-bench.c`, then run
+// `./ext2-geometry-bench SOURCE_DIR [SCRATCH_DIR]`.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DROP_CACHES_PATH "/proc/sys/vm/drop_caches"
+#define READ_BUFFER_SIZE (1024 * 1024)
+#define MAX_GEOMETRY_ARGS 6
+
+struct geometry {
+  const char *name;
+  const char *args[MAX_GEOMETRY_ARGS];
+};
+
+static const struct geometry GEOMETRIES[] = {
+    {"1k", {"-b", "1024"}},
+    {"2k", {"-b", "2048"}},
+    {"4k", {"-b", "4096"}},
+    {"4k-i256", {"-b", "4096", "-I", "256"}},
+};
+
+#define errno_exit(str) \
+  do {                  \
+    int err = errno;    \
+    perror(str);        \
+    exit(err);          \
+  } while (0)
+
+extern char **environ;
+
+static uint64_t bytes_read;
+static uint64_t files_read;
+static char *read_buffer;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    errno_exit("clock_gettime");
+  }
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run(char *const argv[]) {
+  pid_t pid;
+  int err = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+  if (err != 0) {
+    errno = err;
+    errno_exit(argv[0]);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) == -1) {
+    errno_exit("waitpid");
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s failed\n", argv[0]);
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : ECHILD);
+  }
+}
+
+static void drop_caches(void) {
+  sync();
+  int fd = open(DROP_CACHES_PATH, O_WRONLY);
+  if (fd == -1) {
+    errno_exit(DROP_CACHES_PATH);
+  }
+  if (write(fd, "3", 1) != 1) {
+    errno_exit(DROP_CACHES_PATH);
+  }
+  close(fd);
+}
+
+static int read_file(const char *path, const struct stat *st, int type,
+                     struct FTW *ftw) {
+  (void)ftw;
+  if (type != FTW_F || !S_ISREG(st->st_mode)) {
+    return 0;
+  }
+
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    errno_exit(path);
+  }
+  ssize_t n;
+  while ((n = read(fd, read_buffer, READ_BUFFER_SIZE)) > 0) {
+    bytes_read += n;
+  }
+  if (n == -1) {
+    errno_exit(path);
+  }
+  close(fd);
+  files_read++;
+  return 0;
+}
+
+static void measure(const struct geometry *geometry, const char *source,
+                    const char *scratch) {
+  char image[PATH_MAX];
+  char mount_point[PATH_MAX];
+  snprintf(image, sizeof(image), "%s/geometry-bench.img", scratch);
+  snprintf(mount_point, sizeof(mount_point), "%s/geometry-bench.mnt",
+           scratch);
+  if (mkdir(mount_point, 0755) == -1 && errno != EEXIST) {
+    errno_exit(mount_point);
+  }
+
+  char *create[6 + MAX_GEOMETRY_ARGS + 1] = {
+      "./ext2-create", "-d", (char *)source, "-o", image,
+  };
+  int argc = 5;
+  for (int i = 0; i < MAX_GEOMETRY_ARGS && geometry->args[i] != NULL; i++) {
+    create[argc++] = (char *)geometry->args[i];
+  }
+  create[argc] = NULL;
+
+  uint64_t start = now_ns();
+  run(create);
+  double build_seconds = (now_ns() - start) / 1e9;
+
+  struct stat st;
+  if (stat(image, &st) == -1) {
+    errno_exit(image);
+  }
+
+  // The ext2 driver is gone from recent kernels, and ext4 reads ext2 fine
+  char *mount[] = {"mount", "-o", "loop,ro", "-t", "ext4", image, mount_point,
+                   NULL};
+  run(mount);
+
+  drop_caches();
+  bytes_read = 0;
+  files_read = 0;
+  start = now_ns();
+  if (nftw(mount_point, read_file, 64, FTW_PHYS) == -1) {
+    errno_exit("nftw");
+  }
+  double read_seconds = (now_ns() - start) / 1e9;
+
+  char *umount[] = {"umount", mount_point, NULL};
+  run(umount);
+  unlink(image);
+
+  printf("%-8s %10.3f %10.1f %10llu %10.0f %10.1f\n", geometry->name,
+         build_seconds, st.st_size / (1024.0 * 1024.0),
+         (unsigned long long)files_read, files_read / read_seconds,
+         bytes_read / (1024.0 * 1024.0) / read_seconds);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s SOURCE_DIR [SCRATCH_DIR]\n", argv[0]);
+    exit(EINVAL);
+  }
+  const char *scratch = argc > 2 ? argv[2] : "/tmp";
+
+  read_buffer = malloc(READ_BUFFER_SIZE);
+  if (read_buffer == NULL) {
+    errno_exit("malloc");
+  }
+
+  printf("%-8s %10s %10s %10s %10s %10s\n", "geometry", "build_s",
+         "image_MiB", "files", "files/s", "read_MiB/s");
+  for (size_t i = 0; i < sizeof(GEOMETRIES) / sizeof(GEOMETRIES[0]); i++) {
+    measure(&GEOMETRIES[i], argv[1], scratch);
+  }
+
+  free(read_buffer);
+  return 0;
+}
@@ -0,0 +1,180 @@
+// Builds an image of a tree of many small files with ext2-create, once with
+// synchronous I/O and once through io_uring, with cold caches each time.
+// Needs root to drop caches, and ext2-create built in the current directory.
+//
+// Build with `cc -O2 -o ext2-io-bench ext2-io-bench.c`, then run
+// `./ext2-io-bench TREE_DIR [FILES] [SCRATCH_DIR]`. The tree is generated
+// the first time, with FILES files (a million by default) of 512 bytes to
+// 8 KiB in directories of FILES_PER_DIR.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DROP_CACHES_PATH "/proc/sys/vm/drop_caches"
+#define DEFAULT_FILES 1000000
+#define FILES_PER_DIR 1000
+#define MIN_FILE_SIZE 512
+#define MAX_FILE_SIZE (8 * 1024)
+#define RUNS 3
+
+struct backend {
+  const char *name;
+  const char *queue_depth;
+};
+
+static const struct backend BACKENDS[] = {
+    {"sync", "0"},
+    {"io_uring", "64"},
+};
+
+#define errno_exit(str) \
+  do {                  \
+    int err = errno;    \
+    perror(str);        \
+    exit(err);          \
+  } while (0)
+
+extern char **environ;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    errno_exit("clock_gettime");
+  }
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run(char *const argv[]) {
+  pid_t pid;
+  int err = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+  if (err != 0) {
+    errno = err;
+    errno_exit(argv[0]);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) == -1) {
+    errno_exit("waitpid");
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s failed\n", argv[0]);
+    exit(WIFEXITED(status) ? WEXITSTATUS(status) : ECHILD);
+  }
+}
+
+static void drop_caches(void) {
+  sync();
+  int fd = open(DROP_CACHES_PATH, O_WRONLY);
+  if (fd == -1) {
+    errno_exit(DROP_CACHES_PATH);
+  }
+  if (write(fd, "3", 1) != 1) {
+    errno_exit(DROP_CACHES_PATH);
+  }
+  close(fd);
+}
+
+// Sizes and contents come from a fixed sequence, so every run of the
+// benchmark copies the same tree
+static void generate_tree(const char *tree, uint64_t files) {
+  static uint8_t data[MAX_FILE_SIZE];
+  uint64_t state = 0x9E3779B97F4A7C15ULL;
+  char path[PATH_MAX];
+
+  if (mkdir(tree, 0755) == -1) {
+    errno_exit(tree);
+  }
+  for (uint64_t i = 0; i < files; i++) {
+    if (i % FILES_PER_DIR == 0) {
+      snprintf(path, sizeof(path), "%s/%llu", tree,
+               (unsigned long long)(i / FILES_PER_DIR));
+      if (mkdir(path, 0755) == -1) {
+        errno_exit(path);
+      }
+    }
+
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    size_t size =
+        MIN_FILE_SIZE + (state >> 33) % (MAX_FILE_SIZE - MIN_FILE_SIZE);
+    memset(data, (int)(state >> 56), size);
+    memcpy(data, &i, sizeof(i));
+
+    snprintf(path, sizeof(path), "%s/%llu/%llu", tree,
+             (unsigned long long)(i / FILES_PER_DIR), (unsigned long long)i);
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd == -1) {
+      errno_exit(path);
+    }
+    if (write(fd, data, size) != (ssize_t)size) {
+      errno_exit(path);
+    }
+    close(fd);
+  }
+}
+
+static double measure(const struct backend *backend, const char *tree,
+                      const char *image) {
+  char *create[] = {"./ext2-create", "-d", (char *)tree, "-o", (char *)image,
+                    "-q", (char *)backend->queue_depth, NULL};
+  drop_caches();
+  uint64_t start = now_ns();
+  run(create);
+  double seconds = (now_ns() - start) / 1e9;
+  unlink(image);
+  return seconds;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s TREE_DIR [FILES] [SCRATCH_DIR]\n", argv[0]);
+    exit(EINVAL);
+  }
+  const char *tree = argv[1];
+  uint64_t files = argc > 2 ? strtoull(argv[2], NULL, 10) : DEFAULT_FILES;
+  const char *scratch = argc > 3 ? argv[3] : "/tmp";
+
+  struct stat st;
+  if (stat(tree, &st) == -1) {
+    if (errno != ENOENT) {
+      errno_exit(tree);
+    }
+    fprintf(stderr, "Generating %llu files in %s\n",
+            (unsigned long long)files, tree);
+    generate_tree(tree, files);
+  }
+
+  char image[PATH_MAX];
+  snprintf(image, sizeof(image), "%s/io-bench.img", scratch);
+
+  printf("%-8s %10s %10s %10s\n", "backend", "best_s", "median_s",
+         "files/s");
+  for (size_t i = 0; i < sizeof(BACKENDS) / sizeof(BACKENDS[0]); i++) {
+    double seconds[RUNS];
+    for (int r = 0; r < RUNS; r++) {
+      seconds[r] = measure(&BACKENDS[i], tree, image);
+    }
+    // Insertion sort, there are only a few runs
+    for (int r = 1; r < RUNS; r++) {
+      for (int j = r; j > 0 && seconds[j] < seconds[j - 1]; j--) {
+        double swap = seconds[j];
+        seconds[j] = seconds[j - 1];
+        seconds[j - 1] = swap;
+      }
+    }
+    printf("%-8s %10.3f %10.3f %10.0f\n", BACKENDS[i].name, seconds[0],
+           seconds[RUNS / 2], files / seconds[RUNS / 2]);
+  }
+  return 0;
+}
@@ -0,0 +1,890 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "ext2-read.h"
+
+#define EXT2_MAX_LOG_BLOCK_SIZE 6 /* 64 KiB */
+#define EXT2_GOOD_OLD_INODE_SIZE 128
+#define EXT2_S_IFMT 0xF000
+
+#define DIV_ROUND_UP(n, d) (((n) + (d)-1) / (d))
+
+/* The block cache */
+
+static u32 cache_bucket(u32 block) { return block % EXT2_CACHE_BLOCKS; }
+
+static void lru_unlink(struct ext2_image *image, u32 slot) {
+  struct ext2_cache_slot *entry = &image->slots[slot];
+  if (entry->prev != EXT2_NO_SLOT) {
+    image->slots[entry->prev].next = entry->next;
+  } else {
+    image->lru_first = entry->next;
+  }
+  if (entry->next != EXT2_NO_SLOT) {
+    image->slots[entry->next].prev = entry->prev;
+  } else {
+    image->lru_last = entry->prev;
+  }
+}
+
+static void lru_push_first(struct ext2_image *image, u32 slot) {
+  struct ext2_cache_slot *entry = &image->slots[slot];
+  entry->prev = EXT2_NO_SLOT;
+  entry->next = image->lru_first;
+  if (image->lru_first != EXT2_NO_SLOT) {
+    image->slots[image->lru_first].prev = slot;
+  } else {
+    image->lru_last = slot;
+  }
+  image->lru_first = slot;
+}
+
+static void chain_remove(struct ext2_image *image, u32 slot) {
+  u32 *link = &image->buckets[cache_bucket(image->slots[slot].block)];
+  while (*link != slot) {
+    link = &image->slots[*link].chain;
+  }
+  *link = image->slots[slot].chain;
+}
+
+static void cache_init(struct ext2_image *image) {
+  image->lru_first = image->lru_last = EXT2_NO_SLOT;
+  for (u32 slot = 0; slot < EXT2_CACHE_BLOCKS; slot++) {
+    image->buckets[slot] = EXT2_NO_SLOT;
+    image->slots[slot].valid = false;
+    lru_push_first(image, slot);
+  }
+}
+
+const u8 *ext2_read_block(struct ext2_image *image, u32 block) {
+  if (block >= image->superblock.s_blocks_count) {
+    errno = EUCLEAN;
+    return NULL;
+  }
+
+  u32 bucket = cache_bucket(block);
+  for (u32 slot = image->buckets[bucket]; slot != EXT2_NO_SLOT;
+       slot = image->slots[slot].chain) {
+    if (image->slots[slot].block == block) {
+      image->cache_hits++;
+      lru_unlink(image, slot);
+      lru_push_first(image, slot);
+      return image->cache_data + (size_t)slot * image->block_size;
+    }
+  }
+
+  /* Evict the least recently used block */
+  image->cache_misses++;
+  u32 slot = image->lru_last;
+  struct ext2_cache_slot *entry = &image->slots[slot];
+  if (entry->valid) {
+    chain_remove(image, slot);
+    entry->valid = false;
+  }
+
+  u8 *data = image->cache_data + (size_t)slot * image->block_size;
+  ssize_t bytes_read = pread(image->fd, data, image->block_size,
+                             (off_t)block * image->block_size);
+  if (bytes_read != (ssize_t)image->block_size) {
+    if (bytes_read >= 0) {
+      errno = EIO;
+    }
+    return NULL;
+  }
+
+  entry->block = block;
+  entry->valid = true;
+  entry->chain = image->buckets[bucket];
+  image->buckets[bucket] = slot;
+  lru_unlink(image, slot);
+  lru_push_first(image, slot);
+  return data;
+}
+
+/* Opening an image */
+
+static int read_superblock(struct ext2_image *image) {
+  struct ext2_superblock *superblock = &image->superblock;
+
+  /* 1024 bytes in, whatever the block size */
+  if (pread(image->fd, superblock, sizeof(*superblock), 1024) !=
+      sizeof(*superblock)) {
+    return EUCLEAN;
+  }
+  if (superblock->s_magic != EXT2_SUPER_MAGIC ||
+      superblock->s_log_block_size > EXT2_MAX_LOG_BLOCK_SIZE) {
+    return EUCLEAN;
+  }
+  image->block_size = 1024U << superblock->s_log_block_size;
+
+  bool dynamic = superblock->s_rev_level >= EXT2_DYNAMIC_REV;
+  image->inode_size =
+      dynamic ? superblock->s_inode_size : EXT2_GOOD_OLD_INODE_SIZE;
+  image->first_ino =
+      dynamic ? superblock->s_first_ino : EXT2_GOOD_OLD_FIRST_INO;
+  if (image->inode_size < EXT2_GOOD_OLD_INODE_SIZE ||
+      image->inode_size > image->block_size ||
+      (image->inode_size & (image->inode_size - 1)) != 0) {
+    return EUCLEAN;
+  }
+
+  u32 bits_per_block = image->block_size * 8;
+  if (superblock->s_blocks_per_group == 0 ||
+      superblock->s_blocks_per_group > bits_per_block ||
+      superblock->s_inodes_per_group == 0 ||
+      superblock->s_inodes_per_group > bits_per_block ||
+      superblock->s_first_data_block >= superblock->s_blocks_count) {
+    return EUCLEAN;
+  }
+  /* Every block has to be there, even if only as a hole */
+  if ((u64)superblock->s_blocks_count * image->block_size > image->size) {
+    return EUCLEAN;
+  }
+
+  image->group_count =
+      DIV_ROUND_UP(superblock->s_blocks_count - superblock->s_first_data_block,
+                   superblock->s_blocks_per_group);
+  if (superblock->s_inodes_count == 0 ||
+      superblock->s_inodes_count >
+          (u64)superblock->s_inodes_per_group * image->group_count) {
+    return EUCLEAN;
+  }
+  image->inode_table_blocks = DIV_ROUND_UP(
+      superblock->s_inodes_per_group * image->inode_size, image->block_size);
+  image->descriptor_blocks =
+      DIV_ROUND_UP(image->group_count * sizeof(*image->descriptors),
+                   image->block_size);
+  return 0;
+}
+
+static int read_descriptors(struct ext2_image *image) {
+  size_t size = (size_t)image->descriptor_blocks * image->block_size;
+  image->descriptors = malloc(size);
+  if (image->descriptors == NULL) {
+    return errno;
+  }
+
+  off_t offset =
+      (off_t)(image->superblock.s_first_data_block + 1) * image->block_size;
+  ssize_t bytes_read = pread(image->fd, image->descriptors, size, offset);
+  if (bytes_read == -1) {
+    return errno;
+  }
+  if ((size_t)bytes_read != size) {
+    return EIO;
+  }
+
+  for (u32 group = 0; group < image->group_count; group++) {
+    const struct ext2_block_group_descriptor *descriptor =
+        &image->descriptors[group];
+    u32 blocks_count = image->superblock.s_blocks_count;
+    if (descriptor->bg_block_bitmap >= blocks_count ||
+        descriptor->bg_inode_bitmap >= blocks_count ||
+        descriptor->bg_inode_table + image->inode_table_blocks >
+            blocks_count) {
+      return EUCLEAN;
+    }
+  }
+  return 0;
+}
+
+int ext2_open(struct ext2_image *image, const char *path) {
+  memset(image, 0, sizeof(*image));
+  image->fd = open(path, O_RDONLY);
+  if (image->fd == -1) {
+    return errno;
+  }
+
+  struct stat st;
+  int err = fstat(image->fd, &st) == -1 ? errno : 0;
+  if (err == 0) {
+    image->size = st.st_size;
+    err = read_superblock(image);
+  }
+  if (err == 0) {
+    err = read_descriptors(image);
+  }
+  if (err == 0) {
+    image->cache_data = malloc((size_t)EXT2_CACHE_BLOCKS * image->block_size);
+    if (image->cache_data == NULL) {
+      err = errno;
+    }
+  }
+
+  if (err != 0) {
+    ext2_close(image);
+    return err;
+  }
+  cache_init(image);
+  return 0;
+}
+
+void ext2_close(struct ext2_image *image) {
+  if (image->fd != -1) {
+    close(image->fd);
+    image->fd = -1;
+  }
+  free(image->descriptors);
+  free(image->cache_data);
+  image->descriptors = NULL;
+  image->cache_data = NULL;
+}
+
+/* Inodes and their contents */
+
+int ext2_read_inode(struct ext2_image *image, u32 ino,
+                    struct ext2_inode *inode) {
+  if (ino == 0 || ino > image->superblock.s_inodes_count) {
+    return EUCLEAN;
+  }
+
+  u32 group = (ino - 1) / image->superblock.s_inodes_per_group;
+  u32 index = (ino - 1) % image->superblock.s_inodes_per_group;
+  u64 offset = (u64)index * image->inode_size;
+  u32 block =
+      image->descriptors[group].bg_inode_table + offset / image->block_size;
+  const u8 *data = ext2_read_block(image, block);
+  if (data == NULL) {
+    return errno;
+  }
+
+  /* Anything past the rev 0 fields is ignored */
+  memcpy(inode, data + offset % image->block_size, sizeof(*inode));
+  return 0;
+}
+
+u64 ext2_inode_size(const struct ext2_inode *inode) {
+  u64 size = inode->i_size;
+  if ((inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFREG) {
+    size |= (u64)inode->i_dir_acl << 32;
+  }
+  return size;
+}
+
+int ext2_map_block(struct ext2_image *image, const struct ext2_inode *inode,
+                   u64 index, u32 *block) {
+  u64 per_block = image->block_size / sizeof(u32);
+  if (index < EXT2_NDIR_BLOCKS) {
+    *block = inode->i_block[index];
+    return 0;
+  }
+  index -= EXT2_NDIR_BLOCKS;
+
+  /* Find how many levels of tables map the block, and where it falls
+     among the blocks they map */
+  u32 depth = 1;
+  u64 span = per_block;
+  while (index >= span) {
+    index -= span;
+    span *= per_block;
+    if (++depth > 3) {
+      return EFBIG;
+    }
+  }
+
+  u32 table = inode->i_block[EXT2_IND_BLOCK + depth - 1];
+  for (; depth > 0 && table != 0; depth--) {
+    span /= per_block;
+    const u8 *data = ext2_read_block(image, table);
+    if (data == NULL) {
+      return errno;
+    }
+    table = ((const u32 *)data)[index / span];
+    index %= span;
+  }
+  *block = table;
+  return 0;
+}
+
+static bool is_fast_symlink(const struct ext2_inode *inode) {
+  return (inode->i_mode & EXT2_S_IFMT) == EXT2_S_IFLNK && inode->i_blocks == 0;
+}
+
+/* Visits the tree under one block pointer, indirect blocks first */
+static int walk_tree(struct ext2_image *image, u32 block, u32 depth,
+                     u32 *tables[], ext2_block_visitor visit, void *arg) {
+  if (block == 0) {
+    return 0;
+  }
+  visit(block, arg);
+  if (depth == 0) {
+    return 0;
+  }
+
+  const u8 *data = ext2_read_block(image, block);
+  if (data == NULL) {
+    return errno;
+  }
+  u32 *table = tables[depth - 1];
+  memcpy(table, data, image->block_size);
+  for (u32 i = 0; i < image->block_size / sizeof(u32); i++) {
+    int err = walk_tree(image, table[i], depth - 1, tables, visit, arg);
+    if (err != 0) {
+      return err;
+    }
+  }
+  return 0;
+}
+
+int ext2_inode_blocks(struct ext2_image *image, const struct ext2_inode *inode,
+                      ext2_block_visitor visit, void *arg) {
+  /* Devices and fast symlinks keep something else in i_block */
+  if (inode->i_blocks == 0) {
+    return 0;
+  }
+
+  u32 *tables[3];
+  u8 *buffer = malloc(3 * (size_t)image->block_size);
+  if (buffer == NULL) {
+    return ENOMEM;
+  }
+  for (u32 i = 0; i < 3; i++) {
+    tables[i] = (u32 *)(buffer + i * (size_t)image->block_size);
+  }
+
+  int err = 0;
+  for (u32 i = 0; i < EXT2_N_BLOCKS && err == 0; i++) {
+    u32 depth = i < EXT2_NDIR_BLOCKS ? 0 : i - EXT2_NDIR_BLOCKS + 1;
+    err = walk_tree(image, inode->i_block[i], depth, tables, visit, arg);
+  }
+  free(buffer);
+  return err;
+}
+
+ssize_t ext2_read_file(struct ext2_image *image,
+                       const struct ext2_inode *inode, void *buf, size_t size,
+                       u64 offset) {
+  u64 file_size = ext2_inode_size(inode);
+  if (offset >= file_size) {
+    return 0;
+  }
+  if (size > file_size - offset) {
+    size = file_size - offset;
+  }
+
+  /* The target is kept in i_block itself */
+  if (is_fast_symlink(inode)) {
+    if (offset + size > sizeof(inode->i_block)) {
+      errno = EUCLEAN;
+      return -1;
+    }
+    memcpy(buf, (const u8 *)inode->i_block + offset, size);
+    return size;
+  }
+
+  size_t done = 0;
+  while (done < size) {
+    u64 position = offset + done;
+    u32 within = position % image->block_size;
+    size_t chunk = image->block_size - within;
+    if (chunk > size - done) {
+      chunk = size - done;
+    }
+
+    u32 block;
+    int err = ext2_map_block(image, inode, position / image->block_size,
+                             &block);
+    if (err != 0) {
+      errno = err;
+      return -1;
+    }
+    if (block == 0) {
+      memset((u8 *)buf + done, 0, chunk);
+    } else {
+      const u8 *data = ext2_read_block(image, block);
+      if (data == NULL) {
+        return -1;
+      }
+      memcpy((u8 *)buf + done, data + within, chunk);
+    }
+    done += chunk;
+  }
+  return done;
+}
+
+/* Directories */
+
+static u32 entry_name_len(const struct ext2_image *image,
+                          const struct ext2_dir_entry *entry) {
+  if (image->superblock.s_feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE) {
+    return entry->name_len & 0xFF;
+  }
+  return entry->name_len;
+}
+
+/* Index blocks of dir_index directories look like unused entries, so they
+   are skipped */
+int ext2_dir_iterate(struct ext2_image *image, const struct ext2_inode *dir,
+                     ext2_dir_visitor visit, void *arg) {
+  u64 size = ext2_inode_size(dir);
+  if (size % image->block_size != 0) {
+    return EUCLEAN;
+  }
+
+  for (u64 index = 0; index < size / image->block_size; index++) {
+    u32 block;
+    int err = ext2_map_block(image, dir, index, &block);
+    if (err != 0) {
+      return err;
+    }
+    if (block == 0) {
+      return EUCLEAN;
+    }
+    const u8 *data = ext2_read_block(image, block);
+    if (data == NULL) {
+      return errno;
+    }
+
+    for (u32 offset = 0; offset < image->block_size;) {
+      const struct ext2_dir_entry *entry =
+          (const struct ext2_dir_entry *)(data + offset);
+      if (image->block_size - offset < 8 || entry->rec_len < 8 ||
+          entry->rec_len % 4 != 0 ||
+          entry->rec_len > image->block_size - offset ||
+          entry_name_len(image, entry) + 8 > entry->rec_len) {
+        return EUCLEAN;
+      }
+      if (entry->inode != 0 &&
+          visit(entry, entry_name_len(image, entry), arg)) {
+        return 0;
+      }
+      offset += entry->rec_len;
+    }
+  }
+  return 0;
+}
+
+struct lookup {
+  const char *name;
+  size_t name_len;
+  u32 ino;
+};
+
+static bool lookup_visit(const struct ext2_dir_entry *entry, u32 name_len,
+                         void *arg) {
+  struct lookup *lookup = arg;
+  if (name_len != lookup->name_len ||
+      memcmp(entry->name, lookup->name, lookup->name_len) != 0) {
+    return false;
+  }
+  lookup->ino = entry->inode;
+  return true;
+}
+
+/* Symlinks along the way aren't followed */
+int ext2_lookup(struct ext2_image *image, const char *path, u32 *ino) {
+  u32 current = EXT2_ROOT_INO;
+
+  for (;;) {
+    path += strspn(path, "/");
+    if (*path == '\0') {
+      break;
+    }
+
+    struct ext2_inode inode;
+    int err = ext2_read_inode(image, current, &inode);
+    if (err != 0) {
+      return err;
+    }
+    if ((inode.i_mode & EXT2_S_IFMT) != EXT2_S_IFDIR) {
+      return ENOTDIR;
+    }
+
+    struct lookup lookup = {path, strcspn(path, "/"), 0};
+    err = ext2_dir_iterate(image, &inode, lookup_visit, &lookup);
+    if (err != 0) {
+      return err;
+    }
+    if (lookup.ino == 0) {
+      return ENOENT;
+    }
+    current = lookup.ino;
+    path += lookup.name_len;
+  }
+
+  *ino = current;
+  return 0;
+}
+
+/* Checking consistency */
+
+struct checker {
+  struct ext2_image *image;
+  FILE *report;
+  u32 problems;
+
+  /* Blocks reached from the group metadata or an inode, by bitmap bit */
+  u8 *reached;
+  /* Directory entries naming each inode, and the links each one claims */
+  u32 *refs;
+  u16 *links;
+  u32 *used_dirs;
+  u8 *bitmap;
+  /* Copies of the indirect blocks being walked, one per level */
+  u32 *tables[3];
+};
+
+__attribute__((format(printf, 2, 3))) static void
+problem(struct checker *checker, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  fputs("  ", checker->report);
+  vfprintf(checker->report, format, args);
+  fputc('\n', checker->report);
+  va_end(args);
+  checker->problems++;
+}
+
+static bool group_has_super(const struct ext2_image *image, u32 group) {
+  if (!(image->superblock.s_feature_ro_compat &
+        EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER) ||
+      group <= 1) {
+    return true;
+  }
+  for (u32 base = 3; base <= 7; base += 2) {
+    u32 power = base;
+    while (power < group) {
+      power *= base;
+    }
+    if (power == group) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static u32 group_first_block(const struct ext2_image *image, u32 group) {
+  return image->superblock.s_first_data_block +
+         group * image->superblock.s_blocks_per_group;
+}
+
+static u32 group_block_count(const struct ext2_image *image, u32 group) {
+  u32 left = image->superblock.s_blocks_count - group_first_block(image, group);
+  return left < image->superblock.s_blocks_per_group
+             ? left
+             : image->superblock.s_blocks_per_group;
+}
+
+/* Returns whether the block is in range and wasn't already reached */
+static bool claim_block(struct checker *checker, u32 block, u32 ino) {
+  const struct ext2_superblock *superblock = &checker->image->superblock;
+  if (block < superblock->s_first_data_block ||
+      block >= superblock->s_blocks_count) {
+    problem(checker, "inode %u: block %u is out of range", ino, block);
+    return false;
+  }
+
+  u32 bit = block - superblock->s_first_data_block;
+  if (bitmap_test(checker->reached, bit)) {
+    if (ino == 0) {
+      problem(checker, "metadata block %u is used twice", block);
+    } else {
+      problem(checker, "inode %u: block %u is already in use", ino, block);
+    }
+    return false;
+  }
+  bitmap_set_range(checker->reached, bit, bit + 1);
+  return true;
+}
+
+static void claim_metadata(struct checker *checker) {
+  const struct ext2_image *image = checker->image;
+
+  for (u32 group = 0; group < image->group_count; group++) {
+    const struct ext2_block_group_descriptor *descriptor =
+        &image->descriptors[group];
+    u32 first = group_first_block(image, group);
+    if (group_has_super(image, group)) {
+      for (u32 i = 0; i < 1 + image->descriptor_blocks; i++) {
+        claim_block(checker, first + i, 0);
+      }
+    }
+    claim_block(checker, descriptor->bg_block_bitmap, 0);
+    claim_block(checker, descriptor->bg_inode_bitmap, 0);
+    for (u32 i = 0; i < image->inode_table_blocks; i++) {
+      claim_block(checker, descriptor->bg_inode_table + i, 0);
+    }
+  }
+}
+
+/* Claims the block and, for indirect blocks, everything it maps */
+static int claim_tree(struct checker *checker, u32 ino, u32 block, u32 depth,
+                      u64 *count) {
+  if (block == 0 || !claim_block(checker, block, ino)) {
+    return 0;
+  }
+  (*count)++;
+  if (depth == 0) {
+    return 0;
+  }
+
+  struct ext2_image *image = checker->image;
+  const u8 *data = ext2_read_block(image, block);
+  if (data == NULL) {
+    return errno;
+  }
+  /* Deeper levels read more blocks, which could evict this one */
+  u32 *table = checker->tables[depth - 1];
+  memcpy(table, data, image->block_size);
+
+  for (u32 i = 0; i < image->block_size / sizeof(u32); i++) {
+    int err = claim_tree(checker, ino, table[i], depth - 1, count);
+    if (err != 0) {
+      return err;
+    }
+  }
+  return 0;
+}
+
+static bool count_ref(const struct ext2_dir_entry *entry, u32 name_len,
+                      void *arg) {
+  struct checker *checker = arg;
+  if (entry->inode > checker->image->superblock.s_inodes_count) {
+    problem(checker, "entry %.*s names inode %u, which doesn't exist",
+            (int)name_len, entry->name, entry->inode);
+  } else {
+    checker->refs[entry->inode]++;
+  }
+  return false;
+}
+
+static void check_inode(struct checker *checker, u32 ino, bool marked) {
+  struct ext2_image *image = checker->image;
+  struct ext2_inode inode;
+  int err = ext2_read_inode(image, ino, &inode);
+  if (err != 0) {
+    problem(checker, "inode %u: %s", ino, strerror(err));
+    return;
+  }
+
+  bool reserved = ino < image->first_ino && ino != EXT2_ROOT_INO;
+  bool live = reserved ? inode.i_blocks != 0 : inode.i_links_count != 0;
+  if (reserved && !marked) {
+    problem(checker, "reserved inode %u is marked free", ino);
+  } else if (!reserved && live != marked) {
+    problem(checker, "inode %u is %s but marked %s", ino,
+            live ? "in use" : "unused", marked ? "used" : "free");
+  }
+  if (!live) {
+    return;
+  }
+  checker->links[ino] = inode.i_links_count;
+
+  u32 type = inode.i_mode & EXT2_S_IFMT;
+  bool has_blocks = type == EXT2_S_IFREG || type == EXT2_S_IFDIR ||
+                    (type == EXT2_S_IFLNK && !is_fast_symlink(&inode)) ||
+                    reserved;
+  if (!has_blocks) {
+    return;
+  }
+
+  u64 count = 0;
+  for (u32 i = 0; i < EXT2_N_BLOCKS && err == 0; i++) {
+    u32 depth = i < EXT2_NDIR_BLOCKS ? 0 : i - EXT2_NDIR_BLOCKS + 1;
+    err = claim_tree(checker, ino, inode.i_block[i], depth, &count);
+  }
+  if (err != 0) {
+    problem(checker, "inode %u: %s", ino, strerror(err));
+    return;
+  }
+  u64 sectors = count * (image->block_size / 512);
+  if (inode.i_blocks != sectors) {
+    problem(checker, "inode %u: i_blocks is %u, but it has %llu sectors", ino,
+            inode.i_blocks, (unsigned long long)sectors);
+  }
+
+  if (type == EXT2_S_IFDIR) {
+    checker->used_dirs[(ino - 1) / image->superblock.s_inodes_per_group]++;
+    err = ext2_dir_iterate(image, &inode, count_ref, checker);
+    if (err != 0) {
+      problem(checker, "directory %u: %s", ino, strerror(err));
+    }
+  }
+}
+
+/* Reports runs of blocks where the bitmap disagrees with what was reached */
+static void compare_block_bitmap(struct checker *checker, u32 group) {
+  const struct ext2_image *image = checker->image;
+  u32 first = group_first_block(image, group);
+  u32 base = first - image->superblock.s_first_data_block;
+  u32 count = group_block_count(image, group);
+
+  u32 run_start = 0;
+  int run_kind = 0;
+  for (u32 bit = 0; bit <= count; bit++) {
+    int kind = 0;
+    if (bit < count) {
+      bool marked = bitmap_test(checker->bitmap, bit);
+      bool reached = bitmap_test(checker->reached, base + bit);
+      kind = marked == reached ? 0 : marked ? 1 : 2;
+    }
+    if (kind == run_kind) {
+      continue;
+    }
+    const char *state = run_kind == 1 ? "marked used but unreachable"
+                                      : "in use but marked free";
+    if (run_kind != 0 && bit - run_start == 1) {
+      problem(checker, "block %u is %s", first + run_start, state);
+    } else if (run_kind != 0) {
+      problem(checker, "blocks %u-%u are %s", first + run_start,
+              first + bit - 1, state);
+    }
+    run_start = bit;
+    run_kind = kind;
+  }
+}
+
+static u32 count_clear(const u8 *bitmap, u32 count) {
+  return count - bitmap_count(bitmap, 0, count);
+}
+
+/* The bits past the end of the group should all be set */
+static void check_padding(struct checker *checker, u32 group, u32 count,
+                          const char *name) {
+  u32 bits = checker->image->block_size * 8;
+  if (count_clear(checker->bitmap, bits) !=
+      count_clear(checker->bitmap, count)) {
+    problem(checker, "group %u: padding at the end of the %s bitmap is clear",
+            group, name);
+  }
+}
+
+/* Copies a bitmap block, since checking inodes reads many more blocks */
+static bool load_bitmap(struct checker *checker, u32 block) {
+  const u8 *data = ext2_read_block(checker->image, block);
+  if (data == NULL) {
+    problem(checker, "bitmap block %u: %s", block, strerror(errno));
+    return false;
+  }
+  memcpy(checker->bitmap, data, checker->image->block_size);
+  return true;
+}
+
+static void check_groups(struct checker *checker) {
+  struct ext2_image *image = checker->image;
+  const struct ext2_superblock *superblock = &image->superblock;
+  u64 free_blocks = 0;
+  u64 free_inodes = 0;
+
+  for (u32 group = 0; group < image->group_count; group++) {
+    const struct ext2_block_group_descriptor *descriptor =
+        &image->descriptors[group];
+
+    u32 first_ino = group * superblock->s_inodes_per_group + 1;
+    u32 inode_count = superblock->s_inodes_per_group;
+    if (first_ino > superblock->s_inodes_count) {
+      inode_count = 0;
+    } else if (superblock->s_inodes_count - first_ino < inode_count) {
+      inode_count = superblock->s_inodes_count - first_ino + 1;
+    }
+    if (load_bitmap(checker, descriptor->bg_inode_bitmap)) {
+      for (u32 i = 0; i < inode_count; i++) {
+        check_inode(checker, first_ino + i, bitmap_test(checker->bitmap, i));
+      }
+      u32 free = count_clear(checker->bitmap, superblock->s_inodes_per_group);
+      if (free != descriptor->bg_free_inodes_count) {
+        problem(checker, "group %u: %u free inodes, but %u are counted",
+                group, free, descriptor->bg_free_inodes_count);
+      }
+      check_padding(checker, group, superblock->s_inodes_per_group, "inode");
+      free_inodes += free;
+    }
+    if (checker->used_dirs[group] != descriptor->bg_used_dirs_count) {
+      problem(checker, "group %u: %u directories, but %u are counted", group,
+              checker->used_dirs[group], descriptor->bg_used_dirs_count);
+    }
+  }
+
+  /* Blocks are compared once every inode has been walked */
+  for (u32 group = 0; group < image->group_count; group++) {
+    const struct ext2_block_group_descriptor *descriptor =
+        &image->descriptors[group];
+    if (!load_bitmap(checker, descriptor->bg_block_bitmap)) {
+      continue;
+    }
+    u32 count = group_block_count(image, group);
+    compare_block_bitmap(checker, group);
+    u32 free = count_clear(checker->bitmap, count);
+    if (free != descriptor->bg_free_blocks_count) {
+      problem(checker, "group %u: %u free blocks, but %u are counted", group,
+              free, descriptor->bg_free_blocks_count);
+    }
+    check_padding(checker, group, count, "block");
+    free_blocks += free;
+  }
+
+  if (free_blocks != superblock->s_free_blocks_count) {
+    problem(checker, "%llu free blocks, but the superblock counts %u",
+            (unsigned long long)free_blocks, superblock->s_free_blocks_count);
+  }
+  if (free_inodes != superblock->s_free_inodes_count) {
+    problem(checker, "%llu free inodes, but the superblock counts %u",
+            (unsigned long long)free_inodes, superblock->s_free_inodes_count);
+  }
+}
+
+static void check_links(struct checker *checker) {
+  const struct ext2_image *image = checker->image;
+  for (u32 ino = EXT2_ROOT_INO; ino <= image->superblock.s_inodes_count;
+       ino++) {
+    if (ino != EXT2_ROOT_INO && ino < image->first_ino) {
+      continue;
+    }
+    if (checker->refs[ino] != checker->links[ino]) {
+      problem(checker, "inode %u has %u links, but %u entries name it", ino,
+              checker->links[ino], checker->refs[ino]);
+    }
+  }
+}
+
+u32 ext2_check(struct ext2_image *image, FILE *report) {
+  const struct ext2_superblock *superblock = &image->superblock;
+  struct checker checker = {0};
+  checker.image = image;
+  checker.report = report;
+
+  u32 inode_slots = superblock->s_inodes_count + 1;
+  /* Whole words, for the bitmap functions */
+  checker.reached = calloc(
+      DIV_ROUND_UP(superblock->s_blocks_count - superblock->s_first_data_block,
+                   64),
+      sizeof(u64));
+  checker.refs = calloc(inode_slots, sizeof(u32));
+  checker.links = calloc(inode_slots, sizeof(u16));
+  checker.used_dirs = calloc(image->group_count, sizeof(u32));
+  checker.bitmap = malloc(image->block_size);
+  bool allocated = checker.reached != NULL && checker.refs != NULL &&
+                   checker.links != NULL && checker.used_dirs != NULL &&
+                   checker.bitmap != NULL;
+  for (u32 i = 0; i < 3; i++) {
+    checker.tables[i] = malloc(image->block_size);
+    allocated = allocated && checker.tables[i] != NULL;
+  }
+
+  if (!allocated) {
+    problem(&checker, "%s", strerror(ENOMEM));
+  } else {
+    claim_metadata(&checker);
+    check_groups(&checker);
+    check_links(&checker);
+  }
+
+  free(checker.reached);
+  free(checker.refs);
+  free(checker.links);
+  free(checker.used_dirs);
+  free(checker.bitmap);
+  for (u32 i = 0; i < 3; i++) {
+    free(checker.tables[i]);
+  }
+  return checker.problems;
+}
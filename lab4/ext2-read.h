@@ -0,0 +1,84 @@
+/* Read-only access to ext2 images from userspace, so they can be checked
+   without mounting them or running fsck */
+
+#ifndef EXT2_READ_H
+#define EXT2_READ_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "ext2.h"
+
+#define EXT2_CACHE_BLOCKS 64
+#define EXT2_NO_SLOT UINT32_MAX
+
+/* A cached block, kept in a hash chain and on the LRU list */
+struct ext2_cache_slot {
+  u32 block;
+  u32 chain;
+  /* Most recently used first */
+  u32 prev;
+  u32 next;
+  bool valid;
+};
+
+struct ext2_image {
+  int fd;
+  u64 size;
+  u32 block_size;
+  u32 group_count;
+  u32 inode_size;
+  u32 first_ino;
+  u32 inode_table_blocks;
+  u32 descriptor_blocks;
+  struct ext2_superblock superblock;
+  struct ext2_block_group_descriptor *descriptors;
+
+  struct ext2_cache_slot slots[EXT2_CACHE_BLOCKS];
+  u32 buckets[EXT2_CACHE_BLOCKS];
+  u32 lru_first;
+  u32 lru_last;
+  u8 *cache_data;
+  u64 cache_hits;
+  u64 cache_misses;
+};
+
+/* These return 0 or an errno value, EUCLEAN if the image is corrupt */
+int ext2_open(struct ext2_image *image, const char *path);
+void ext2_close(struct ext2_image *image);
+int ext2_read_inode(struct ext2_image *image, u32 ino,
+                    struct ext2_inode *inode);
+/* Block 0 stands for a hole */
+int ext2_map_block(struct ext2_image *image, const struct ext2_inode *inode,
+                   u64 index, u32 *block);
+int ext2_lookup(struct ext2_image *image, const char *path, u32 *ino);
+
+/* Calls `visit` on each entry in a directory until it returns true */
+typedef bool (*ext2_dir_visitor)(const struct ext2_dir_entry *entry,
+                                 u32 name_len, void *arg);
+int ext2_dir_iterate(struct ext2_image *image, const struct ext2_inode *dir,
+                     ext2_dir_visitor visit, void *arg);
+
+/* Calls `visit` on every block an inode owns, indirect blocks included */
+typedef void (*ext2_block_visitor)(u32 block, void *arg);
+int ext2_inode_blocks(struct ext2_image *image, const struct ext2_inode *inode,
+                      ext2_block_visitor visit, void *arg);
+
+/* NULL with errno set on failure. The block stays valid until the next read
+   from the image. */
+const u8 *ext2_read_block(struct ext2_image *image, u32 block);
+
+/* Like pread, returning the number of bytes read or -1 with errno set */
+ssize_t ext2_read_file(struct ext2_image *image,
+                       const struct ext2_inode *inode, void *buf, size_t size,
+                       u64 offset);
+
+u64 ext2_inode_size(const struct ext2_inode *inode);
+
+/* Compares the bitmaps and free counts against the blocks and inodes that
+   are reachable, and link counts against directory entries. Describes each
+   problem on `report` and returns how many there were. */
+u32 ext2_check(struct ext2_image *image, FILE *report);
+
+#endif
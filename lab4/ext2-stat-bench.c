@@ -0,0 +1,158 @@
+// Measures stat() latency on names in one big directory of a mounted image,
+// to compare images made by ext2-create with and without -i. Mount each with
+// `mount -o loop,ro -t ext4 IMAGE DIR`, since the ext2 driver reads indexed
+// directories linearly. Caches are dropped before each pass so names are
+// looked up in the directory again, which needs root.
+//
+// Build with `cc -O2 -o ext2-stat-bench ext2-stat-bench.c`.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DROP_CACHES_PATH "/proc/sys/vm/drop_caches"
+#define DEFAULT_LOOKUPS 1000
+
+#define errno_exit(str) \
+  do {                  \
+    int err = errno;    \
+    perror(str);        \
+    exit(err);          \
+  } while (0)
+
+static void drop_caches(void) {
+  sync();
+  int fd = open(DROP_CACHES_PATH, O_WRONLY);
+  if (fd == -1 || write(fd, "3", 1) != 1) {
+    // Still worth measuring, but later passes find the names cached
+    perror(DROP_CACHES_PATH);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    errno_exit("clock_gettime");
+  }
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *left, const void *right) {
+  uint64_t l = *(const uint64_t *)left;
+  uint64_t r = *(const uint64_t *)right;
+  return (l > r) - (l < r);
+}
+
+static char **read_names(int dir_fd, long *count) {
+  DIR *dir = fdopendir(dup(dir_fd));
+  if (dir == NULL) {
+    errno_exit("fdopendir");
+  }
+
+  char **names = NULL;
+  long capacity = 0;
+  *count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (*count == capacity) {
+      capacity = capacity == 0 ? 1024 : capacity * 2;
+      names = realloc(names, capacity * sizeof(char *));
+      if (names == NULL) {
+        errno_exit("realloc");
+      }
+    }
+    names[(*count)++] = strdup(entry->d_name);
+  }
+  closedir(dir);
+  return names;
+}
+
+// Hits stat names from the directory, misses stat names that aren't there,
+// which a linear directory can only rule out by reading all of it
+static void measure(int dir_fd, char **names, long count, long lookups,
+                    int hit) {
+  uint64_t *samples = calloc(lookups, sizeof(uint64_t));
+  if (samples == NULL) {
+    errno_exit("calloc");
+  }
+
+  drop_caches();
+  for (long i = 0; i < lookups; i++) {
+    char missing[32];
+    const char *name = names[i % count];
+    if (!hit) {
+      snprintf(missing, sizeof(missing), "missing-%ld", i);
+      name = missing;
+    }
+
+    struct stat st;
+    uint64_t start = now_ns();
+    int ret = fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW);
+    samples[i] = now_ns() - start;
+    if ((ret == 0) != hit) {
+      errno_exit(name);
+    }
+  }
+  qsort(samples, lookups, sizeof(uint64_t), compare_u64);
+
+  printf("%-8ld %-6s %10.1f %10.1f %10.1f\n", count, hit ? "hit" : "miss",
+         samples[lookups / 2] / 1e3, samples[lookups * 99 / 100] / 1e3,
+         samples[lookups - 1] / 1e3);
+  free(samples);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s DIR [LOOKUPS]\n", argv[0]);
+    exit(EINVAL);
+  }
+  long lookups = argc > 2 ? strtol(argv[2], NULL, 10) : DEFAULT_LOOKUPS;
+  if (lookups < 1) {
+    lookups = DEFAULT_LOOKUPS;
+  }
+
+  int dir_fd = open(argv[1], O_RDONLY | O_DIRECTORY);
+  if (dir_fd == -1) {
+    errno_exit("open");
+  }
+  long count;
+  char **names = read_names(dir_fd, &count);
+  if (count == 0) {
+    fprintf(stderr, "%s: empty directory\n", argv[1]);
+    exit(EINVAL);
+  }
+
+  // Spread lookups across the directory rather than in readdir order
+  srand(1);
+  for (long i = count - 1; i > 0; i--) {
+    long j = rand() % (i + 1);
+    char *name = names[i];
+    names[i] = names[j];
+    names[j] = name;
+  }
+
+  printf("%-8s %-6s %10s %10s %10s\n", "entries", "kind", "p50_us", "p99_us",
+         "max_us");
+  measure(dir_fd, names, count, lookups, 1);
+  measure(dir_fd, names, count, lookups, 0);
+
+  for (long i = 0; i < count; i++) {
+    free(names[i]);
+  }
+  free(names);
+  close(dir_fd);
+  return 0;
+}